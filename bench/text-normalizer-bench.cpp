@@ -0,0 +1,167 @@
+// Compares TextNormalizer against piperTextPreprocess, the multi-pass
+// function it replaced in paroli-server, on the same inputs.
+//
+//   cmake .. -DPAROLI_BUILD_BENCH=ON ... && make paroli-bench
+//   ./paroli-bench
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "text-normalizer.hpp"
+
+namespace {
+
+// piperTextPreprocess as it was, kept as the baseline
+std::string replaceAll(std::string_view str, std::string_view from,
+                       std::string_view to) {
+  std::string result;
+  result.reserve(str.size());
+  size_t last = 0;
+  while (true) {
+    auto next = str.find(from, last);
+    if (next == std::string_view::npos) {
+      result += str.substr(last);
+      break;
+    }
+    result += str.substr(last, next - last);
+    result += to;
+    last = next + from.size();
+  }
+  return result;
+}
+
+std::string piperTextPreprocess(std::string text) {
+  // trim leading and tailing spaces
+  auto first = text.find_first_not_of(" \n\r\t");
+  if (first != std::string::npos)
+    text = text.substr(first);
+  auto last = text.find_last_not_of(" \n\r\t");
+  if (last != std::string::npos)
+    text = text.substr(0, last + 1);
+
+  if (text.empty()) {
+    text = ",";
+    return text;
+  }
+
+  // append a comma if the text does not end with a punctuation
+  const char *punctuation = ".,!?;:";
+  bool has_punctuation = (strchr(punctuation, text.back()) != nullptr);
+  if (!has_punctuation)
+    text += ",";
+
+  // Piper have no idea how to process ... and .. so we convert them to ,
+  std::string result;
+  size_t i = 0;
+  while (i < text.size()) {
+    auto ch = text[i];
+    if (ch == '.') {
+      size_t count = 1;
+      while (i + count < text.size() && text[i + count] == '.')
+        count++;
+      if (count == 1)
+        result += '.';
+      else
+        result += ',';
+      i += count - 1;
+    } else {
+      result += ch;
+    }
+    i++;
+  }
+
+  // Handle stupid unicode characters that piper can't handle
+  result = replaceAll(result, "…", ",");
+  result = replaceAll(result, "“", "\"");
+  result = replaceAll(result, "”", "\"");
+  result = replaceAll(result, "‘", "'");
+  result = replaceAll(result, "’", "'");
+  result = replaceAll(result, "—", ", ");
+  result = replaceAll(result, " - ", ", ");
+  return result;
+}
+
+const std::vector<std::string> &inputs() {
+  static const std::vector<std::string> texts = [] {
+    const std::string sentence =
+        "“Well…” she said — it’s late... isn’t it? The train - as usual - "
+        "was late.. ‘Again’, he replied. ";
+    std::string paragraph;
+    while (paragraph.size() < 4096) {
+      paragraph += sentence;
+    }
+    std::string plain;
+    while (plain.size() < 4096) {
+      plain += "To be or not to be, that is the question. ";
+    }
+    return std::vector<std::string>{
+        "  Hello world  ",
+        sentence,
+        paragraph,
+        plain,
+    };
+  }();
+  return texts;
+}
+
+void BM_PiperTextPreprocess(benchmark::State &state) {
+  const auto &text = inputs()[state.range(0)];
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(piperTextPreprocess(text));
+  }
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+
+// Allocates the result like the old function did
+void BM_TextNormalizer(benchmark::State &state) {
+  const auto &text = inputs()[state.range(0)];
+  piper::TextNormalizer normalizer;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(normalizer.normalize(text));
+  }
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+
+// Reuses one buffer, as paroli-cli does
+void BM_TextNormalizerReuse(benchmark::State &state) {
+  const auto &text = inputs()[state.range(0)];
+  piper::TextNormalizer normalizer;
+  std::string out;
+  for (auto _ : state) {
+    normalizer.normalize(text, out);
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+
+// Short text, one sentence, 4 KiB with replacements, 4 KiB without
+BENCHMARK(BM_PiperTextPreprocess)->DenseRange(0, 3);
+BENCHMARK(BM_TextNormalizer)->DenseRange(0, 3);
+BENCHMARK(BM_TextNormalizerReuse)->DenseRange(0, 3);
+
+} // namespace
+
+int main(int argc, char **argv) {
+  // Timing different results would be meaningless
+  piper::TextNormalizer normalizer;
+  for (const auto &text : inputs()) {
+    if (normalizer.normalize(text) != piperTextPreprocess(text)) {
+      std::cerr << "Outputs differ for: " << text << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return EXIT_FAILURE;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return EXIT_SUCCESS;
+}
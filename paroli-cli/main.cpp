@@ -1,7 +1,11 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <functional>
+#include <future>
+#include <iomanip>
 #include <iostream>
 #include <map>
 #include <sstream>
@@ -29,7 +33,10 @@
 #include <spdlog/spdlog.h>
 
 #include <nlohmann/json.hpp>
+#include "audio-store.hpp"
+#include "phoneme-corpus.hpp"
 #include "piper.hpp"
+#include "wavfile.hpp"
 
 using namespace std;
 using json = nlohmann::json;
@@ -65,6 +72,9 @@ struct RunConfig {
   // Variation in phoneme lengths
   optional<float> noiseW;
 
+  // Seed for the synthesis noise, makes output reproducible
+  optional<uint64_t> seed;
+
   // Seconds of silence to add after each sentence
   optional<float> sentenceSilenceSeconds;
 
@@ -75,12 +85,23 @@ struct RunConfig {
   // https://github.com/mush42/libtashkeel/
   optional<filesystem::path> tashkeelModelPath;
 
+  // Number of diacritized sentences to cache (0 disables the cache)
+  optional<size_t> tashkeelCacheSize;
+
+  // Memory for synthesized sentence audio in MiB (0 disables the cache)
+  size_t sentenceCacheSize = 0;
+
+  // Stretch cached sentences whose length scale is off by at most this
+  // fraction, instead of synthesizing them (0 disables it)
+  float timeStretchTolerance = 0;
+
   // stdin input is lines of JSON instead of text with format:
   // {
   //   "text": str,               (required)
   //   "speaker_id": int,         (optional)
   //   "speaker": str,            (optional)
   //   "output_file": str,        (optional)
+  //   "seed": int,               (optional)
   // }
   bool jsonInput = false;
 
@@ -90,13 +111,44 @@ struct RunConfig {
   // Set to whatever accelerator is available for ONNX. Ex: "cuda"
   // This has 0 affect if the underlying model is not handled by ONNX.
   std::string accelerator = "";
+
+  // Directory to cache optimized models in, for faster startup (disabled if
+  // not set)
+  optional<filesystem::path> modelCachePath;
+
+  // Rounds of warmup inference before the first input (0 to disable)
+  size_t warmupRounds = 0;
+
+  // Directory of the persistent audio store, shared with paroli-server
+  optional<filesystem::path> audioStorePath;
+
+  // Size limit of the audio store in MiB
+  size_t audioStoreSize = 1024;
+
+  // Only phonemize the input lines, into this phoneme corpus file. The
+  // encoder and decoder are not loaded.
+  optional<filesystem::path> phonemizeToPath;
+
+  // Synthesize the entries of this phoneme corpus instead of reading stdin,
+  // into <entry>.wav files of the output directory
+  optional<filesystem::path> corpusPath;
+
+  // Entries [begin, end) of the corpus to synthesize
+  size_t corpusBegin = 0;
+  optional<size_t> corpusEnd;
+
+  // Corpus entries synthesized in parallel
+  size_t jobs = 1;
 };
 
 void parseArgs(int argc, char *argv[], RunConfig &runConfig);
+void phonemizeCorpus(piper::PiperConfig &piperConfig, piper::Voice &voice,
+                     const RunConfig &runConfig);
+size_t synthesizeCorpus(piper::Voice &voice, const RunConfig &runConfig);
 // ----------------------------------------------------------------------------
 
 int main(int argc, char *argv[]) {
-  spdlog::set_default_logger(spdlog::stderr_color_st("paroli"));
+  spdlog::set_default_logger(spdlog::stderr_color_mt("paroli"));
 
   RunConfig runConfig;
   parseArgs(argc, argv, runConfig);
@@ -113,13 +165,22 @@ int main(int argc, char *argv[]) {
   spdlog::debug("Encoder model: {}", runConfig.encoderPath.string());
   spdlog::debug("Decoder model: {}", runConfig.decoderPath.string());
 
+  if (runConfig.modelCachePath) {
+    piperConfig.optimizedModelCachePath = runConfig.modelCachePath->string();
+  }
+
   auto startTime = chrono::steady_clock::now();
-  loadVoice(piperConfig, "", runConfig.encoderPath.string(), runConfig.decoderPath.string(),
-            runConfig.modelConfigPath.string(), voice, runConfig.speakerId,
-            runConfig.accelerator);
-  auto endTime = chrono::steady_clock::now();
-  spdlog::info("Loaded voice in {} second(s)",
-               chrono::duration<double>(endTime - startTime).count());
+  loadVoiceConfig(runConfig.modelConfigPath.string(), voice,
+                  runConfig.speakerId);
+  // The models load while eSpeak and libtashkeel are initialized
+  std::future<void> modelsLoaded;
+  if (!runConfig.phonemizeToPath) {
+    modelsLoaded = std::async(std::launch::async, [&]() {
+      loadVoiceModels(piperConfig, runConfig.encoderPath.string(),
+                      runConfig.decoderPath.string(), voice,
+                      runConfig.accelerator);
+    });
+  }
 
   // Get the path to the piper executable so we can locate espeak-ng-data, etc.
   // next to it.
@@ -186,8 +247,37 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  if (runConfig.tashkeelCacheSize) {
+    piperConfig.tashkeelCacheSize = runConfig.tashkeelCacheSize.value();
+  }
+
+  if (runConfig.corpusPath) {
+    // Already phonemized
+    piperConfig.useESpeak = false;
+    piperConfig.useTashkeel = false;
+  }
+
+  if (runConfig.sentenceCacheSize > 0) {
+    voice.sentenceCache = std::make_unique<piper::SentenceCache>(
+        runConfig.sentenceCacheSize * 1024 * 1024,
+        runConfig.timeStretchTolerance);
+  }
+
   piper::initialize(piperConfig);
 
+  if (modelsLoaded.valid()) {
+    modelsLoaded.get();
+  }
+  auto endTime = chrono::steady_clock::now();
+  spdlog::info("Loaded voice in {} second(s)",
+               chrono::duration<double>(endTime - startTime).count());
+  if (auto usage = piper::processMemoryUsage()) {
+    // Models mapped by other processes as well show up as shared
+    spdlog::info("Resident memory: {} MiB private, {} MiB shared",
+                 usage->privateBytes / (1024 * 1024),
+                 usage->sharedBytes / (1024 * 1024));
+  }
+
   // Scales
   if (runConfig.noiseScale) {
     voice.synthesisConfig.noiseScale = runConfig.noiseScale.value();
@@ -201,6 +291,11 @@ int main(int argc, char *argv[]) {
     voice.synthesisConfig.noiseW = runConfig.noiseW.value();
   }
 
+  if (runConfig.seed && !runConfig.phonemizeToPath) {
+    piper::checkSeed(voice, runConfig.seed);
+    voice.synthesisConfig.seed = runConfig.seed;
+  }
+
   if (runConfig.sentenceSilenceSeconds) {
     voice.synthesisConfig.sentenceSilenceSeconds =
         runConfig.sentenceSilenceSeconds.value();
@@ -222,24 +317,109 @@ int main(int argc, char *argv[]) {
 
   } // if phonemeSilenceSeconds
 
+  if (runConfig.phonemizeToPath) {
+    phonemizeCorpus(piperConfig, voice, runConfig);
+    piper::terminate(piperConfig);
+    return EXIT_SUCCESS;
+  }
+
+  piper::warmupVoice(voice, runConfig.warmupRounds);
+
   if (runConfig.outputType == OUTPUT_DIRECTORY) {
     runConfig.outputPath = filesystem::absolute(runConfig.outputPath.value());
     spdlog::info("Output directory: {}", runConfig.outputPath.value().string());
   }
 
+  if (runConfig.corpusPath) {
+    size_t failures = synthesizeCorpus(voice, runConfig);
+    piper::terminate(piperConfig);
+    return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  std::unique_ptr<piper::AudioStore> audioStore;
+  if (runConfig.audioStorePath) {
+    audioStore = std::make_unique<piper::AudioStore>(
+        runConfig.audioStorePath.value(), runConfig.audioStoreSize * 1024 * 1024);
+  }
+
+  // Phoneme ids of the current line (--json-input), synthesized instead of
+  // its text
+  optional<piper::PhonemeData> phonemes;
+
+  // Like piper::textToAudio, but answers from the audio store if possible and
+  // stores what was synthesized
+  auto textToAudio = [&](const string &text, vector<int16_t> &audioBuffer,
+                         piper::SynthesisResult &result,
+                         const function<void()> &audioCallback) {
+    if (phonemes) {
+      // No text to key the audio store by
+      piper::synthesize(voice, *phonemes, audioBuffer, result, audioCallback);
+      return;
+    }
+
+    if (!audioStore) {
+      piper::textToAudio(piperConfig, voice, text, audioBuffer, result,
+                         audioCallback);
+      return;
+    }
+
+    auto key = piper::audioStoreKey(voice, text);
+    if (audioStore->getAudio(key, audioBuffer)) {
+      spdlog::debug("Found audio in store");
+      audioCallback();
+      audioBuffer.clear();
+      return;
+    }
+
+    vector<int16_t> audio;
+    piper::textToAudio(piperConfig, voice, text, audioBuffer, result, [&]() {
+      audio.insert(audio.end(), audioBuffer.begin(), audioBuffer.end());
+      audioCallback();
+    });
+    audioStore->putAudio(key, audio);
+  };
+
+  auto textToWavFile = [&](const string &text, ostream &audioFile,
+                           piper::SynthesisResult &result) {
+    if (!audioStore && !phonemes) {
+      piper::textToWavFile(piperConfig, voice, text, audioFile, result);
+      return;
+    }
+
+    vector<int16_t> audio, audioBuffer;
+    textToAudio(text, audioBuffer, result, [&]() {
+      audio.insert(audio.end(), audioBuffer.begin(), audioBuffer.end());
+    });
+
+    auto &synthesisConfig = voice.synthesisConfig;
+    writeWavHeader(synthesisConfig.sampleRate, synthesisConfig.sampleWidth,
+                   synthesisConfig.channels, (int32_t)audio.size(), audioFile);
+    audioFile.write((const char *)audio.data(), sizeof(int16_t) * audio.size());
+  };
+
   string line;
+  string normalizedLine;
   piper::SynthesisResult result;
   while (getline(cin, line)) {
     auto outputType = runConfig.outputType;
     auto speakerId = voice.synthesisConfig.speakerId;
+    auto seed = voice.synthesisConfig.seed;
     std::optional<filesystem::path> maybeOutputPath = runConfig.outputPath;
+    phonemes.reset();
 
     if (runConfig.jsonInput) {
       // Each line is a JSON object
       json lineRoot = json::parse(line);
 
-      // Text is required
-      line = lineRoot["text"].get<std::string>();
+      if (lineRoot.contains("phoneme_ids")) {
+        // Already phonemized, text is ignored
+        phonemes = piper::parsePhonemeData(lineRoot["phoneme_ids"]);
+        piper::validatePhonemeData(voice, *phonemes);
+        line.clear();
+      } else {
+        // Text is required
+        line = lineRoot["text"].get<std::string>();
+      }
 
       if (lineRoot.contains("output_file")) {
         // Override output WAV file path
@@ -263,8 +443,30 @@ int main(int argc, char *argv[]) {
           spdlog::warn("No speaker named: {}", speakerName);
         }
       }
+
+      if (lineRoot.contains("seed")) {
+        // Override seed
+        voice.synthesisConfig.seed = lineRoot["seed"].get<uint64_t>();
+        piper::checkSeed(voice, voice.synthesisConfig.seed);
+      }
+    }
+
+    if (outputType == OUTPUT_FILE && !runConfig.jsonInput) {
+      // Read all of standard input before synthesizing.
+      // Otherwise, we would overwrite the output file for each line.
+      stringstream text;
+      text << line;
+      while (getline(cin, line)) {
+        text << " " << line;
+      }
+
+      line = text.str();
     }
 
+    // Same text clean up as paroli-server
+    voice.textNormalizer.normalize(line, normalizedLine);
+    line.swap(normalizedLine);
+
     // Timestamp is used for path to output WAV file
     const auto now = chrono::system_clock::now();
     const auto timestamp =
@@ -280,7 +482,7 @@ int main(int argc, char *argv[]) {
 
       // Output audio to automatically-named WAV file in a directory
       ofstream audioFile(outputPath.string(), ios::binary);
-      piper::textToWavFile(piperConfig, voice, line, audioFile, result);
+      textToWavFile(line, audioFile, result);
       spdlog::info("Wrote {}", outputPath.string());
     } else if (outputType == OUTPUT_FILE) {
       if (!maybeOutputPath || maybeOutputPath->empty()) {
@@ -289,25 +491,13 @@ int main(int argc, char *argv[]) {
 
       filesystem::path outputPath = maybeOutputPath.value();
 
-      if (!runConfig.jsonInput) {
-        // Read all of standard input before synthesizing.
-        // Otherwise, we would overwrite the output file for each line.
-        stringstream text;
-        text << line;
-        while (getline(cin, line)) {
-          text << " " << line;
-        }
-
-        line = text.str();
-      }
-
       // Output audio to WAV file
       ofstream audioFile(outputPath.string(), ios::binary);
-      piper::textToWavFile(piperConfig, voice, line, audioFile, result);
+      textToWavFile(line, audioFile, result);
       cout << outputPath.string() << endl;
     } else if (outputType == OUTPUT_STDOUT) {
       // Output WAV to stdout
-      piper::textToWavFile(piperConfig, voice, line, cout, result);
+      textToWavFile(line, cout, result);
     } else if (outputType == OUTPUT_RAW) {
       // Raw output to stdout
       vector<int16_t> audioBuffer;
@@ -323,8 +513,7 @@ int main(int argc, char *argv[]) {
                    sizeof(int16_t) * audioBuffer.size());
         cout.flush();
       };
-      piper::textToAudio(piperConfig, voice, line, audioBuffer, result,
-                         audioCallback);
+      textToAudio(line, audioBuffer, result, audioCallback);
 
       // Wait for audio output to finish
       spdlog::info("Waiting for audio to finish playing...");
@@ -336,6 +525,7 @@ int main(int argc, char *argv[]) {
 
     // Restore config (--json-input)
     voice.synthesisConfig.speakerId = speakerId;
+    voice.synthesisConfig.seed = seed;
 
   } // for each line
 
@@ -346,6 +536,116 @@ int main(int argc, char *argv[]) {
 
 // ----------------------------------------------------------------------------
 
+// Phonemize every input line into an entry of the corpus, numbered from 0
+void phonemizeCorpus(piper::PiperConfig &piperConfig, piper::Voice &voice,
+                     const RunConfig &runConfig) {
+  piper::PhonemeCorpusWriter corpus(runConfig.phonemizeToPath.value(),
+                                    voice.modelConfig.numSymbols);
+
+  auto startTime = chrono::steady_clock::now();
+  string line;
+  string normalizedLine;
+  while (getline(cin, line)) {
+    if (runConfig.jsonInput) {
+      json lineRoot = json::parse(line);
+      line = lineRoot["text"].get<std::string>();
+    }
+
+    // Same text clean up as synthesizing right away
+    voice.textNormalizer.normalize(line, normalizedLine);
+    corpus.add(piper::phonemize(piperConfig, voice, normalizedLine));
+  }
+  corpus.finish();
+
+  auto endTime = chrono::steady_clock::now();
+  spdlog::info("Phonemized {} line(s) into {} in {} second(s)", corpus.size(),
+               runConfig.phonemizeToPath->string(),
+               chrono::duration<double>(endTime - startTime).count());
+}
+
+// Synthesize the corpus entries on runConfig.jobs threads, which take the
+// next entry as they finish one. Returns the number of entries that failed.
+size_t synthesizeCorpus(piper::Voice &voice, const RunConfig &runConfig) {
+  piper::PhonemeCorpus corpus(runConfig.corpusPath.value());
+  if (corpus.numSymbols() != voice.modelConfig.numSymbols) {
+    throw runtime_error("Phoneme corpus was made for a voice with " +
+                        to_string(corpus.numSymbols()) + " symbols, not " +
+                        to_string(voice.modelConfig.numSymbols));
+  }
+  if (runConfig.outputType != OUTPUT_DIRECTORY) {
+    throw runtime_error("Phoneme corpora are synthesized into an output "
+                        "directory (--output_dir)");
+  }
+
+  const size_t end = min(runConfig.corpusEnd.value_or(corpus.size()),
+                         corpus.size());
+  const size_t begin = min(runConfig.corpusBegin, end);
+  const size_t jobs = max<size_t>(1, min(runConfig.jobs, end - begin));
+  spdlog::info("Synthesizing entries {} to {} of {} with {} job(s)", begin,
+               end, runConfig.corpusPath->string(), jobs);
+
+  atomic<size_t> nextEntry{begin};
+  atomic<size_t> failures{0};
+  vector<piper::SynthesisResult> results(jobs);
+  auto &synthesisConfig = voice.synthesisConfig;
+  auto startTime = chrono::steady_clock::now();
+
+  auto work = [&](piper::SynthesisResult &result) {
+    vector<int16_t> audio;
+    for (size_t index; (index = nextEntry++) < end;) {
+      stringstream outputName;
+      outputName << setw(8) << setfill('0') << index << ".wav";
+      filesystem::path outputPath = runConfig.outputPath.value();
+      outputPath.append(outputName.str());
+
+      try {
+        auto phonemeData = corpus.entry(index);
+        piper::validatePhonemeData(voice, phonemeData);
+        audio.clear();
+        piper::synthesize(voice, phonemeData, audio, result, nullptr);
+
+        ofstream audioFile(outputPath.string(), ios::binary);
+        writeWavHeader(synthesisConfig.sampleRate, synthesisConfig.sampleWidth,
+                       synthesisConfig.channels, (int32_t)audio.size(),
+                       audioFile);
+        audioFile.write((const char *)audio.data(),
+                        sizeof(int16_t) * audio.size());
+        if (!audioFile) {
+          throw runtime_error("Failed to write " + outputPath.string());
+        }
+        spdlog::debug("Wrote {}", outputPath.string());
+      } catch (const exception &e) {
+        spdlog::error("Entry {}: {}", index, e.what());
+        failures++;
+      }
+    }
+  };
+
+  vector<thread> workers;
+  for (size_t i = 1; i < jobs; i++) {
+    workers.emplace_back(work, ref(results[i]));
+  }
+  work(results[0]);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  double inferSeconds = 0, audioSeconds = 0;
+  for (const auto &result : results) {
+    inferSeconds += result.inferSeconds;
+    audioSeconds += result.audioSeconds;
+  }
+  auto endTime = chrono::steady_clock::now();
+  spdlog::info("Synthesized {} entries ({} failed) in {} second(s), {} "
+               "second(s) of audio, real-time factor {}",
+               end - begin, failures.load(),
+               chrono::duration<double>(endTime - startTime).count(),
+               audioSeconds, audioSeconds > 0 ? inferSeconds / audioSeconds : 0);
+  return failures;
+}
+
+// ----------------------------------------------------------------------------
+
 void printUsage(char *argv[]) {
   cerr << endl;
   cerr << "usage: " << argv[0] << " [options]" << endl;
@@ -373,6 +673,10 @@ void printUsage(char *argv[]) {
        << endl;
   cerr << "   --noise_w               NUM   phoneme width noise (default: 0.8)"
        << endl;
+  cerr << "   --seed                  NUM   seed for the noise, same seed gives "
+          "the same audio, needs an encoder with dp_noise and z_noise inputs "
+          "(default: random)"
+       << endl;
   cerr << "   --sentence_silence      NUM   seconds of silence after each "
           "sentence (default: 0.2)"
        << endl;
@@ -381,12 +685,46 @@ void printUsage(char *argv[]) {
   cerr << "   --tashkeel_model        FILE  path to libtashkeel onnx model "
           "(arabic)"
        << endl;
+  cerr << "   --tashkeel_cache_size   NUM   number of diacritized sentences to "
+          "cache (default: 1024)"
+       << endl;
+  cerr << "   --sentence_cache_size   NUM   MiB of memory to cache synthesized "
+          "sentences in (default: 0, disabled)"
+       << endl;
+  cerr << "   --time_stretch_tolerance NUM  time-stretch cached sentences "
+          "whose length scale differs by at most this fraction (default: 0, "
+          "disabled)"
+       << endl;
   cerr << "   --json-input                  stdin input is lines of JSON "
-          "instead of plain text"
+          "instead of plain text, with text or phoneme_ids"
+       << endl;
+  cerr << "   --audio_store           DIR   reuse audio synthesized before, "
+          "stored in this directory (default: disabled)"
+       << endl;
+  cerr << "   --audio_store_size      NUM   MiB of disk for the audio store "
+          "(default: 1024)"
+       << endl;
+  cerr << "   --phonemize_to          FILE  only phonemize the input lines into "
+          "a phoneme corpus, without loading the models"
+       << endl;
+  cerr << "   --corpus                FILE  synthesize the entries of a phoneme "
+          "corpus into the output directory instead of reading stdin"
+       << endl;
+  cerr << "   --corpus_range   BEGIN:END    entries of the corpus to synthesize "
+          "(default: all)"
+       << endl;
+  cerr << "   --jobs                  NUM   corpus entries to synthesize in "
+          "parallel (default: 1)"
        << endl;
   cerr << "   --accelerator           STR   accelerator to use for ONNX "
           "(default: none, valid: cuda)"
        << endl;
+  cerr << "   --model_cache           DIR   keep optimized models in this "
+          "directory, later starts skip optimizing (default: disabled)"
+       << endl;
+  cerr << "   --warmup                NUM   rounds of warmup inference before "
+          "reading input, for lower latency on the first line (default: 0)"
+       << endl;
   cerr << "   --debug                       print DEBUG messages to the console"
        << endl;
   cerr << "   -q       --quiet              disable logging" << endl;
@@ -446,6 +784,9 @@ void parseArgs(int argc, char *argv[], RunConfig &runConfig) {
     } else if (arg == "--noise_w" || arg == "--noise-w") {
       ensureArg(argc, argv, i);
       runConfig.noiseW = stof(argv[++i]);
+    } else if (arg == "--seed") {
+      ensureArg(argc, argv, i);
+      runConfig.seed = stoull(argv[++i]);
     } else if (arg == "--sentence_silence" || arg == "--sentence-silence") {
       ensureArg(argc, argv, i);
       runConfig.sentenceSilenceSeconds = stof(argv[++i]);
@@ -472,10 +813,56 @@ void parseArgs(int argc, char *argv[], RunConfig &runConfig) {
     } else if (arg == "--tashkeel_model" || arg == "--tashkeel-model") {
       ensureArg(argc, argv, i);
       runConfig.tashkeelModelPath = filesystem::path(argv[++i]);
+    } else if (arg == "--tashkeel_cache_size" ||
+               arg == "--tashkeel-cache-size") {
+      ensureArg(argc, argv, i);
+      runConfig.tashkeelCacheSize = stoul(argv[++i]);
+    } else if (arg == "--sentence_cache_size" ||
+               arg == "--sentence-cache-size") {
+      ensureArg(argc, argv, i);
+      runConfig.sentenceCacheSize = stoul(argv[++i]);
+    } else if (arg == "--time_stretch_tolerance" ||
+               arg == "--time-stretch-tolerance") {
+      ensureArg(argc, argv, i);
+      runConfig.timeStretchTolerance = stof(argv[++i]);
     } else if (arg == "--json_input" || arg == "--json-input") {
       runConfig.jsonInput = true;
+    } else if (arg == "--audio_store" || arg == "--audio-store") {
+      ensureArg(argc, argv, i);
+      runConfig.audioStorePath = filesystem::path(argv[++i]);
+    } else if (arg == "--audio_store_size" || arg == "--audio-store-size") {
+      ensureArg(argc, argv, i);
+      runConfig.audioStoreSize = stoul(argv[++i]);
+    } else if (arg == "--phonemize_to" || arg == "--phonemize-to") {
+      ensureArg(argc, argv, i);
+      runConfig.phonemizeToPath = filesystem::path(argv[++i]);
+    } else if (arg == "--corpus") {
+      ensureArg(argc, argv, i);
+      runConfig.corpusPath = filesystem::path(argv[++i]);
+    } else if (arg == "--corpus_range" || arg == "--corpus-range") {
+      ensureArg(argc, argv, i);
+      std::string range = argv[++i];
+      auto colon = range.find(':');
+      if (colon == std::string::npos) {
+        throw runtime_error("--corpus_range must be BEGIN:END");
+      }
+      if (colon > 0) {
+        runConfig.corpusBegin = stoul(range.substr(0, colon));
+      }
+      if (colon + 1 < range.size()) {
+        runConfig.corpusEnd = stoul(range.substr(colon + 1));
+      }
+    } else if (arg == "--jobs") {
+      ensureArg(argc, argv, i);
+      runConfig.jobs = stoul(argv[++i]);
     } else if (arg == "--accelerator") {
       runConfig.accelerator = argv[++i];
+    } else if (arg == "--model_cache" || arg == "--model-cache") {
+      ensureArg(argc, argv, i);
+      runConfig.modelCachePath = filesystem::path(argv[++i]);
+    } else if (arg == "--warmup") {
+      ensureArg(argc, argv, i);
+      runConfig.warmupRounds = stoul(argv[++i]);
     } else if (arg == "--version") {
       std::cout << piper::getVersion() << std::endl;
       exit(0);
@@ -491,13 +878,16 @@ void parseArgs(int argc, char *argv[], RunConfig &runConfig) {
     }
   }
 
-  // Verify model file exists
-  if(!filesystem::exists(runConfig.encoderPath)){
+  // Verify model file exists, phonemizing doesn't need them
+  if(!runConfig.phonemizeToPath && !filesystem::exists(runConfig.encoderPath)){
     throw runtime_error("Encoder model file doesn't exist");
   }
-  if(!filesystem::exists(runConfig.decoderPath)){
+  if(!runConfig.phonemizeToPath && !filesystem::exists(runConfig.decoderPath)){
     throw runtime_error("Decoder model file doesn't exist");
   }
+  if(runConfig.phonemizeToPath && runConfig.corpusPath){
+    throw runtime_error("--phonemize_to and --corpus don't go together");
+  }
   if(!modelConfigPath){
     throw runtime_error("Model config file must be provided");
   }
@@ -11,25 +11,53 @@
 #include <stdexcept>
 #include <memory>
 #include <cstring>
+#include <iostream>
 
-std::vector<uint8_t> encodeOgg(const std::vector<short>& data, size_t sr, size_t nchannels, size_t bitrate)
+static int frameDurationCtl(float frameDuration)
 {
-    StreamingOggOpusEncoder encoder(sr, nchannels, bitrate);
-    std::vector<uint8_t> oggBuffer = encoder.encode(data);
-    auto extra = encoder.finish();
-    oggBuffer.insert(oggBuffer.end(), extra.begin(), extra.end());
+    if(frameDuration == 2.5f)
+        return OPUS_FRAMESIZE_2_5_MS;
+    if(frameDuration == 5.0f)
+        return OPUS_FRAMESIZE_5_MS;
+    if(frameDuration == 10.0f)
+        return OPUS_FRAMESIZE_10_MS;
+    if(frameDuration == 20.0f)
+        return OPUS_FRAMESIZE_20_MS;
+    if(frameDuration == 40.0f)
+        return OPUS_FRAMESIZE_40_MS;
+    if(frameDuration == 60.0f)
+        return OPUS_FRAMESIZE_60_MS;
+    throw std::runtime_error("Opus frame duration must be 2.5, 5, 10, 20, 40 or 60 ms");
+}
+
+void validateOpusEncoderOptions(const OpusEncoderOptions& options)
+{
+    frameDurationCtl(options.frameDuration);
+    if(options.complexity < -1 || options.complexity > 10)
+        throw std::runtime_error("Opus complexity must be between 0 and 10");
+    if(options.bitrate < 6000 || options.bitrate > 510000)
+        throw std::runtime_error("Opus bitrate must be between 6000 and 510000");
+}
+
+std::vector<uint8_t> encodeOgg(std::span<const short> data, size_t sr, size_t nchannels, const OpusEncoderOptions& options)
+{
+    StreamingOggOpusEncoder encoder(sr, nchannels, options);
+    std::vector<uint8_t> oggBuffer;
+    // Opus at our bitrates is well below 1/4 of the PCM size
+    oggBuffer.reserve(data.size() / 2 + 4096);
+    encoder.encode(data, oggBuffer);
+    encoder.finish(oggBuffer);
     return oggBuffer;
 }
 
-StreamingOggOpusEncoder::StreamingOggOpusEncoder(size_t sr, size_t nchannels, size_t bitrate)
+StreamingOggOpusEncoder::StreamingOggOpusEncoder(size_t sr, size_t nchannels, const OpusEncoderOptions& options)
     :sr(sr), nchannels(nchannels)
 {
     auto write_func = [](void* user_data, const unsigned char* ptr, opus_int32 size) -> int {
         StreamingOggOpusEncoder* self = (StreamingOggOpusEncoder*)user_data;
-        auto buffer = &self->oggBuffer;
-        auto old_size = buffer->size();
-        buffer->resize(old_size + size);
-        memcpy(buffer->data() + old_size, ptr, size);
+        if(self->output == nullptr)
+            return 1;
+        self->output->insert(self->output->end(), ptr, ptr + size);
         return 0;
     };
     auto close_func = [](void* user_data) -> int {
@@ -50,33 +78,62 @@ StreamingOggOpusEncoder::StreamingOggOpusEncoder(size_t sr, size_t nchannels, si
             &ope_encoder_destroy);
     if(err != OPE_OK)
         throw std::runtime_error("Failed to create encoder");
-    if(ope_encoder_ctl(encoder.get(), OPUS_SET_BITRATE(bitrate)) != OPE_OK)
-        std::cerr << "Failed to set bitrate to " << bitrate << std::endl;
+    if(ope_encoder_ctl(encoder.get(), OPUS_SET_BITRATE(options.bitrate)) != OPE_OK)
+        std::cerr << "Failed to set bitrate to " << options.bitrate << std::endl;
+    if(ope_encoder_ctl(encoder.get(), OPUS_SET_EXPERT_FRAME_DURATION(frameDurationCtl(options.frameDuration))) != OPE_OK)
+        std::cerr << "Failed to set frame duration to " << options.frameDuration << "ms" << std::endl;
+    if(options.complexity >= 0 && ope_encoder_ctl(encoder.get(), OPUS_SET_COMPLEXITY(options.complexity)) != OPE_OK)
+        std::cerr << "Failed to set complexity to " << options.complexity << std::endl;
+    if(options.serialNo.has_value() && ope_encoder_ctl(encoder.get(), OPE_SET_SERIALNO(*options.serialNo)) != OPE_OK)
+        std::cerr << "Failed to set serial number" << std::endl;
+    if(options.flushPages) {
+        // By default libopusenc holds back up to 2s of audio before encoding
+        // and up to 1s of packets before writing a page
+        if(ope_encoder_ctl(encoder.get(), OPE_SET_DECISION_DELAY(0)) != OPE_OK)
+            std::cerr << "Failed to set decision delay" << std::endl;
+        if(ope_encoder_ctl(encoder.get(), OPE_SET_MUXING_DELAY(0)) != OPE_OK)
+            std::cerr << "Failed to set muxing delay" << std::endl;
+    }
 }
 
-std::vector<uint8_t> StreamingOggOpusEncoder::encode(const std::vector<short>& data)
+void StreamingOggOpusEncoder::encode(std::span<const short> data, std::vector<uint8_t>& out)
 {
-    oggBuffer.clear();
-    audioBuffer.insert(audioBuffer.end(), data.begin(), data.end());
-    const size_t frame_size = 960;
-    if(audioBuffer.size() < frame_size * nchannels)
-        return {};
-    size_t i = 0;
-    size_t end = (audioBuffer.size() / frame_size) * frame_size;
-    for(i = 0; i < end; i += frame_size) {
-        int err = ope_encoder_write(encoder.get(), audioBuffer.data() + i, frame_size);
-        if(err != 0)
+    output = &out;
+    // libopusenc buffers internally and accepts any number of samples per
+    // channel, so the input is handed over as is. Only an incomplete
+    // interleaved frame has to wait for its remaining channels.
+    if(!partialFrame.empty()) {
+        size_t missing = nchannels - partialFrame.size();
+        size_t take = std::min(missing, data.size());
+        partialFrame.insert(partialFrame.end(), data.begin(), data.begin() + take);
+        data = data.subspan(take);
+        if(partialFrame.size() < nchannels) {
+            output = nullptr;
+            return;
+        }
+        int err = ope_encoder_write(encoder.get(), partialFrame.data(), 1);
+        partialFrame.clear();
+        if(err != OPE_OK) {
+            output = nullptr;
             throw std::runtime_error("opusenc failed to encode");
+        }
     }
-    audioBuffer.erase(audioBuffer.begin(), audioBuffer.begin() + end);
 
-    return oggBuffer;
+    size_t frames = data.size() / nchannels;
+    if(frames > 0) {
+        int err = ope_encoder_write(encoder.get(), data.data(), frames);
+        if(err != OPE_OK) {
+            output = nullptr;
+            throw std::runtime_error("opusenc failed to encode");
+        }
+    }
+    partialFrame.assign(data.begin() + frames * nchannels, data.end());
+    output = nullptr;
 }
 
-std::vector<uint8_t> StreamingOggOpusEncoder::finish()
+void StreamingOggOpusEncoder::finish(std::vector<uint8_t>& out)
 {
-    oggBuffer.clear();
+    output = &out;
     ope_encoder_drain(encoder.get());
-    return oggBuffer;
+    output = nullptr;
 }
-
@@ -2,23 +2,49 @@
 
 #include <vector>
 #include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
 #include <unistd.h>
 #include <opus/opusenc.h>
 
-std::vector<uint8_t> encodeOgg(const std::vector<short>& data, size_t sr, size_t nchannels, size_t bitrate = 32000);
+struct OpusEncoderOptions {
+    size_t bitrate = 32000;
+    // 0 (fastest) to 10 (best quality), -1 for the libopus default
+    int complexity = -1;
+    // Frame duration in milliseconds: 2.5, 5, 10, 20, 40 or 60
+    float frameDuration = 20.0f;
+    // Encode and emit an Ogg page for every packet instead of letting
+    // libopusenc buffer audio for up to two seconds. For low latency streaming.
+    bool flushPages = false;
+    // Serial number of the logical Ogg stream, random if not set. Streams
+    // chained one after another need distinct serial numbers.
+    std::optional<int32_t> serialNo;
+};
+
+// Throws if the frame duration is not one Opus supports
+void validateOpusEncoderOptions(const OpusEncoderOptions& options);
+
+std::vector<uint8_t> encodeOgg(std::span<const short> data, size_t sr, size_t nchannels,
+    const OpusEncoderOptions& options = {});
 
 struct StreamingOggOpusEncoder {
-    StreamingOggOpusEncoder(size_t sr, size_t nchannels, size_t bitrate = 32000);
+    StreamingOggOpusEncoder(size_t sr, size_t nchannels, const OpusEncoderOptions& options = {});
+    // Callbacks of the encoder point to this object
+    StreamingOggOpusEncoder(const StreamingOggOpusEncoder&) = delete;
+    StreamingOggOpusEncoder& operator=(const StreamingOggOpusEncoder&) = delete;
 
-    std::vector<uint8_t> encode(const std::vector<short>& data);
-    std::vector<uint8_t> finish();
+    // Encode interleaved samples, appending finished Ogg pages to out
+    void encode(std::span<const short> data, std::vector<uint8_t>& out);
+    // Drain the encoder, appending the remaining pages to out
+    void finish(std::vector<uint8_t>& out);
 
-    std::vector<short> audioBuffer;
     std::shared_ptr<OggOpusEnc> encoder;
-    OpusEncCallbacks callbacks;
+    std::shared_ptr<OggOpusComments> comments;
     size_t sr;
     size_t nchannels;
-    std::vector<uint8_t> oggBuffer;
-    std::shared_ptr<OggOpusComments> comments;
+    // Samples of an incomplete multi-channel frame, waiting for the rest
+    std::vector<short> partialFrame;
+    // Where the write callback appends pages to, only set during a call
+    std::vector<uint8_t>* output = nullptr;
 };
-
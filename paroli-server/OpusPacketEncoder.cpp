@@ -0,0 +1,101 @@
+#include <opus/opus.h>
+
+#include "OpusPacketEncoder.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <iostream>
+#include <string>
+
+// Largest packet libopus produces for a single frame
+static constexpr size_t MAX_PACKET_SIZE = 1275 * 3 + 7;
+
+OpusPacketEncoder::OpusPacketEncoder(size_t sr, size_t nchannels, const OpusEncoderOptions& options)
+    : sr(sr), nchannels(nchannels)
+{
+    validateOpusEncoderOptions(options);
+    frameSize = (size_t)(sr * options.frameDuration / 1000);
+
+    int err = 0;
+    encoder = std::shared_ptr<OpusEncoder>(
+        opus_encoder_create(sr, nchannels, OPUS_APPLICATION_AUDIO, &err),
+        &opus_encoder_destroy);
+    if(err != OPUS_OK)
+        throw std::runtime_error("Failed to create Opus encoder: " + std::string(opus_strerror(err)));
+    opus_encoder_ctl(encoder.get(), OPUS_GET_COMPLEXITY(&defaultComplexity));
+    applyOptions(options);
+
+    pending.reserve(frameSize * nchannels);
+    packet.resize(headerSize + MAX_PACKET_SIZE);
+}
+
+void OpusPacketEncoder::applyOptions(const OpusEncoderOptions& options)
+{
+    if(opus_encoder_ctl(encoder.get(), OPUS_SET_BITRATE(options.bitrate)) != OPUS_OK)
+        std::cerr << "Failed to set bitrate to " << options.bitrate << std::endl;
+    // Settings survive a reset, so the default has to be restored explicitly
+    opus_int32 complexity = options.complexity >= 0 ? options.complexity : defaultComplexity;
+    if(opus_encoder_ctl(encoder.get(), OPUS_SET_COMPLEXITY(complexity)) != OPUS_OK)
+        std::cerr << "Failed to set complexity to " << complexity << std::endl;
+}
+
+void OpusPacketEncoder::reset(const OpusEncoderOptions& options)
+{
+    validateOpusEncoderOptions(options);
+    opus_encoder_ctl(encoder.get(), OPUS_RESET_STATE);
+    applyOptions(options);
+    frameSize = (size_t)(sr * options.frameDuration / 1000);
+    sequence = 0;
+    pending.clear();
+}
+
+void OpusPacketEncoder::encodeFrame(const short* frame, const PacketCallback& onPacket)
+{
+    opus_int32 size = opus_encode(encoder.get(), frame, frameSize,
+        packet.data() + headerSize, packet.size() - headerSize);
+    if(size < 0)
+        throw std::runtime_error("Opus failed to encode: " + std::string(opus_strerror(size)));
+
+    const uint16_t duration = frameSize * 48000 / sr;
+    packet[0] = sequence & 0xff;
+    packet[1] = (sequence >> 8) & 0xff;
+    packet[2] = (sequence >> 16) & 0xff;
+    packet[3] = (sequence >> 24) & 0xff;
+    packet[4] = duration & 0xff;
+    packet[5] = (duration >> 8) & 0xff;
+    sequence++;
+
+    onPacket(std::span<const uint8_t>(packet.data(), headerSize + size));
+}
+
+void OpusPacketEncoder::encode(std::span<const short> data, const PacketCallback& onPacket)
+{
+    const size_t frameSamples = frameSize * nchannels;
+
+    // Complete the frame left over from the last call first
+    if(!pending.empty()) {
+        size_t take = std::min(frameSamples - pending.size(), data.size());
+        pending.insert(pending.end(), data.begin(), data.begin() + take);
+        data = data.subspan(take);
+        if(pending.size() < frameSamples)
+            return;
+        encodeFrame(pending.data(), onPacket);
+        pending.clear();
+    }
+
+    // Then encode straight from the input
+    while(data.size() >= frameSamples) {
+        encodeFrame(data.data(), onPacket);
+        data = data.subspan(frameSamples);
+    }
+    pending.assign(data.begin(), data.end());
+}
+
+void OpusPacketEncoder::finish(const PacketCallback& onPacket)
+{
+    if(pending.empty())
+        return;
+    pending.resize(frameSize * nchannels, 0);
+    encodeFrame(pending.data(), onPacket);
+    pending.clear();
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <span>
+#include <opus/opus.h>
+
+#include "OggOpusEncoder.hpp"
+
+// Encodes audio into bare Opus packets without an Ogg container, so each
+// packet can be sent as soon as its frame is complete. Every packet is
+// prefixed with a small little endian header:
+//   uint32 sequence number, starting at 0
+//   uint16 duration of the packet in samples at 48kHz
+struct OpusPacketEncoder {
+    static constexpr size_t headerSize = 6;
+    using PacketCallback = std::function<void(std::span<const uint8_t>)>;
+
+    OpusPacketEncoder(size_t sr, size_t nchannels, const OpusEncoderOptions& options = {});
+
+    // Encode interleaved samples, calling onPacket for every finished packet
+    void encode(std::span<const short> data, const PacketCallback& onPacket);
+    // Pad the last incomplete frame with silence and encode it
+    void finish(const PacketCallback& onPacket);
+    // Start over with a new stream, keeping the encoder and buffers
+    void reset(const OpusEncoderOptions& options = {});
+
+    std::shared_ptr<OpusEncoder> encoder;
+    size_t sr;
+    size_t nchannels;
+    // Samples per channel in one frame
+    size_t frameSize;
+    uint32_t sequence = 0;
+    // Complexity libopus picked on its own
+    opus_int32 defaultComplexity = 0;
+    // Samples of the current incomplete frame
+    std::vector<short> pending;
+    // Reused for every packet
+    std::vector<uint8_t> packet;
+
+private:
+    void applyOptions(const OpusEncoderOptions& options);
+    void encodeFrame(const short* frame, const PacketCallback& onPacket);
+};
@@ -0,0 +1,239 @@
+#include "Prefork.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include <spdlog/spdlog.h>
+
+SharedMetrics::SharedMetrics(size_t workers)
+    : count(workers)
+{
+    void* map = mmap(nullptr, sizeof(Slot) * count, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(map == MAP_FAILED)
+        throw std::system_error(errno, std::generic_category(), "Cannot map shared metrics");
+    slots = static_cast<Slot*>(map);
+    for(size_t i = 0; i < count; i++)
+        new (&slots[i]) Slot{};
+}
+
+SharedMetrics::~SharedMetrics()
+{
+    munmap(slots, sizeof(Slot) * count);
+}
+
+void SharedMetrics::publish(size_t worker, const std::string& json)
+{
+    auto& slot = slots[worker];
+    if(json.size() > SLOT_BYTES) {
+        spdlog::warn("Metrics of {} bytes don't fit the shared slot", json.size());
+        return;
+    }
+    std::lock_guard<std::mutex> lock(publishMutex);
+    const uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.length = json.size();
+    memcpy(slot.data, json.data(), json.size());
+    slot.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+void SharedMetrics::clear(size_t worker)
+{
+    // A worker dying mid write leaves the sequence odd, start over from an
+    // even one. Only the supervisor clears, while the worker is not running.
+    auto& slot = slots[worker];
+    slot.length = 0;
+    slot.sequence.store(0, std::memory_order_release);
+}
+
+std::vector<nlohmann::json> SharedMetrics::read() const
+{
+    std::vector<nlohmann::json> result;
+    std::string json;
+    for(size_t i = 0; i < count; i++) {
+        const auto& slot = slots[i];
+        // A worker dying mid write leaves the slot odd until it is restarted
+        bool consistent = false;
+        for(int attempt = 0; attempt < 100 && !consistent; attempt++) {
+            const uint64_t before = slot.sequence.load(std::memory_order_acquire);
+            if(before % 2 == 1)
+                continue;
+            json.assign(slot.data, std::min<size_t>(slot.length, SLOT_BYTES));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            consistent = slot.sequence.load(std::memory_order_relaxed) == before;
+        }
+        if(consistent && !json.empty())
+            result.push_back(nlohmann::json::parse(json, nullptr, false));
+    }
+    return result;
+}
+
+// Sizes of what all workers share: one audio store on disk, one voice directory
+static bool isSharedField(const std::string& object, const std::string& field)
+{
+    if(object == "audio_store")
+        return field == "entries" || field == "bytes" || field == "capacity";
+    return object == "voices" && field == "voices";
+}
+
+nlohmann::json aggregateMetrics(const std::vector<nlohmann::json>& workers)
+{
+    nlohmann::json total = nlohmann::json::object();
+    for(const auto& metrics : workers) {
+        if(!metrics.is_object())
+            continue;
+        for(const auto& [object, fields] : metrics.items()) {
+            if(!fields.is_object())
+                continue;
+            auto& sum = total[object];
+            for(const auto& [field, value] : fields.items()) {
+                if(!value.is_number_integer())
+                    continue;
+                const auto n = value.get<uint64_t>();
+                if(!sum.contains(field))
+                    sum[field] = n;
+                else if(isSharedField(object, field))
+                    sum[field] = std::max(sum[field].get<uint64_t>(), n);
+                else
+                    sum[field] = sum[field].get<uint64_t>() + n;
+            }
+        }
+    }
+
+    for(auto& [object, sum] : total.items()) {
+        if(!sum.contains("hits") || !sum.contains("misses"))
+            continue;
+        const uint64_t hits = sum["hits"].get<uint64_t>() + sum.value("coalesced", uint64_t(0));
+        const uint64_t lookups = hits + sum["misses"].get<uint64_t>();
+        sum["hit_rate"] = lookups > 0 ? (double)hits / lookups : 0.0;
+    }
+    total["workers"] = workers.size();
+    return total;
+}
+
+// Workers living shorter than this are restarted after a pause, so a worker
+// failing at startup doesn't spin
+static constexpr auto MIN_WORKER_UPTIME = std::chrono::seconds(1);
+
+// Makes the worker stop once the supervisor is gone, however it died
+static void followSupervisor(pid_t supervisor)
+{
+#ifdef __linux__
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if(getppid() != supervisor)
+        _exit(EXIT_FAILURE);
+#else
+    // No parent death signal, the worker is reparented once the supervisor
+    // dies. The watcher blocks every signal, so they go to the threads
+    // expecting them.
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    std::thread([supervisor]() {
+        while(getppid() == supervisor)
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        kill(getpid(), SIGTERM);
+    }).detach();
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+#endif
+}
+
+size_t runPrefork(size_t workers, SharedMetrics& metrics)
+{
+    sigset_t handled, previous;
+    sigemptyset(&handled);
+    for(int signal : {SIGCHLD, SIGTERM, SIGINT, SIGHUP})
+        sigaddset(&handled, signal);
+    pthread_sigmask(SIG_BLOCK, &handled, &previous);
+
+    struct Worker
+    {
+        pid_t pid = 0;
+        std::chrono::steady_clock::time_point started;
+    };
+    std::vector<Worker> running(workers);
+    const pid_t supervisor = getpid();
+
+    // Returns true in the new worker
+    auto spawn = [&](size_t index) {
+        metrics.clear(index);
+        pid_t pid = fork();
+        if(pid < 0)
+            throw std::system_error(errno, std::generic_category(), "Cannot fork worker");
+        if(pid == 0) {
+            pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+            followSupervisor(supervisor);
+            return true;
+        }
+        running[index] = {pid, std::chrono::steady_clock::now()};
+        spdlog::info("Started worker {} (pid {})", index, pid);
+        return false;
+    };
+
+    for(size_t i = 0; i < workers; i++) {
+        if(spawn(i))
+            return i;
+    }
+
+    bool stopping = false;
+    while(true) {
+        int signal;
+        if(sigwait(&handled, &signal) != 0)
+            continue;
+
+        if(signal == SIGTERM || signal == SIGINT || signal == SIGHUP) {
+            if(signal != SIGHUP) {
+                spdlog::info("Stopping workers");
+                stopping = true;
+            }
+            for(const auto& worker : running) {
+                if(worker.pid > 0)
+                    kill(worker.pid, signal);
+            }
+            continue;
+        }
+
+        // SIGCHLD, possibly for several workers
+        int status;
+        pid_t pid;
+        while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            auto it = std::find_if(running.begin(), running.end(), [pid](const Worker& worker) {
+                return worker.pid == pid;
+            });
+            if(it == running.end())
+                continue;
+            const size_t index = it - running.begin();
+            it->pid = 0;
+            if(stopping)
+                continue;
+
+            if(WIFSIGNALED(status))
+                spdlog::error("Worker {} (pid {}) was killed by signal {}, restarting it", index, pid, WTERMSIG(status));
+            else
+                spdlog::error("Worker {} (pid {}) exited with status {}, restarting it", index, pid, WEXITSTATUS(status));
+            if(std::chrono::steady_clock::now() - it->started < MIN_WORKER_UPTIME)
+                std::this_thread::sleep_for(MIN_WORKER_UPTIME);
+            if(spawn(index))
+                return index;
+        }
+
+        if(stopping && std::all_of(running.begin(), running.end(), [](const Worker& worker) { return worker.pid == 0; })) {
+            spdlog::info("All workers stopped");
+            exit(EXIT_SUCCESS);
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+// Metrics of all worker processes, in memory the supervisor maps before
+// forking so every worker sees it. Each worker has a slot with its latest
+// metrics as JSON, written under a sequence counter so readers never see a
+// half written slot.
+class SharedMetrics
+{
+public:
+    explicit SharedMetrics(size_t workers);
+    ~SharedMetrics();
+    SharedMetrics(const SharedMetrics&) = delete;
+    SharedMetrics& operator=(const SharedMetrics&) = delete;
+
+    size_t workers() const { return count; }
+
+    // Replaces the worker's metrics. Threads of the worker may publish
+    // concurrently
+    void publish(size_t worker, const std::string& json);
+    // Forgets a worker's metrics, for a restarted worker. Not safe while the
+    // worker runs.
+    void clear(size_t worker);
+    // The latest metrics of every worker that published any
+    std::vector<nlohmann::json> read() const;
+
+private:
+    static constexpr size_t SLOT_BYTES = 8192;
+    struct Slot
+    {
+        // Odd while being written
+        std::atomic<uint64_t> sequence;
+        uint32_t length;
+        char data[SLOT_BYTES];
+    };
+
+    Slot* slots = nullptr;
+    size_t count = 0;
+    // The sequence counter allows one writer per slot. Private to each
+    // process, unlike the slots
+    std::mutex publishMutex;
+};
+
+// Adds up the metrics of the workers. Counters and per worker sizes are
+// summed, sizes of what the workers share are taken once, rates are
+// recomputed from the sums.
+nlohmann::json aggregateMetrics(const std::vector<nlohmann::json>& workers);
+
+// Forks the workers and supervises them: crashed workers are restarted,
+// SIGTERM, SIGINT and SIGHUP are passed on. Returns the worker's index in
+// each worker. The supervisor itself exits once the workers stopped after
+// SIGTERM or SIGINT. Must be called before any thread is started.
+// Workers stop when the supervisor dies, through PR_SET_PDEATHSIG on Linux
+// and by watching their parent elsewhere.
+size_t runPrefork(size_t workers, SharedMetrics& metrics);
@@ -0,0 +1,239 @@
+#include "Resampler.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+
+ResampleQuality parseResampleQuality(const std::string& name)
+{
+    if(name == "polyphase")
+        return ResampleQuality::Polyphase;
+    if(name == "quick")
+        return ResampleQuality::Quick;
+    if(name == "low")
+        return ResampleQuality::Low;
+    if(name == "medium")
+        return ResampleQuality::Medium;
+    if(name == "high")
+        return ResampleQuality::High;
+    if(name == "veryhigh")
+        return ResampleQuality::VeryHigh;
+    throw std::runtime_error("Unknown resample quality " + name);
+}
+
+static unsigned long soxrQualityRecipe(ResampleQuality quality)
+{
+    switch(quality) {
+    case ResampleQuality::Quick:
+        return SOXR_QQ;
+    case ResampleQuality::Low:
+        return SOXR_LQ;
+    case ResampleQuality::High:
+        return SOXR_HQ;
+    case ResampleQuality::VeryHigh:
+        return SOXR_VHQ;
+    default:
+        return SOXR_MQ;
+    }
+}
+
+std::unique_ptr<PolyphaseResampler> PolyphaseResampler::create(size_t orig_sr, size_t out_sr)
+{
+    size_t g = std::gcd(orig_sr, out_sr);
+    size_t up = out_sr / g;
+    size_t down = orig_sr / g;
+    if(up > maxUpFactor || down > maxUpFactor)
+        return nullptr;
+    return std::make_unique<PolyphaseResampler>(up, down);
+}
+
+PolyphaseResampler::PolyphaseResampler(size_t up, size_t down)
+    : up(up), down(down)
+{
+    static_assert(taps % 8 == 0, "taps must be a multiple of 8");
+    constexpr double halfTaps = taps / 2;
+    constexpr double beta = 8.0;
+
+    // Kaiser windowed sinc. Cut off a bit below the lower Nyquist frequency
+    const double cutoff = 0.92 * std::min(1.0, (double)up / (double)down);
+    const double i0Beta = std::cyl_bessel_i(0.0, beta);
+
+    coeffs.resize(up * taps);
+    for(size_t p = 0; p < up; p++) {
+        float* h = coeffs.data() + p * taps;
+        double sum = 0;
+        for(size_t t = 0; t < taps; t++) {
+            // Distance from the input sample to the output position
+            double d = ((double)t - (halfTaps - 1)) - (double)p / (double)up;
+            double x = M_PI * cutoff * d;
+            double sinc = (d == 0) ? 1.0 : std::sin(x) / x;
+            double r = d / halfTaps;
+            double window = (std::abs(r) >= 1) ? 0.0 : std::cyl_bessel_i(0.0, beta * std::sqrt(1 - r * r)) / i0Beta;
+            h[t] = sinc * window;
+            sum += h[t];
+        }
+        // Unity gain for every phase
+        for(size_t t = 0; t < taps; t++)
+            h[t] /= sum;
+    }
+    reset();
+}
+
+void PolyphaseResampler::reset()
+{
+    // Pretend the stream is preceded by silence so the first output sample
+    // lines up with the first input sample
+    history.assign(taps / 2 - 1, 0.0f);
+    historyStart = -(int64_t)(taps / 2 - 1);
+    inputCount = 0;
+    outputCount = 0;
+}
+
+void PolyphaseResampler::produce(std::vector<short>& out, uint64_t maxOutput)
+{
+    const int64_t available = historyStart + (int64_t)history.size();
+    while(outputCount < maxOutput) {
+        const uint64_t pos = outputCount * down;
+        const int64_t center = pos / up;
+        const size_t phase = pos % up;
+        if(center + (int64_t)(taps / 2) >= available)
+            break;
+
+        const float* x = history.data() + (center - (int64_t)(taps / 2 - 1) - historyStart);
+        const float* h = coeffs.data() + phase * taps;
+        // Independent lanes so the compiler can vectorize the dot product
+        float acc[8] = {};
+        for(size_t t = 0; t < taps; t += 8) {
+            for(size_t l = 0; l < 8; l++)
+                acc[l] += x[t + l] * h[t + l];
+        }
+        float sum = ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+        sum = std::clamp(sum, -32768.0f, 32767.0f);
+        out.push_back((short)std::lrint(sum));
+        outputCount++;
+    }
+
+    // Drop samples no longer needed by the next output sample
+    const int64_t nextCenter = (outputCount * down) / up;
+    const int64_t keepFrom = nextCenter - (int64_t)(taps / 2 - 1);
+    if(keepFrom > historyStart) {
+        size_t drop = std::min<size_t>(keepFrom - historyStart, history.size());
+        history.erase(history.begin(), history.begin() + drop);
+        historyStart += drop;
+    }
+}
+
+void PolyphaseResampler::process(std::span<const short> data, std::vector<short>& out)
+{
+    history.insert(history.end(), data.begin(), data.end());
+    inputCount += data.size();
+    out.reserve(out.size() + data.size() * up / down + 1);
+    produce(out, UINT64_MAX);
+}
+
+void PolyphaseResampler::flush(std::vector<short>& out)
+{
+    // Pad with silence to get the samples that depend on future input
+    history.insert(history.end(), taps / 2, 0.0f);
+    const uint64_t total = (inputCount * up + down - 1) / down;
+    produce(out, total);
+    reset();
+}
+
+StreamingResampler::StreamingResampler(size_t orig_sr, size_t out_sr, int channels, ResampleQuality quality)
+    : orig_sr(orig_sr), out_sr(out_sr), channels(channels)
+{
+    if(orig_sr == out_sr)
+        return;
+
+    if(quality == ResampleQuality::Polyphase && channels == 1) {
+        polyphase = PolyphaseResampler::create(orig_sr, out_sr);
+        if(polyphase)
+            return;
+    }
+
+    soxr_io_spec_t io_spec = soxr_io_spec(SOXR_INT16_I, SOXR_INT16_I);
+    soxr_quality_spec_t q_spec = soxr_quality_spec(soxrQualityRecipe(quality), 0);
+    soxr_error_t error;
+    soxr = std::shared_ptr<std::remove_pointer_t<soxr_t>>(
+        soxr_create(orig_sr, out_sr, channels, &error, &io_spec, &q_spec, NULL),
+        &soxr_delete);
+    if(error != NULL)
+        throw std::runtime_error("soxr_create failed");
+}
+
+void StreamingResampler::process(std::span<const short> data, std::vector<short>& out)
+{
+    if(data.empty())
+        return;
+    if(polyphase) {
+        polyphase->process(data, out);
+        return;
+    }
+    if(!soxr) {
+        out.insert(out.end(), data.begin(), data.end());
+        return;
+    }
+
+    size_t frames = data.size() / channels;
+    const short* in = data.data();
+    while(frames > 0) {
+        size_t capacity = frames * out_sr / orig_sr + 64;
+        size_t oldSize = out.size();
+        out.resize(oldSize + capacity * channels);
+        size_t idone, odone;
+        soxr_error_t error = soxr_process(soxr.get(), in, frames, &idone,
+            out.data() + oldSize, capacity, &odone);
+        out.resize(oldSize + odone * channels);
+        if(error != NULL)
+            throw std::runtime_error("soxr_process failed");
+        in += idone * channels;
+        frames -= idone;
+    }
+}
+
+void StreamingResampler::flush(std::vector<short>& out)
+{
+    if(polyphase) {
+        polyphase->flush(out);
+        return;
+    }
+    if(!soxr)
+        return;
+
+    // Passing no input tells soxr the stream ended, keep going until the
+    // filter is drained
+    constexpr size_t capacity = 1024;
+    while(true) {
+        size_t oldSize = out.size();
+        out.resize(oldSize + capacity * channels);
+        size_t odone;
+        soxr_error_t error = soxr_process(soxr.get(), NULL, 0, NULL,
+            out.data() + oldSize, capacity, &odone);
+        out.resize(oldSize + odone * channels);
+        if(error != NULL)
+            throw std::runtime_error("soxr_process failed");
+        if(odone == 0)
+            break;
+    }
+    soxr_clear(soxr.get());
+}
+
+void StreamingResampler::reset()
+{
+    if(polyphase)
+        polyphase->reset();
+    if(soxr)
+        soxr_clear(soxr.get());
+}
+
+std::vector<short> resample(std::span<const short> input, size_t orig_sr, size_t out_sr, int channels, ResampleQuality quality)
+{
+    StreamingResampler resampler(orig_sr, out_sr, channels, quality);
+    std::vector<short> output;
+    output.reserve(input.size() * out_sr / orig_sr + 64);
+    resampler.process(input, output);
+    resampler.flush(output);
+    return output;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <type_traits>
+#include <soxr.h>
+
+enum class ResampleQuality
+{
+    // Built-in polyphase FIR. Only used for small ratios such as 22050->24000
+    // and 16000->24000, other ratios fall back to soxr medium quality. Flat to
+    // 85% of the lower Nyquist frequency with about 80 dB of rejection.
+    Polyphase,
+    Quick,
+    Low,
+    Medium,
+    High,
+    VeryHigh,
+};
+
+// Parse "polyphase", "quick", "low", "medium", "high" or "veryhigh"
+ResampleQuality parseResampleQuality(const std::string& name);
+
+// Polyphase FIR resampler for mono audio with a small rational ratio
+struct PolyphaseResampler {
+    // Taps per phase, must be a multiple of 8. Fewer taps widen the
+    // transition band, 16 already loses the top of a 22050 Hz voice.
+    static constexpr size_t taps = 64;
+    static constexpr size_t maxUpFactor = 160;
+
+    // Returns nullptr if the ratio is not supported
+    static std::unique_ptr<PolyphaseResampler> create(size_t orig_sr, size_t out_sr);
+
+    PolyphaseResampler(size_t up, size_t down);
+
+    void process(std::span<const short> data, std::vector<short>& out);
+    void flush(std::vector<short>& out);
+    void reset();
+
+    size_t up;
+    size_t down;
+    // Coefficients of phase p are coeffs[p * taps, (p + 1) * taps)
+    std::vector<float> coeffs;
+    // Input samples still needed by future output samples
+    std::vector<float> history;
+    // Absolute input index of history[0]
+    int64_t historyStart;
+    uint64_t inputCount;
+    uint64_t outputCount;
+
+private:
+    void produce(std::vector<short>& out, uint64_t maxOutput);
+};
+
+// Resampler that keeps its filter state across chunks of the same stream.
+// Feed audio with process() and call flush() at the end of the stream to get
+// the filter's tail. The resampler can be reused for another stream after
+// flush().
+struct StreamingResampler {
+    StreamingResampler(size_t orig_sr, size_t out_sr, int channels,
+        ResampleQuality quality = ResampleQuality::Medium);
+
+    // Resample a chunk, appending the result to out
+    void process(std::span<const short> data, std::vector<short>& out);
+    // Drain the filter, appending the result to out, and reset
+    void flush(std::vector<short>& out);
+    // Drop any buffered state
+    void reset();
+
+    size_t orig_sr;
+    size_t out_sr;
+    int channels;
+    std::shared_ptr<std::remove_pointer_t<soxr_t>> soxr;
+    std::unique_ptr<PolyphaseResampler> polyphase;
+};
+
+// Resample a complete buffer
+std::vector<short> resample(std::span<const short> input, size_t orig_sr, size_t out_sr, int channels,
+    ResampleQuality quality = ResampleQuality::Medium);
@@ -0,0 +1,124 @@
+#include "ResponseCache.hpp"
+
+#include <cstdio>
+
+// 64 bit FNV-1a, good enough to tell responses apart
+static uint64_t hashBytes(const std::string& data)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(unsigned char c : data) {
+        hash ^= c;
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+CachedResponse::CachedResponse(std::string body, std::string contentType)
+    : body(std::move(body)), contentType(std::move(contentType))
+{
+    char buf[24];
+    snprintf(buf, sizeof(buf), "\"%016llx\"", (unsigned long long)hashBytes(this->body));
+    etag = buf;
+}
+
+ResponseCache::Ticket::Ticket(ResponseCache& cache, std::string key)
+    : cache(cache), key(std::move(key))
+{
+}
+
+ResponseCache::Ticket::~Ticket()
+{
+    if(!done)
+        cache.finish(key, nullptr);
+}
+
+void ResponseCache::Ticket::fulfill(ResponsePtr response)
+{
+    if(done)
+        return;
+    done = true;
+    cache.finish(key, std::move(response));
+}
+
+ResponseCache::ResponseCache(size_t capacityBytes)
+    : capacityBytes(capacityBytes)
+{
+}
+
+bool ResponseCache::lookup(const std::string& key, Lookup& result, std::function<void(Lookup)> onReady)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(key);
+    if(it != index.end()) {
+        entries.splice(entries.begin(), entries, it->second);
+        counters.hits++;
+        result.response = it->second->response;
+        return true;
+    }
+
+    auto flight = inflight.find(key);
+    if(flight != inflight.end()) {
+        counters.coalesced++;
+        flight->second.push_back(std::move(onReady));
+        return false;
+    }
+
+    counters.misses++;
+    inflight.emplace(key, std::vector<std::function<void(Lookup)>>{});
+    result.ticket = std::make_shared<Ticket>(*this, key);
+    return true;
+}
+
+void ResponseCache::finish(const std::string& key, ResponsePtr response)
+{
+    std::vector<std::function<void(Lookup)>> waiters;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(response)
+            insertLocked(key, response);
+        auto flight = inflight.find(key);
+        if(flight != inflight.end()) {
+            waiters = std::move(flight->second);
+            inflight.erase(flight);
+        }
+    }
+    for(auto& waiter : waiters)
+        waiter(Lookup{response, nullptr});
+}
+
+void ResponseCache::insertLocked(const std::string& key, ResponsePtr response)
+{
+    const size_t size = response->body.size() + key.size();
+    if(size > maxEntryBytes())
+        return;
+
+    auto it = index.find(key);
+    if(it != index.end()) {
+        usedBytes -= it->second->response->body.size() + key.size();
+        entries.erase(it->second);
+        index.erase(it);
+    }
+
+    while(!entries.empty() && usedBytes + size > capacityBytes) {
+        auto& last = entries.back();
+        usedBytes -= last.response->body.size() + last.key.size();
+        index.erase(last.key);
+        entries.pop_back();
+        counters.evictions++;
+    }
+
+    entries.push_front(Entry{key, std::move(response)});
+    index.emplace(key, entries.begin());
+    usedBytes += size;
+    counters.insertions++;
+}
+
+ResponseCacheStats ResponseCache::stats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    ResponseCacheStats res = counters;
+    res.entries = entries.size();
+    res.bytes = usedBytes;
+    res.capacity = capacityBytes;
+    return res;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A finished response as sent to the client
+struct CachedResponse
+{
+    CachedResponse(std::string body, std::string contentType);
+
+    std::string body;
+    std::string contentType;
+    // Quoted hash of the body, for ETag/If-None-Match
+    std::string etag;
+};
+
+struct ResponseCacheStats
+{
+    size_t hits = 0;
+    size_t misses = 0;
+    // Requests that waited for an identical one instead of synthesizing
+    size_t coalesced = 0;
+    size_t insertions = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t capacity = 0;
+};
+
+// Memory bounded LRU cache of whole responses. Identical requests arriving
+// while one of them is synthesizing wait for its result instead of running
+// their own synthesis.
+class ResponseCache
+{
+public:
+    using ResponsePtr = std::shared_ptr<const CachedResponse>;
+
+    // Handed to the one request synthesizing a key. Requests waiting on the
+    // key get what is passed to fulfill(), or nothing if the ticket is
+    // dropped without, in which case they synthesize on their own.
+    class Ticket
+    {
+    public:
+        Ticket(ResponseCache& cache, std::string key);
+        ~Ticket();
+        Ticket(const Ticket&) = delete;
+        Ticket& operator=(const Ticket&) = delete;
+
+        // Caches response and hands it to the waiting requests
+        void fulfill(ResponsePtr response);
+
+    private:
+        ResponseCache& cache;
+        std::string key;
+        bool done = false;
+    };
+
+    struct Lookup
+    {
+        // Set on a hit, or when an identical request finished for us
+        ResponsePtr response;
+        // Set if we are the one to synthesize
+        std::shared_ptr<Ticket> ticket;
+    };
+
+    explicit ResponseCache(size_t capacityBytes);
+
+    // Returns true if the result is known right away. Otherwise onReady is
+    // called once the identical request in flight is done, possibly on
+    // another thread
+    bool lookup(const std::string& key, Lookup& result, std::function<void(Lookup)> onReady);
+
+    ResponseCacheStats stats();
+
+    // Largest response worth caching
+    size_t maxEntryBytes() const { return capacityBytes / 4; }
+
+private:
+    struct Entry
+    {
+        std::string key;
+        ResponsePtr response;
+    };
+
+    void finish(const std::string& key, ResponsePtr response);
+    void insertLocked(const std::string& key, ResponsePtr response);
+
+    std::mutex mutex;
+    const size_t capacityBytes;
+    size_t usedBytes = 0;
+    // Most recently used first
+    std::list<Entry> entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    // Requests waiting on a key being synthesized
+    std::unordered_map<std::string, std::vector<std::function<void(Lookup)>>> inflight;
+    ResponseCacheStats counters;
+};
@@ -0,0 +1,246 @@
+#include "ShardCluster.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include <drogon/HttpRequest.h>
+#include <drogon/HttpResponse.h>
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+
+using namespace drogon;
+
+// Connections to each worker, so a long sentence doesn't hold up the next
+static constexpr size_t CONNECTIONS_PER_WORKER = 4;
+// Tries per sentence, on different workers where possible
+static constexpr size_t MAX_ATTEMPTS = 3;
+static constexpr double SHARD_TIMEOUT_SECONDS = 60.0;
+static constexpr double HEALTH_CHECK_INTERVAL_SECONDS = 2.0;
+static constexpr double HEALTH_CHECK_TIMEOUT_SECONDS = 2.0;
+
+std::string makeShardRequest(const piper::PhonemeSentence& sentence, const ShardOptions& options)
+{
+    nlohmann::json json;
+    json["voice"] = options.voice;
+    json["phrases"] = nlohmann::json::array();
+    for(const auto& phrase : sentence.phrases) {
+        json["phrases"].push_back({
+            {"phoneme_ids", phrase.phonemeIds},
+            {"silence_seconds", phrase.silenceSeconds},
+        });
+    }
+    if(options.speakerId.has_value())
+        json["speaker_id"] = *options.speakerId;
+    if(options.noiseScale.has_value())
+        json["noise_scale"] = *options.noiseScale;
+    if(options.lengthScale.has_value())
+        json["length_scale"] = *options.lengthScale;
+    if(options.noiseW.has_value())
+        json["noise_w"] = *options.noiseW;
+    if(options.seed.has_value())
+        json["seed"] = *options.seed;
+    json["sentence_silence_seconds"] = options.sentenceSilenceSeconds;
+    return json.dump();
+}
+
+void parseShardRequest(std::string_view body, piper::PhonemeSentence& sentence, ShardOptions& options)
+{
+    auto json = nlohmann::json::parse(body, nullptr, false);
+    if(json.is_discarded() || !json.is_object())
+        throw std::runtime_error("Shard request must be a JSON object");
+    if(!json.contains("phrases"))
+        throw std::runtime_error("Missing 'phrases' field");
+    sentence = piper::parsePhonemeSentence(json["phrases"]);
+    if(!json.contains("voice") || !json["voice"].is_string())
+        throw std::runtime_error("Missing 'voice' field");
+    options.voice = json["voice"].get<std::string>();
+
+    auto number = [&](const char* key) -> std::optional<float> {
+        if(!json.contains(key))
+            return std::nullopt;
+        if(!json[key].is_number())
+            throw std::runtime_error(std::string(key) + " must be a number");
+        return json[key].get<float>();
+    };
+    options.noiseScale = number("noise_scale");
+    options.lengthScale = number("length_scale");
+    options.noiseW = number("noise_w");
+    if(json.contains("speaker_id")) {
+        if(!json["speaker_id"].is_number_unsigned())
+            throw std::runtime_error("speaker_id must be a non-negative integer");
+        options.speakerId = json["speaker_id"].get<size_t>();
+    }
+    if(json.contains("seed")) {
+        if(!json["seed"].is_number_unsigned())
+            throw std::runtime_error("seed must be a non-negative integer");
+        options.seed = json["seed"].get<uint64_t>();
+    }
+    auto silence = number("sentence_silence_seconds");
+    if(!silence.has_value())
+        throw std::runtime_error("Missing 'sentence_silence_seconds' field");
+    if(!std::isfinite(*silence) || *silence < 0)
+        throw std::runtime_error("sentence_silence_seconds must be a non-negative number");
+    options.sentenceSilenceSeconds = *silence;
+}
+
+ShardCluster::ShardCluster(const std::vector<std::string>& urls, std::string authToken,
+    std::function<std::string()> voiceDigest)
+    : authToken(std::move(authToken)), voiceDigest(std::move(voiceDigest))
+{
+    thread.run();
+    auto loop = thread.getLoop();
+    for(const auto& url : urls) {
+        auto worker = std::make_unique<Worker>();
+        worker->url = url;
+        for(size_t i = 0; i < CONNECTIONS_PER_WORKER; i++)
+            worker->clients.push_back(HttpClient::newHttpClient(url, loop));
+        worker->clientInFlight.resize(CONNECTIONS_PER_WORKER);
+        worker->healthClient = HttpClient::newHttpClient(url, loop);
+        workers.push_back(std::move(worker));
+    }
+    spdlog::info("Sharding sentences over {} worker(s)", workers.size());
+
+    loop->queueInLoop([this]() { checkHealth(); });
+    loop->runEvery(HEALTH_CHECK_INTERVAL_SECONDS, [this]() { checkHealth(); });
+}
+
+void ShardCluster::checkHealth()
+{
+    // A sentence without phrases, which workers only check
+    ShardOptions options;
+    options.voice = voiceDigest();
+    const auto body = makeShardRequest({}, options);
+    for(auto& worker : workers) {
+        auto req = HttpRequest::newHttpRequest();
+        req->setMethod(Post);
+        req->setPath("/api/v1/shard");
+        req->setContentTypeCode(CT_APPLICATION_JSON);
+        req->setBody(body);
+        if(!authToken.empty())
+            req->addHeader("Authorization", "Bearer " + authToken);
+        worker->healthClient->sendRequest(req, [worker = worker.get()](ReqResult result, const HttpResponsePtr& resp) {
+            const bool healthy = result == ReqResult::Ok && resp->statusCode() == k200OK;
+            if(healthy == worker->healthy.exchange(healthy))
+                return;
+            if(healthy)
+                spdlog::info("Worker {} is ready", worker->url);
+            else if(result != ReqResult::Ok)
+                spdlog::info("Worker {} is not ready", worker->url);
+            else
+                spdlog::warn("Worker {} is not ready, status {}: {}", worker->url, (int)resp->statusCode(), resp->body());
+        }, HEALTH_CHECK_TIMEOUT_SECONDS);
+    }
+}
+
+std::optional<size_t> ShardCluster::pick(const std::vector<size_t>& tried) const
+{
+    // Prefer workers this sentence hasn't failed on
+    for(bool allowTried : {false, true}) {
+        std::optional<size_t> best;
+        for(size_t i = 0; i < workers.size(); i++) {
+            if(!workers[i]->healthy)
+                continue;
+            if(!allowTried && std::find(tried.begin(), tried.end(), i) != tried.end())
+                continue;
+            if(!best || workers[i]->inFlight < workers[*best]->inFlight)
+                best = i;
+        }
+        if(best)
+            return best;
+    }
+    return std::nullopt;
+}
+
+void ShardCluster::synthesize(const piper::PhonemeSentence& sentence, const ShardOptions& options,
+    int sampleRate, Callback callback)
+{
+    auto job = std::make_shared<Job>();
+    job->body = makeShardRequest(sentence, options);
+    job->sampleRate = sampleRate;
+    job->callback = std::move(callback);
+    thread.getLoop()->queueInLoop([this, job]() { send(job); });
+}
+
+void ShardCluster::send(std::shared_ptr<Job> job)
+{
+    auto index = job->tried.size() < MAX_ATTEMPTS ? pick(job->tried) : std::nullopt;
+    if(!index) {
+        fallbacks++;
+        job->callback(std::nullopt);
+        return;
+    }
+    if(!job->tried.empty())
+        retries++;
+    job->tried.push_back(*index);
+
+    auto& worker = *workers[*index];
+    auto client = std::min_element(worker.clientInFlight.begin(), worker.clientInFlight.end())
+        - worker.clientInFlight.begin();
+    worker.clientInFlight[client]++;
+    worker.inFlight++;
+
+    auto req = HttpRequest::newHttpRequest();
+    req->setMethod(Post);
+    req->setPath("/api/v1/shard");
+    req->setContentTypeCode(CT_APPLICATION_JSON);
+    req->setBody(job->body);
+    if(!authToken.empty())
+        req->addHeader("Authorization", "Bearer " + authToken);
+
+    worker.clients[client]->sendRequest(req, [this, job, &worker, client](ReqResult result, const HttpResponsePtr& resp) {
+        worker.clientInFlight[client]--;
+        worker.inFlight--;
+
+        // Another worker would reject it as well. The coordinator synthesizes
+        // the sentence and reports what is wrong with it, if anything. A
+        // worker refusing the token or serving another voice is at fault
+        // itself though.
+        if(result == ReqResult::Ok && resp->statusCode() >= k400BadRequest && resp->statusCode() < k500InternalServerError
+            && resp->statusCode() != k401Unauthorized && resp->statusCode() != k409Conflict) {
+            spdlog::warn("Worker {} rejected a sentence, status {}: {}", worker.url, (int)resp->statusCode(), resp->body());
+            fallbacks++;
+            job->callback(std::nullopt);
+            return;
+        }
+
+        std::string error;
+        if(result != ReqResult::Ok)
+            error = "request failed (" + std::to_string((int)result) + ")";
+        else if(resp->statusCode() != k200OK)
+            error = "status " + std::to_string(resp->statusCode()) + ": " + std::string(resp->body());
+        else if(resp->getHeader("X-Sample-Rate") != std::to_string(job->sampleRate))
+            error = "sample rate " + resp->getHeader("X-Sample-Rate") + " instead of " + std::to_string(job->sampleRate);
+
+        if(error.empty()) {
+            auto body = resp->body();
+            std::vector<int16_t> audio(body.size() / sizeof(int16_t));
+            memcpy(audio.data(), body.data(), audio.size() * sizeof(int16_t));
+            worker.shards++;
+            job->callback(std::move(audio));
+            return;
+        }
+
+        spdlog::warn("Sentence failed on worker {}: {}", worker.url, error);
+        worker.failures++;
+        // Out of rotation until the next health check says otherwise
+        worker.healthy = false;
+        send(job);
+    }, SHARD_TIMEOUT_SECONDS);
+}
+
+ShardClusterStats ShardCluster::stats() const
+{
+    ShardClusterStats stats;
+    stats.workers = workers.size();
+    for(const auto& worker : workers) {
+        stats.healthy += worker->healthy;
+        stats.inFlight += worker->inFlight;
+        stats.shards += worker->shards;
+        stats.failures += worker->failures;
+    }
+    stats.retries = retries;
+    stats.fallbacks = fallbacks;
+    return stats;
+}
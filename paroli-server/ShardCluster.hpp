@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <drogon/HttpClient.h>
+#include <trantor/net/EventLoopThread.h>
+
+#include "piper.hpp"
+
+// Settings a sentence is synthesized with, besides its phoneme ids
+struct ShardOptions
+{
+    // configDigest of the voice the phoneme ids are for, workers serving
+    // another voice refuse the sentence
+    std::string voice;
+    std::optional<size_t> speakerId;
+    std::optional<float> noiseScale;
+    std::optional<float> lengthScale;
+    std::optional<float> noiseW;
+    std::optional<uint64_t> seed;
+    // The coordinator's, workers may have been started with another one
+    float sentenceSilenceSeconds = 0;
+};
+
+// Body of a /api/v1/shard request and its parser, which throws on malformed
+// requests
+std::string makeShardRequest(const piper::PhonemeSentence& sentence, const ShardOptions& options);
+void parseShardRequest(std::string_view body, piper::PhonemeSentence& sentence, ShardOptions& options);
+
+struct ShardClusterStats
+{
+    size_t workers = 0;
+    size_t healthy = 0;
+    size_t inFlight = 0;
+    size_t shards = 0;
+    size_t failures = 0;
+    size_t retries = 0;
+    // Sentences no worker could synthesize, left to the coordinator
+    size_t fallbacks = 0;
+};
+
+// The paroli-server instances a coordinator hands sentences to. Every few
+// seconds each worker is sent an empty sentence, which only succeeds if the
+// worker is ready, accepts the token and serves the coordinator's voice. A
+// sentence goes to the healthy worker with the fewest sentences in flight. A
+// sentence failing on one worker is retried on another, a few times.
+class ShardCluster
+{
+public:
+    // Gets the sentence's PCM, or nothing if no worker synthesized it
+    using Callback = std::function<void(std::optional<std::vector<int16_t>> audio)>;
+
+    // urls like http://10.0.0.2:8848, the token is sent as bearer token.
+    // voiceDigest gives the configDigest of the coordinator's current voice.
+    ShardCluster(const std::vector<std::string>& urls, std::string authToken,
+        std::function<std::string()> voiceDigest);
+    ShardCluster(const ShardCluster&) = delete;
+    ShardCluster& operator=(const ShardCluster&) = delete;
+
+    // Returns right away, callback is called on the cluster's own thread.
+    // Workers must answer with sampleRate, or they count as failed.
+    void synthesize(const piper::PhonemeSentence& sentence, const ShardOptions& options,
+        int sampleRate, Callback callback);
+
+    ShardClusterStats stats() const;
+
+private:
+    struct Worker
+    {
+        std::string url;
+        // Sentences go over the least busy connection
+        std::vector<drogon::HttpClientPtr> clients;
+        std::vector<size_t> clientInFlight;
+        // Of its own, so checks don't queue behind sentences
+        drogon::HttpClientPtr healthClient;
+        std::atomic<bool> healthy{false};
+        std::atomic<size_t> inFlight{0};
+        std::atomic<size_t> shards{0};
+        std::atomic<size_t> failures{0};
+    };
+    struct Job
+    {
+        std::string body;
+        int sampleRate;
+        Callback callback;
+        std::vector<size_t> tried;
+    };
+
+    // Only called on the cluster's thread
+    void send(std::shared_ptr<Job> job);
+    std::optional<size_t> pick(const std::vector<size_t>& tried) const;
+    void checkHealth();
+
+    std::string authToken;
+    std::function<std::string()> voiceDigest;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> retries{0};
+    std::atomic<size_t> fallbacks{0};
+    // Last, so the loop stops before the clients go away
+    trantor::EventLoopThread thread{"shard cluster"};
+};
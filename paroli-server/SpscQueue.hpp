@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+
+// Bounded lock free queue for exactly one producer and one consumer thread.
+// The producer and consumer may change over time as long as the hand over is
+// synchronized by other means (ex: a mutex or a task queue).
+template <typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(size_t capacity)
+        : mask(std::bit_ceil(capacity < 2 ? 2 : capacity) - 1)
+        , slots(std::make_unique<T[]>(mask + 1))
+    {
+    }
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // Producer side. Returns false if the queue is full, item is left untouched
+    bool tryPush(T&& item)
+    {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if(t - cachedHead > mask) {
+            cachedHead = head.load(std::memory_order_acquire);
+            if(t - cachedHead > mask)
+                return false;
+        }
+        slots[t & mask] = std::move(item);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns false if the queue is empty
+    bool tryPop(T& item)
+    {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if(h == cachedTail) {
+            cachedTail = tail.load(std::memory_order_acquire);
+            if(h == cachedTail)
+                return false;
+        }
+        item = std::move(slots[h & mask]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+private:
+    static constexpr size_t cacheLine = 64;
+
+    const size_t mask;
+    std::unique_ptr<T[]> slots;
+    // Written by the consumer. Kept on separate cache lines from the
+    // producer's state to avoid false sharing
+    alignas(cacheLine) std::atomic<size_t> head{0};
+    size_t cachedTail = 0;
+    // Written by the producer
+    alignas(cacheLine) std::atomic<size_t> tail{0};
+    size_t cachedHead = 0;
+};
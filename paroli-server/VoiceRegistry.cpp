@@ -0,0 +1,241 @@
+#include "VoiceRegistry.hpp"
+
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+
+// First file in directory named stem.<anything>
+static std::optional<std::filesystem::path> findModelFile(const std::filesystem::path& directory, const std::string& stem)
+{
+    for(const auto& file : std::filesystem::directory_iterator(directory)) {
+        if(file.is_regular_file() && file.path().stem() == stem)
+            return file.path();
+    }
+    return std::nullopt;
+}
+
+// Model files, plus the sentence cache
+static size_t voiceBytes(const VoiceRegistry::Files& files, const piper::Voice& voice)
+{
+    return std::filesystem::file_size(files.encoder)
+        + std::filesystem::file_size(files.decoder)
+        + (voice.sentenceCache ? voice.sentenceCache->capacity() : 0);
+}
+
+VoiceRegistry::VoiceRegistry(const std::filesystem::path& directory, size_t budgetBytes, Loader loader)
+    : budgetBytes(budgetBytes), loader(std::move(loader))
+{
+    if(!std::filesystem::is_directory(directory))
+        throw std::runtime_error("Voice directory doesn't exist: " + directory.string());
+
+    for(const auto& dir : std::filesystem::directory_iterator(directory)) {
+        if(!dir.is_directory())
+            continue;
+        const auto name = dir.path().filename().string();
+        auto encoder = findModelFile(dir.path(), "encoder");
+        auto decoder = findModelFile(dir.path(), "decoder");
+        auto config = dir.path() / "config.json";
+        if(!encoder || !decoder || !std::filesystem::exists(config)) {
+            spdlog::warn("Skipping voice {}, it needs an encoder, a decoder and a config.json", name);
+            continue;
+        }
+
+        Entry entry;
+        entry.files = {*encoder, *decoder, config};
+        entry.bytes = std::filesystem::file_size(*encoder) + std::filesystem::file_size(*decoder);
+        std::ifstream configFile(config);
+        auto configRoot = nlohmann::json::parse(configFile);
+        if(configRoot.contains("speaker_id_map")) {
+            for(auto& [speaker, id] : configRoot["speaker_id_map"].items())
+                entry.speakers[speaker] = id.get<piper::SpeakerId>();
+        }
+        entries.emplace(name, std::move(entry));
+    }
+    spdlog::info("Found {} voice(s) in {}", entries.size(), directory.string());
+}
+
+VoiceRegistry::Entry& VoiceRegistry::find(const std::string& name)
+{
+    auto it = entries.find(name);
+    if(it == entries.end())
+        throw std::runtime_error("Unknown voice " + name);
+    return it->second;
+}
+
+bool VoiceRegistry::contains(const std::string& name) const
+{
+    return entries.contains(name);
+}
+
+std::vector<std::string> VoiceRegistry::names() const
+{
+    std::vector<std::string> result;
+    result.reserve(entries.size());
+    for(const auto& [name, entry] : entries)
+        result.push_back(name);
+    return result;
+}
+
+std::map<std::string, piper::SpeakerId> VoiceRegistry::speakers(const std::string& name) const
+{
+    auto it = entries.find(name);
+    if(it == entries.end())
+        throw std::runtime_error("Unknown voice " + name);
+    return it->second.speakers;
+}
+
+bool VoiceRegistry::isLoaded(const std::string& name)
+{
+    auto& entry = find(name);
+    std::lock_guard<std::mutex> lock(mutex);
+    return entry.voice != nullptr;
+}
+
+VoiceRegistry::VoicePtr VoiceRegistry::tryGet(const std::string& name)
+{
+    auto& entry = find(name);
+    std::lock_guard<std::mutex> lock(mutex);
+    if(entry.voice)
+        entry.lastUsed = ++useClock;
+    return entry.voice;
+}
+
+VoiceRegistry::VoicePtr VoiceRegistry::get(const std::string& name)
+{
+    auto& entry = find(name);
+    std::promise<VoicePtr> promise;
+    std::shared_future<VoicePtr> loading;
+    std::vector<VoicePtr> evicted;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        entry.lastUsed = ++useClock;
+        if(entry.voice)
+            return entry.voice;
+        // Someone else is loading it already
+        if(entry.loading.valid())
+            loading = entry.loading;
+        else {
+            entry.loading = promise.get_future().share();
+            evicted = evictLocked(entry.bytes);
+            loadedBytes += entry.bytes;
+        }
+    }
+    if(loading.valid())
+        return loading.get();
+    evicted.clear();
+
+    try {
+        spdlog::info("Loading voice {}", name);
+        auto voice = std::make_shared<piper::Voice>();
+        loader(entry.files, *voice);
+
+        const size_t bytes = voiceBytes(entry.files, *voice);
+        std::lock_guard<std::mutex> lock(mutex);
+        loadedBytes += bytes - entry.bytes;
+        entry.bytes = bytes;
+        entry.voice = voice;
+        entry.loading = {};
+        loadCount++;
+        promise.set_value(voice);
+        return voice;
+    }
+    catch(...) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            loadedBytes -= entry.bytes;
+            entry.loading = {};
+        }
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+}
+
+size_t VoiceRegistry::reload()
+{
+    std::vector<std::string> loaded;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for(const auto& [name, entry] : entries) {
+            if(entry.voice)
+                loaded.push_back(name);
+        }
+    }
+
+    size_t reloaded = 0;
+    std::exception_ptr error;
+    for(const auto& name : loaded) {
+        auto& entry = find(name);
+        auto voice = std::make_shared<piper::Voice>();
+        try {
+            spdlog::info("Reloading voice {}", name);
+            loader(entry.files, *voice);
+        }
+        catch(const std::exception& e) {
+            spdlog::error("Cannot reload voice {}: {}", name, e.what());
+            if(!error)
+                error = std::current_exception();
+            continue;
+        }
+
+        const size_t bytes = voiceBytes(entry.files, *voice);
+        // Destroyed after the lock is released, unless requests still hold it
+        VoicePtr old;
+        std::lock_guard<std::mutex> lock(mutex);
+        // Unloaded meanwhile, the next use loads the new files anyway
+        if(!entry.voice)
+            continue;
+        old = std::move(entry.voice);
+        entry.voice = std::move(voice);
+        loadedBytes += bytes - entry.bytes;
+        entry.bytes = bytes;
+        reloaded++;
+    }
+    if(error)
+        std::rethrow_exception(error);
+    return reloaded;
+}
+
+std::vector<VoiceRegistry::VoicePtr> VoiceRegistry::evictLocked(size_t incoming)
+{
+    std::vector<VoicePtr> evicted;
+    while(budgetBytes > 0 && loadedBytes + incoming > budgetBytes) {
+        Entry* victim = nullptr;
+        std::string victimName;
+        for(auto& [name, entry] : entries) {
+            // Requests still use voices referenced from elsewhere
+            if(!entry.voice || entry.voice.use_count() > 1)
+                continue;
+            if(!victim || entry.lastUsed < victim->lastUsed) {
+                victim = &entry;
+                victimName = name;
+            }
+        }
+        if(!victim) {
+            spdlog::warn("Voice memory budget exceeded, all loaded voices are in use");
+            break;
+        }
+        spdlog::info("Unloading voice {}", victimName);
+        evicted.push_back(std::move(victim->voice));
+        victim->voice = nullptr;
+        loadedBytes -= victim->bytes;
+        evictionCount++;
+    }
+    return evicted;
+}
+
+VoiceRegistryStats VoiceRegistry::stats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    VoiceRegistryStats stats;
+    stats.voices = entries.size();
+    for(const auto& [name, entry] : entries)
+        stats.loaded += entry.voice != nullptr;
+    stats.loads = loadCount;
+    stats.evictions = evictionCount;
+    stats.bytes = loadedBytes;
+    stats.budget = budgetBytes;
+    return stats;
+}
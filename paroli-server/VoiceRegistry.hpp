@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "piper.hpp"
+
+struct VoiceRegistryStats
+{
+    size_t voices = 0;
+    size_t loaded = 0;
+    size_t loads = 0;
+    size_t evictions = 0;
+    // Estimated memory of the loaded voices
+    size_t bytes = 0;
+    size_t budget = 0;
+};
+
+// The voices in a directory, one sub directory per voice holding its
+// encoder.*, decoder.* and config.json. The sub directory's name is the
+// voice's name. Voices are loaded on first use. Before loading one would take
+// the estimated memory of the loaded voices over the budget, voices no request
+// holds on to are unloaded, least recently used first.
+class VoiceRegistry
+{
+public:
+    using VoicePtr = std::shared_ptr<piper::Voice>;
+    struct Files
+    {
+        std::filesystem::path encoder;
+        std::filesystem::path decoder;
+        std::filesystem::path config;
+    };
+    // Loads the voice from its files, with the server wide settings applied
+    using Loader = std::function<void(const Files& files, piper::Voice& voice)>;
+
+    // A budget of 0 means no limit
+    VoiceRegistry(const std::filesystem::path& directory, size_t budgetBytes, Loader loader);
+    VoiceRegistry(const VoiceRegistry&) = delete;
+    VoiceRegistry& operator=(const VoiceRegistry&) = delete;
+
+    bool contains(const std::string& name) const;
+    std::vector<std::string> names() const;
+
+    // The voice if it is loaded, nullptr otherwise
+    VoicePtr tryGet(const std::string& name);
+
+    // Loads the voice if needed, blocking. Concurrent calls for the same voice
+    // wait for a single load. Throws if the voice is unknown or fails to load.
+    VoicePtr get(const std::string& name);
+
+    // Loads the loaded voices again from their files and swaps them in. Requests
+    // holding the old voices finish on them. A voice failing to load keeps the
+    // old one, the first error is thrown after trying all.
+    size_t reload();
+
+    // Speaker name to id, from the config so the voice needn't be loaded
+    std::map<std::string, piper::SpeakerId> speakers(const std::string& name) const;
+    bool isLoaded(const std::string& name);
+
+    VoiceRegistryStats stats();
+
+private:
+    struct Entry
+    {
+        Files files;
+        std::map<std::string, piper::SpeakerId> speakers;
+        // Model files, plus the sentence cache once it is known
+        size_t bytes = 0;
+        VoicePtr voice;
+        std::shared_future<VoicePtr> loading;
+        uint64_t lastUsed = 0;
+    };
+
+    // Unload idle voices until incoming bytes fit the budget. The voices are
+    // handed back to be destroyed outside the lock.
+    std::vector<VoicePtr> evictLocked(size_t incoming);
+
+    Entry& find(const std::string& name);
+
+    // Fixed after construction, only the entries' state changes
+    std::map<std::string, Entry> entries;
+    size_t budgetBytes;
+    Loader loader;
+
+    std::mutex mutex;
+    uint64_t useClock = 0;
+    size_t loadedBytes = 0;
+    size_t loadCount = 0;
+    size_t evictionCount = 0;
+};
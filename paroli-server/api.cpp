@@ -1,151 +1,224 @@
 #include <drogon/drogon.h>
 #include <drogon/HttpController.h>
 #include <drogon/WebSocketController.h>
+#include <trantor/net/EventLoopThread.h>
 #include <trantor/net/EventLoopThreadPool.h>
 
 #include <span>
 #include <bit>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <coroutine>
 #include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <thread>
 
 #include "piper.hpp"
+#include "audio-store.hpp"
+#include "wavfile.hpp"
 #include "OggOpusEncoder.hpp"
+#include "OpusPacketEncoder.hpp"
+#include "Prefork.hpp"
+#include "Resampler.hpp"
+#include "ResponseCache.hpp"
+#include "ShardCluster.hpp"
+#include "SpscQueue.hpp"
+#include "VoiceRegistry.hpp"
 #include <nlohmann/json.hpp>
-#include <soxr.h>
 
 using namespace drogon;
 extern piper::PiperConfig piperConfig;
-extern piper::Voice voice;
+extern std::atomic<std::shared_ptr<piper::Voice>> defaultVoice;
+extern std::unique_ptr<VoiceRegistry> voiceRegistry;
 extern std::string authToken;
+extern ResampleQuality resampleQuality;
+extern bool parallelOpusEncode;
+extern size_t wsHighWaterMark;
+extern size_t wsLowWaterMark;
+extern size_t wsMaxConcurrentRequests;
+extern std::unique_ptr<ResponseCache> responseCache;
+extern bool responseCacheDeterministic;
+extern std::unique_ptr<piper::AudioStore> audioStore;
+extern std::atomic<bool> serverReady;
+extern std::function<bool()> reloadVoices;
+extern std::unique_ptr<SharedMetrics> sharedMetrics;
+extern size_t workerIndex;
+extern std::unique_ptr<ShardCluster> shardCluster;
 
 static constexpr size_t MAX_TEXT_LENGTH = 64 * 1024; // 64 KiB
+// About what phonemizing the longest text gives
+static constexpr size_t MAX_PHONEME_IDS = 4 * MAX_TEXT_LENGTH;
 trantor::EventLoopThreadPool synthesizerThreadPool(3, "synehesizer thread pool");
+// Resampling, encoding and sending, so the synthesizer threads only run inference
+trantor::EventLoopThreadPool postProcessThreadPool(2, "post-process thread pool");
+// Loads registry voices, which takes seconds, away from the synthesizer threads
+trantor::EventLoopThread voiceLoaderThread("voice loader");
+// Admin reloads, which re-read every loaded voice, so they don't hold up the
+// first use of other voices on the voice loader
+trantor::EventLoopThread voiceReloadThread("voice reload");
+
+// Audio of text from the on-disk audio store, if enabled and present
+static bool loadStoredAudio(
+    const piper::Voice& voice,
+    const std::string& text,
+    std::optional<size_t> speakerId,
+    std::optional<float> noiseScale,
+    std::optional<float> lengthScale,
+    std::optional<float> noiseW,
+    std::optional<uint64_t> seed,
+    std::vector<int16_t>& audio)
+{
+    // Requests with phoneme ids have no text to key the audio by
+    if(!audioStore || text.empty())
+        return false;
+    try {
+        return audioStore->getAudio(
+            piper::audioStoreKey(voice, text, speakerId, noiseScale, lengthScale, noiseW, seed), audio);
+    }
+    catch (const std::exception& e) {
+        LOG_ERROR << "Failed to read from audio store: " << e.what();
+        return false;
+    }
+}
+
+static void storeAudio(
+    const piper::Voice& voice,
+    const std::string& text,
+    std::optional<size_t> speakerId,
+    std::optional<float> noiseScale,
+    std::optional<float> lengthScale,
+    std::optional<float> noiseW,
+    std::optional<uint64_t> seed,
+    std::span<const int16_t> audio)
+{
+    if(!audioStore || text.empty() || audio.empty())
+        return;
+    try {
+        audioStore->putAudio(
+            piper::audioStoreKey(voice, text, speakerId, noiseScale, lengthScale, noiseW, seed), audio);
+    }
+    catch (const std::exception& e) {
+        LOG_ERROR << "Failed to write to audio store: " << e.what();
+    }
+}
+
+// The request's phoneme ids if it came with them, the phonemized text otherwise
+static piper::PhonemeData requestPhonemes(
+    piper::Voice& voice,
+    const std::string& text,
+    const std::optional<piper::PhonemeData>& phonemes)
+{
+    if(phonemes.has_value())
+        return *phonemes;
+    return piper::phonemize(piperConfig, voice, text);
+}
 
 template<typename Func>
 requires std::is_invocable_v<Func, const std::span<const short>>
 [[nodiscard]]
-auto speak(const std::string& text, std::optional<size_t> speaker_id, Func cb, std::optional<float> length_scale
-        , std::optional<float> noise_scale, std::optional<float> noise_w) -> bool
+auto speak(piper::Voice& voice, const std::string& text, const std::optional<piper::PhonemeData>& phonemes,
+        std::optional<size_t> speaker_id, Func cb, std::optional<float> length_scale
+        , std::optional<float> noise_scale, std::optional<float> noise_w, std::optional<uint64_t> seed) -> bool
 {
     std::vector<short> audioBuffer;
+    if(loadStoredAudio(voice, text, speaker_id, noise_scale, length_scale, noise_w, seed, audioBuffer)) {
+        cb(std::span<const short>(audioBuffer));
+        return true;
+    }
+
     piper::SynthesisResult result;
-    auto callback = [&audioBuffer, cb=std::move(cb)]() {
+    // Everything handed to cb so far, for the audio store
+    std::vector<short> spoken;
+    auto callback = [&audioBuffer, &spoken, cb=std::move(cb)]() {
         auto view = std::span(audioBuffer);
         cb(view);
+        if(audioStore)
+            spoken.insert(spoken.end(), audioBuffer.begin(), audioBuffer.end());
     };
 
     try {
-        piper::textToAudio(piperConfig, voice, text, audioBuffer, result, callback, speaker_id,
-            noise_scale, length_scale, noise_w);
+        if(phonemes.has_value())
+            piper::synthesize(voice, *phonemes, audioBuffer, result, callback, speaker_id,
+                noise_scale, length_scale, noise_w, seed);
+        else
+            piper::textToAudio(piperConfig, voice, text, audioBuffer, result, callback, speaker_id,
+                noise_scale, length_scale, noise_w, seed);
     }
     catch(const std::exception& e) {
         LOG_ERROR << "Exception thrown while generating speach: " << e.what();
         return false;
     }
+    storeAudio(voice, text, speaker_id, noise_scale, length_scale, noise_w, seed, spoken);
     return true;
 }
 
 struct SynthesisApiParams
 {
     std::string text;
+    // Phonemized by the client, synthesized instead of the text
+    std::optional<piper::PhonemeData> phonemes;
+    // Voice of the registry to speak with, the default voice if not set
+    std::optional<std::string> voice_name;
     std::optional<int64_t> speaker_id;
+    // Speaker by name, looked up once the voice is known
+    std::optional<std::string> speaker;
     std::optional<float> length_scale;
     std::optional<float> noise_scale;
     std::optional<float> noise_w;
+    // Same seed, same audio (with models taking their noise as inputs)
+    std::optional<uint64_t> seed;
     std::optional<std::string> audio_format;
+    // Send the response with chunked transfer as audio becomes available
+    bool stream = false;
+    OpusEncoderOptions opus_options;
+    // WebSocket only. The client acknowledges received bytes, see ConnectionFlowControl
+    bool flow_control = false;
+    // WebSocket only. Send audio at most this many times faster than real time
+    std::optional<float> pace;
+    // WebSocket only. Tags the binary messages and status of the request
+    std::optional<uint32_t> request_id;
+    // WebSocket only. Hold the output back until earlier ordered requests are done
+    bool ordered = true;
+    // Set by resolveSynthesisVoice, keeps a registry voice loaded while in use
+    std::shared_ptr<piper::Voice> voice;
 };
 
-static std::string replaceAll(std::string_view str, std::string_view from, std::string_view to)
-{
-    std::string result;
-    result.reserve(str.size());
-    size_t last = 0;
-    while(true) {
-        auto next = str.find(from, last);
-        if(next == std::string_view::npos) {
-            result += str.substr(last);
-            break;
-        }
-        result += str.substr(last, next - last);
-        result += to;
-        last = next + from.size();
-    }
-    return result;
-}
-
-static std::string piperTextPreprocess(std::string text)
-{
-    // trim leading and tailing spaces
-    auto first = text.find_first_not_of(" \n\r\t");
-    if(first != std::string::npos)
-        text = text.substr(first);
-    auto last = text.find_last_not_of(" \n\r\t");
-    if(last != std::string::npos)
-        text = text.substr(0, last + 1);
-
-    if(text.empty()) {
-        text = ",";
-        return text;
-    }
-
-    // append a comma if the text does not end with a punctuation
-    const char* punctuation = ".,!?;:";
-    bool has_punctuation = (strchr(punctuation, text.back()) != nullptr);
-    if(!has_punctuation)
-        text += ",";
-
-    // Piper have no idea how to process ... and .. so we convert them to ,
-    std::string result;
-    size_t i = 0;
-    while(i < text.size()) {
-        auto ch = text[i];
-        if(ch == '.') {
-            size_t count = 1;
-            while(i + count < text.size() && text[i + count] == '.')
-                count++;
-            if(count == 1)
-                result += '.';
-            else
-                result += ',';
-            i += count - 1;
-        } else {
-            result += ch;
-        }
-        i++;
-    }
-
-    // Handle stupid unicode characters that piper can't handle
-    result = replaceAll(result, "…", ",");
-    result = replaceAll(result, "“", "\"");
-    result = replaceAll(result, "”", "\"");
-    result = replaceAll(result, "‘", "'");
-    result = replaceAll(result, "’", "'");
-    result = replaceAll(result, "—", ", ");
-    result = replaceAll(result, " - ", ", ");
-    return result;
-}
-
 SynthesisApiParams parseSynthesisApiParams(const std::string_view json_txt)
 {
     auto res = SynthesisApiParams{};
     auto json = nlohmann::json::parse(json_txt);
-    if(!json.contains("text"))
-        throw std::runtime_error("Missing 'text' field");
-    res.text = json["text"].get<std::string>();
-    if(res.text.size() > MAX_TEXT_LENGTH)
-        throw std::runtime_error("Text too long");
+    if(json.contains("phoneme_ids") && json["phoneme_ids"].is_null() == false) {
+        res.phonemes = piper::parsePhonemeData(json["phoneme_ids"]);
+        size_t count = 0;
+        for(const auto& sentence : res.phonemes->sentences) {
+            for(const auto& phrase : sentence.phrases)
+                count += phrase.phonemeIds.size();
+        }
+        if(count > MAX_PHONEME_IDS)
+            throw std::runtime_error("Too many phoneme ids");
+    }
+    else {
+        if(!json.contains("text"))
+            throw std::runtime_error("Missing 'text' field");
+        res.text = json["text"].get<std::string>();
+        if(res.text.size() > MAX_TEXT_LENGTH)
+            throw std::runtime_error("Text too long");
+    }
     if(json.contains("speaker_id") && json["speaker_id"].is_null() == false)
         res.speaker_id = json["speaker_id"].get<int64_t>();
-    if(json.contains("speaker")) {
-        const auto& speaker_id_map = voice.modelConfig.speakerIdMap;
-        auto speaker = json["speaker"].get<std::string>();
-        if(speaker_id_map.has_value() == false)
-            throw std::runtime_error("Speaker ID map is not available");
-
-        if(!speaker_id_map->contains(speaker))
-            throw std::runtime_error("Unknown speaker name " + speaker);
-        res.speaker_id = speaker_id_map->at(speaker);
+    if(json.contains("speaker"))
+        res.speaker = json["speaker"].get<std::string>();
+    if(json.contains("voice") && json["voice"].is_null() == false) {
+        if(json["voice"].is_string() == false)
+            throw std::runtime_error("voice must be a string");
+        res.voice_name = json["voice"].get<std::string>();
     }
     if(json.contains("length_scale")) {
         if(json["length_scale"].is_number() == false)
@@ -168,39 +241,685 @@ SynthesisApiParams parseSynthesisApiParams(const std::string_view json_txt)
         if(!std::isfinite(*res.noise_w) || *res.noise_w < 0.0f || *res.noise_w > 100.0f)
             throw std::runtime_error("noise_w out of range");
     }
+    if(json.contains("seed") && json["seed"].is_null() == false) {
+        if(json["seed"].is_number_unsigned() == false)
+            throw std::runtime_error("seed must be a non-negative integer");
+        res.seed = json["seed"].get<uint64_t>();
+    }
     if(json.contains("audio_format")) {
         if(json["audio_format"].is_string() == false)
             throw std::runtime_error("audio_format must be a string");
         res.audio_format = json["audio_format"].get<std::string>();
     }
+    if(json.contains("bitrate")) {
+        if(json["bitrate"].is_number_integer() == false)
+            throw std::runtime_error("bitrate must be an integer");
+        res.opus_options.bitrate = json["bitrate"].get<size_t>();
+    }
+    if(json.contains("complexity")) {
+        if(json["complexity"].is_number_integer() == false)
+            throw std::runtime_error("complexity must be an integer");
+        res.opus_options.complexity = json["complexity"].get<int>();
+    }
+    if(json.contains("frame_duration")) {
+        if(json["frame_duration"].is_number() == false)
+            throw std::runtime_error("frame_duration must be a number");
+        res.opus_options.frameDuration = json["frame_duration"].get<float>();
+    }
+    if(json.contains("flush_pages")) {
+        if(json["flush_pages"].is_boolean() == false)
+            throw std::runtime_error("flush_pages must be a boolean");
+        res.opus_options.flushPages = json["flush_pages"].get<bool>();
+    }
+    validateOpusEncoderOptions(res.opus_options);
+    if(json.contains("stream")) {
+        if(json["stream"].is_boolean() == false)
+            throw std::runtime_error("stream must be a boolean");
+        res.stream = json["stream"].get<bool>();
+    }
+    if(json.contains("flow_control")) {
+        if(json["flow_control"].is_boolean() == false)
+            throw std::runtime_error("flow_control must be a boolean");
+        res.flow_control = json["flow_control"].get<bool>();
+    }
+    if(json.contains("pace") && json["pace"].is_null() == false) {
+        if(json["pace"].is_number() == false)
+            throw std::runtime_error("pace must be a number");
+        res.pace = json["pace"].get<float>();
+        if(!std::isfinite(*res.pace) || *res.pace <= 0.0f || *res.pace > 100.0f)
+            throw std::runtime_error("pace out of range");
+    }
+    if(json.contains("request_id") && json["request_id"].is_null() == false) {
+        if(json["request_id"].is_number_unsigned() == false || json["request_id"].get<uint64_t>() > UINT32_MAX)
+            throw std::runtime_error("request_id must be an unsigned 32 bit integer");
+        res.request_id = json["request_id"].get<uint32_t>();
+    }
+    // Untagged audio can't be told apart, so only tagged requests may interleave
+    res.ordered = !res.request_id.has_value();
+    if(json.contains("delivery")) {
+        if(json["delivery"].is_string() == false)
+            throw std::runtime_error("delivery must be a string");
+        auto delivery = json["delivery"].get<std::string>();
+        if(delivery == "ordered")
+            res.ordered = true;
+        else if(delivery == "interleaved" && res.request_id.has_value())
+            res.ordered = false;
+        else if(delivery == "interleaved")
+            throw std::runtime_error("interleaved delivery requires a request_id");
+        else
+            throw std::runtime_error("delivery must be ordered or interleaved");
+    }
+    return res;
+}
+
+// The named voice of the registry, loaded if needed, or the default voice
+static Task<std::shared_ptr<piper::Voice>> acquireVoice(const std::optional<std::string>& name)
+{
+    if(!name.has_value())
+        co_return defaultVoice.load();
+    if(!voiceRegistry || !voiceRegistry->contains(*name))
+        throw std::runtime_error("Unknown voice " + *name);
+    if(auto loaded = voiceRegistry->tryGet(*name))
+        co_return loaded;
+
+    auto loop = trantor::EventLoop::getEventLoopOfCurrentThread();
+    co_await switchThreadCoro(voiceLoaderThread.getLoop());
+    std::shared_ptr<piper::Voice> loaded;
+    std::exception_ptr error;
+    try {
+        loaded = voiceRegistry->get(*name);
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+    co_await switchThreadCoro(loop);
+    if(error)
+        std::rethrow_exception(error);
+    co_return loaded;
+}
 
-    if(res.speaker_id.has_value() && (*res.speaker_id < 0 || *res.speaker_id >= voice.modelConfig.numSpeakers))
+// Gets the voice of the request, then checks and fills in what depends on it:
+// the speaker, and the normalized text or the phoneme ids
+static Task<> resolveSynthesisVoice(SynthesisApiParams& params)
+{
+    params.voice = co_await acquireVoice(params.voice_name);
+    const auto& voice = *params.voice;
+    if(params.speaker.has_value()) {
+        const auto& speaker_id_map = voice.modelConfig.speakerIdMap;
+        if(speaker_id_map.has_value() == false)
+            throw std::runtime_error("Speaker ID map is not available");
+
+        if(!speaker_id_map->contains(*params.speaker))
+            throw std::runtime_error("Unknown speaker name " + *params.speaker);
+        params.speaker_id = speaker_id_map->at(*params.speaker);
+    }
+
+    if(params.speaker_id.has_value() && (*params.speaker_id < 0 || *params.speaker_id >= voice.modelConfig.numSpeakers))
         throw std::runtime_error("Speaker ID is out of range");
 
-    res.text = piperTextPreprocess(res.text);
-    return res;
+    piper::checkSeed(voice, params.seed);
+
+    if(params.phonemes.has_value()) {
+        piper::validatePhonemeData(voice, *params.phonemes);
+        co_return;
+    }
+    auto text = std::move(params.text);
+    voice.textNormalizer.normalize(text, params.text);
 }
 
-static std::vector<short> resample(std::span<const short> input, size_t orig_sr, size_t out_sr, int channels)
+enum class AudioFormat
+{
+    Opus,
+    OpusRaw,
+    Pcm,
+    Wav,
+};
+
+static AudioFormat parseAudioFormat(const std::optional<std::string>& name)
+{
+    auto format = name.value_or("opus");
+    if(format == "opus")
+        return AudioFormat::Opus;
+    if(format == "opus-raw")
+        return AudioFormat::OpusRaw;
+    if(format == "wav")
+        return AudioFormat::Wav;
+    return AudioFormat::Pcm;
+}
+
+static const char* audioContentType(AudioFormat format)
+{
+    switch(format) {
+    case AudioFormat::Opus:
+        return "audio/ogg; codecs=opus";
+    case AudioFormat::Wav:
+        return "audio/wav";
+    default:
+        return "audio/raw";
+    }
+}
+
+// Turns synthesized audio into the messages sent to the client, chunk by chunk.
+// Opus is resampled to 24kHz and muxed into an Ogg stream, PCM is sent as
+// 16 bit little endian samples at the voice's sample rate. WAV is PCM behind
+// a header with unknown (maximum) length, as the length is not known upfront.
+// Raw Opus is resampled to 24kHz as well and every packet becomes a message
+// of its own, see OpusPacketEncoder for the framing.
+struct AudioStreamEncoder
+{
+    using MessageCallback = std::function<void(std::span<const uint8_t>)>;
+
+    AudioStreamEncoder(AudioFormat format, size_t sampleRate, const OpusEncoderOptions& opusOptions = {})
+        : format(format), sampleRate(sampleRate)
+    {
+        if(format == AudioFormat::Opus) {
+            resampler.emplace(sampleRate, 24000, 1, resampleQuality);
+            encoder.emplace(24000, 1, opusOptions);
+        }
+        else if(format == AudioFormat::OpusRaw) {
+            resampler.emplace(sampleRate, 24000, 1, resampleQuality);
+            packetEncoder.emplace(24000, 1, opusOptions);
+        }
+    }
+    // The Ogg encoder's callbacks point at itself
+    AudioStreamEncoder(const AudioStreamEncoder&) = delete;
+    AudioStreamEncoder& operator=(const AudioStreamEncoder&) = delete;
+
+    // Start over for another stream. Reuses the resampler, the raw Opus
+    // encoder and the buffers. libopusenc can't restart a stream, so the Ogg
+    // encoder is created anew.
+    void reset(AudioFormat newFormat, const OpusEncoderOptions& opusOptions = {})
+    {
+        format = newFormat;
+        headerSent = false;
+        encoder.reset();
+        if(format == AudioFormat::Opus || format == AudioFormat::OpusRaw) {
+            if(resampler)
+                resampler->reset();
+            else
+                resampler.emplace(sampleRate, 24000, 1, resampleQuality);
+        }
+        if(format == AudioFormat::Opus)
+            encoder.emplace(24000, 1, opusOptions);
+        else if(format == AudioFormat::OpusRaw && packetEncoder)
+            packetEncoder->reset(opusOptions);
+        else if(format == AudioFormat::OpusRaw)
+            packetEncoder.emplace(24000, 1, opusOptions);
+    }
+
+    // Encode pcm, calling onMessage for every message that is ready to be sent
+    void encode(std::span<const short> pcm, const MessageCallback& onMessage)
+    {
+        if(format == AudioFormat::OpusRaw) {
+            resampled.clear();
+            resampler->process(pcm, resampled);
+            packetEncoder->encode(resampled, onMessage);
+            return;
+        }
+
+        chunk.clear();
+        if(format == AudioFormat::Opus) {
+            resampled.clear();
+            resampler->process(pcm, resampled);
+            encoder->encode(resampled, chunk);
+            emit(onMessage);
+            return;
+        }
+
+        if(format == AudioFormat::Wav && !headerSent) {
+            WavHeader header;
+            header.dataSize = 0xFFFFFFFF;
+            header.chunkSize = 0xFFFFFFFF;
+            header.sampleRate = sampleRate;
+            header.numChannels = 1;
+            header.bytesPerSec = sampleRate * sizeof(int16_t);
+            header.blockAlign = sizeof(int16_t);
+            auto bytes = reinterpret_cast<const uint8_t*>(&header);
+            chunk.insert(chunk.end(), bytes, bytes + sizeof(header));
+            headerSent = true;
+        }
+
+        size_t offset = chunk.size();
+        chunk.resize(offset + pcm.size() * sizeof(int16_t));
+        memcpy(chunk.data() + offset, pcm.data(), pcm.size() * sizeof(int16_t));
+        if constexpr (std::endian::native == std::endian::big) {
+            // Convert to little endian
+            auto samples = reinterpret_cast<int16_t*>(chunk.data() + offset);
+            for(size_t i = 0; i < pcm.size(); i++)
+                samples[i] = (samples[i] >> 8) | (samples[i] << 8);
+        }
+        emit(onMessage);
+    }
+
+    // Send whatever is left at the end of the stream
+    void finish(const MessageCallback& onMessage)
+    {
+        if(format != AudioFormat::Opus && format != AudioFormat::OpusRaw)
+            return;
+        resampled.clear();
+        resampler->flush(resampled);
+        if(format == AudioFormat::OpusRaw) {
+            packetEncoder->encode(resampled, onMessage);
+            packetEncoder->finish(onMessage);
+            return;
+        }
+        chunk.clear();
+        encoder->encode(resampled, chunk);
+        encoder->finish(chunk);
+        emit(onMessage);
+    }
+
+    AudioFormat format;
+    size_t sampleRate;
+
+private:
+    void emit(const MessageCallback& onMessage)
+    {
+        if(!chunk.empty())
+            onMessage(chunk);
+    }
+
+    std::optional<StreamingResampler> resampler;
+    std::optional<StreamingOggOpusEncoder> encoder;
+    std::optional<OpusPacketEncoder> packetEncoder;
+    std::vector<short> resampled;
+    std::vector<uint8_t> chunk;
+    bool headerSent = false;
+};
+
+// Moves encoding and sending of one stream off the synthesizer threads. The
+// synthesis side pushes PCM chunks into a lock free queue, sleeping while it
+// is full, a post-processing loop picked for the stream drains it in order,
+// encodes and hands messages to onMessage. A drain task is only queued when
+// none is pending. onEnd is called on the post-processing loop once all audio
+// before finish() is out.
+struct AudioPipeline : public std::enable_shared_from_this<AudioPipeline>
+{
+    using MessageCallback = AudioStreamEncoder::MessageCallback;
+    using EndCallback = std::function<void(bool ok)>;
+    using RecycleCallback = std::function<void(std::unique_ptr<AudioStreamEncoder>)>;
+
+    AudioPipeline(AudioFormat format, size_t sampleRate, const OpusEncoderOptions& opusOptions,
+        MessageCallback onMessage, EndCallback onEnd)
+        : AudioPipeline(std::make_unique<AudioStreamEncoder>(format, sampleRate, opusOptions),
+            std::move(onMessage), std::move(onEnd))
+    {
+    }
+
+    // recycle gets the encoder back once the stream is done, before onEnd
+    AudioPipeline(std::unique_ptr<AudioStreamEncoder> encoder, MessageCallback onMessage,
+        EndCallback onEnd, RecycleCallback recycle = nullptr)
+        : encoder(std::move(encoder))
+        , onMessage(std::move(onMessage))
+        , onEnd(std::move(onEnd))
+        , recycle(std::move(recycle))
+        , loop(postProcessThreadPool.getNextLoop())
+        , queue(queueCapacity)
+    {
+    }
+
+    // Called by the producer only
+    void push(std::span<const short> pcm)
+    {
+        if(pcm.empty())
+            return;
+        enqueue(Item{std::vector<short>(pcm.begin(), pcm.end())});
+    }
+
+    // Called by the producer only, after the last push
+    void finish(bool ok)
+    {
+        enqueue(Item{{}, true, ok});
+    }
+
+private:
+    struct Item
+    {
+        std::vector<short> pcm;
+        // Marks the end of the stream
+        bool end = false;
+        bool ok = true;
+    };
+
+    // Sentences come in whole, decoder chunks are ~1s. More than this in
+    // flight means post-processing can't keep up and the producer waits.
+    static constexpr size_t queueCapacity = 64;
+
+    void enqueue(Item&& item)
+    {
+        if(!queue.tryPush(std::move(item)))
+            waitForSpace(item);
+        // Pairs with the fence in drain(), either we see the flag cleared
+        // or the drain task sees our item
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(!drainScheduled.exchange(true, std::memory_order_acq_rel))
+            loop->queueInLoop([self = shared_from_this()]() { self->drain(); });
+    }
+
+    // Blocks the producer until drain() made room and pushes item. Producers
+    // push from inside synthesis callbacks, so this can't suspend instead.
+    void waitForSpace(Item& item)
+    {
+        std::unique_lock<std::mutex> lock(spaceMutex);
+        producerWaiting.store(true);
+        // Pairs with the fence in drain(), either drain() sees the flag or
+        // the next try sees its pop
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        spaceAvailable.wait(lock, [&]() { return queue.tryPush(std::move(item)); });
+        producerWaiting.store(false, std::memory_order_relaxed);
+    }
+
+    void drain()
+    {
+        Item item;
+        while(true) {
+            while(queue.tryPop(item)) {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if(producerWaiting.load(std::memory_order_relaxed)) {
+                    // Taking the lock waits until the producer sleeps
+                    std::lock_guard<std::mutex> lock(spaceMutex);
+                    spaceAvailable.notify_one();
+                }
+                process(item);
+            }
+            drainScheduled.store(false, std::memory_order_release);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            // Something was pushed after the last pop but saw the flag still set
+            if(queue.empty() || drainScheduled.exchange(true, std::memory_order_acq_rel))
+                return;
+        }
+    }
+
+    void process(Item& item)
+    {
+        if(item.end) {
+            bool ok = item.ok && !failed;
+            if(ok) {
+                try {
+                    encoder->finish(onMessage);
+                }
+                catch(const std::exception& e) {
+                    LOG_ERROR << "Exception thrown while encoding audio: " << e.what();
+                    ok = false;
+                }
+            }
+            if(recycle)
+                recycle(std::move(encoder));
+            onEnd(ok);
+            return;
+        }
+        if(failed)
+            return;
+        try {
+            encoder->encode(item.pcm, onMessage);
+        }
+        catch(const std::exception& e) {
+            // Skip the rest of the stream, a gap in the audio is worse than an early end
+            LOG_ERROR << "Exception thrown while encoding audio: " << e.what();
+            failed = true;
+        }
+    }
+
+    std::unique_ptr<AudioStreamEncoder> encoder;
+    MessageCallback onMessage;
+    EndCallback onEnd;
+    RecycleCallback recycle;
+    trantor::EventLoop* loop;
+    SpscQueue<Item> queue;
+    std::atomic<bool> drainScheduled{false};
+    // The producer sleeps on these while the queue is full
+    std::mutex spaceMutex;
+    std::condition_variable spaceAvailable;
+    std::atomic<bool> producerWaiting{false};
+    // Only touched on loop
+    bool failed = false;
+};
+
+// Flow control state of one WebSocket connection. Clients that opt in report
+// the total number of audio bytes they received so far with {"ack": bytes}.
+// Once more than the high water mark is unacknowledged, streams on the
+// connection hold off synthesizing their next sentence until it drops to the
+// low water mark. Closing the connection releases all waiting streams.
+struct ConnectionFlowControl
+{
+    struct WindowAwaiter
+    {
+        ConnectionFlowControl& flow;
+
+        bool await_ready()
+        {
+            std::lock_guard<std::mutex> lock(flow.mutex);
+            return flow.closed || flow.unacknowledged() <= wsHighWaterMark;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            std::lock_guard<std::mutex> lock(flow.mutex);
+            // An ack may have come in since await_ready
+            if(flow.closed || flow.unacknowledged() <= wsHighWaterMark)
+                return false;
+            flow.waiters.push_back({handle, trantor::EventLoop::getEventLoopOfCurrentThread()});
+            return true;
+        }
+
+        void await_resume() {}
+    };
+
+    // Suspends while the client is too far behind. Resumes on the calling loop
+    WindowAwaiter waitForWindow()
+    {
+        return WindowAwaiter{*this};
+    }
+
+    void onSent(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        sentBytes += bytes;
+    }
+
+    void onAck(size_t totalBytes)
+    {
+        std::vector<Waiter> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ackedBytes = std::clamp(totalBytes, ackedBytes, sentBytes);
+            if(unacknowledged() <= wsLowWaterMark)
+                ready.swap(waiters);
+        }
+        resume(ready);
+    }
+
+    void close()
+    {
+        std::vector<Waiter> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            ready.swap(waiters);
+        }
+        resume(ready);
+    }
+
+    bool isClosed()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return closed;
+    }
+
+private:
+    struct Waiter
+    {
+        std::coroutine_handle<> handle;
+        trantor::EventLoop* loop;
+    };
+
+    size_t unacknowledged() const
+    {
+        return sentBytes - ackedBytes;
+    }
+
+    static void resume(const std::vector<Waiter>& ready)
+    {
+        for(const auto& waiter : ready)
+            waiter.loop->queueInLoop([handle = waiter.handle]() { handle.resume(); });
+    }
+
+    std::mutex mutex;
+    size_t sentBytes = 0;
+    size_t ackedBytes = 0;
+    bool closed = false;
+    std::vector<Waiter> waiters;
+};
+
+// State of one /api/v1/stream connection, kept in the connection's context.
+// Runs up to wsMaxConcurrentRequests requests at once and queues the rest.
+// Output of ordered requests is held back until the ordered requests before
+// them are done, interleaved requests send right away. Encoders of finished
+// requests are kept for the next ones.
+struct StreamConnection
 {
-    soxr_io_spec_t io_spec = soxr_io_spec(SOXR_INT16_I, SOXR_INT16_I);
-    soxr_quality_spec_t q_spec = soxr_quality_spec(SOXR_MQ, 0);
-    soxr_error_t error;
-    soxr_t soxr = soxr_create(orig_sr, out_sr, channels, &error, &io_spec, &q_spec, NULL);
-    if(error != NULL) {
-        throw std::runtime_error("soxr_create failed");
+    // Place of an ordered request in line
+    struct DeliverySlot
+    {
+        std::vector<std::pair<std::string, WebSocketMessageType>> held;
+        bool done = false;
+    };
+
+    ConnectionFlowControl flow;
+
+    // Get in line, in the order messages arrive. Requests turning out to be
+    // interleaved give their slot up with complete()
+    std::shared_ptr<DeliverySlot> reserveSlot()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return orderedSlots.emplace_back(std::make_shared<DeliverySlot>());
+    }
+
+    // Calls start now if below the concurrency limit, later otherwise
+    void submit(std::function<void()> start)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(running >= wsMaxConcurrentRequests) {
+                pending.push_back(std::move(start));
+                return;
+            }
+            running++;
+        }
+        start();
     }
-    std::vector<short> output(input.size() * out_sr / orig_sr);
-    size_t idone, odone;
-    error = soxr_process(soxr, input.data(), input.size(), &idone, output.data(), output.size(), &odone);
-    if(error != NULL) {
-        soxr_delete(soxr);
-        throw std::runtime_error("soxr_process failed");
+
+    // A request is done, start the next one waiting
+    void requestFinished()
+    {
+        std::function<void()> next;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(pending.empty()) {
+                running--;
+                return;
+            }
+            next = std::move(pending.front());
+            pending.pop_front();
+        }
+        next();
     }
-    output.resize(odone);
-    
-    soxr_delete(soxr);
-    return output;
+
+    void send(const WebSocketConnectionPtr& wsConnPtr, const std::shared_ptr<DeliverySlot>& slot,
+        std::string message, WebSocketMessageType type)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(slot && slot != orderedSlots.front()) {
+            slot->held.emplace_back(std::move(message), type);
+            return;
+        }
+        transmit(wsConnPtr, message, type);
+    }
+
+    // All output of the request is sent. Releases what the ones after it held back
+    void complete(const WebSocketConnectionPtr& wsConnPtr, const std::shared_ptr<DeliverySlot>& slot)
+    {
+        if(!slot)
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        slot->done = true;
+        while(!orderedSlots.empty() && orderedSlots.front()->done) {
+            orderedSlots.pop_front();
+            if(orderedSlots.empty())
+                break;
+            auto& next = orderedSlots.front();
+            for(auto& [message, type] : next->held)
+                transmit(wsConnPtr, message, type);
+            next->held = {};
+        }
+    }
+
+    std::unique_ptr<AudioStreamEncoder> acquireEncoder(AudioFormat format, size_t sampleRate,
+        const OpusEncoderOptions& opusOptions)
+    {
+        std::unique_ptr<AudioStreamEncoder> encoder;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            // Voices differ in sample rate, the resampler is set up for one
+            auto it = std::find_if(idleEncoders.begin(), idleEncoders.end(),
+                [sampleRate](const auto& idle) { return idle->sampleRate == sampleRate; });
+            if(it != idleEncoders.end()) {
+                encoder = std::move(*it);
+                idleEncoders.erase(it);
+            }
+        }
+        if(!encoder)
+            return std::make_unique<AudioStreamEncoder>(format, sampleRate, opusOptions);
+        encoder->reset(format, opusOptions);
+        return encoder;
+    }
+
+    void releaseEncoder(std::unique_ptr<AudioStreamEncoder> encoder)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(idleEncoders.size() < wsMaxConcurrentRequests)
+            idleEncoders.push_back(std::move(encoder));
+    }
+
+    // Drop queued requests, they hold on to the connection
+    void close()
+    {
+        flow.close();
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.clear();
+    }
+
+private:
+    // Audio counts against the flow control window once it is on its way.
+    // Held back audio can't be acknowledged by the client, counting it would
+    // stall the request everything else waits for.
+    void transmit(const WebSocketConnectionPtr& wsConnPtr, const std::string& message,
+        WebSocketMessageType type)
+    {
+        if(type == WebSocketMessageType::Binary)
+            flow.onSent(message.size());
+        wsConnPtr->send(message, type);
+    }
+
+    std::mutex mutex;
+    size_t running = 0;
+    std::deque<std::function<void()>> pending;
+    std::deque<std::shared_ptr<DeliverySlot>> orderedSlots;
+    std::vector<std::unique_ptr<AudioStreamEncoder>> idleEncoders;
+};
+
+static std::string makeStreamStatusMessage(bool ok, std::optional<uint32_t> requestId,
+    const std::string& message = "")
+{
+    nlohmann::json resp;
+    resp["status"] = ok ? "ok" : "failed";
+    if(!message.empty())
+        resp["message"] = message;
+    else
+        resp["message"] = ok ? "finished" : "failed to synthesis";
+    if(requestId.has_value())
+        resp["request_id"] = *requestId;
+    return resp.dump();
 }
 
 HttpResponsePtr makeBadRequestResponse(const std::string &msg)
@@ -212,8 +931,11 @@ HttpResponsePtr makeBadRequestResponse(const std::string &msg)
     return resp;
 }
 
-// Awaiter that dispatches per-sentence synthesize() calls across the thread pool.
+// Awaiter that dispatches per-sentence synthesize() calls across the thread pool,
+// or on a coordinator, the default voice's sentences across the shard workers.
 // The last task to complete (atomic counter == N) resumes the suspended coroutine.
+// If onSentenceReady is set, it is called with each sentence index in sentence
+// order, as soon as that sentence and all sentences before it are done.
 struct ParallelSynthAwaiter : drogon::CallbackAwaiter<void>
 {
     ParallelSynthAwaiter(
@@ -225,127 +947,621 @@ struct ParallelSynthAwaiter : drogon::CallbackAwaiter<void>
         std::optional<size_t> speakerId,
         std::optional<float> noiseScale,
         std::optional<float> lengthScale,
-        std::optional<float> noiseW)
+        std::optional<float> noiseW,
+        std::optional<uint64_t> seed,
+        std::function<void(size_t)> onSentenceReady = nullptr,
+        std::function<void(size_t)> postProcess = nullptr)
         : pool_(pool), voice_(voice), phonemeData_(phonemeData),
           sentenceAudio_(sentenceAudio), sentenceResults_(sentenceResults),
           speakerId_(speakerId), noiseScale_(noiseScale),
-          lengthScale_(lengthScale), noiseW_(noiseW) {}
+          lengthScale_(lengthScale), noiseW_(noiseW), seed_(seed),
+          onSentenceReady_(std::move(onSentenceReady)),
+          postProcess_(std::move(postProcess)),
+          sentenceDone_(phonemeData.sentences.size(), false) {}
 
     void await_suspend(std::coroutine_handle<> handle)
     {
+        handle_ = handle;
         const size_t n = phonemeData_.sentences.size();
+        // Coordinator mode, the workers serve the default voice. A single
+        // sentence is quicker here than over HTTP
+        const bool sharded = shardCluster && n > 1 && &voice_ == defaultVoice.load().get();
         for (size_t i = 0; i < n; i++) {
-            pool_.getNextLoop()->queueInLoop([this, i, n, handle]() {
+            if (!sharded) {
+                pool_.getNextLoop()->queueInLoop([this, i]() { process(i); });
+                continue;
+            }
+            ShardOptions options{voice_.configDigest, speakerId_, noiseScale_, lengthScale_, noiseW_, seed_,
+                voice_.synthesisConfig.sentenceSilenceSeconds};
+            shardCluster->synthesize(phonemeData_.sentences[i], options, voice_.synthesisConfig.sampleRate,
+                [this, i](std::optional<std::vector<int16_t>> audio) {
+                    // Post processing runs on the synthesizer threads either way. If no
+                    // worker managed, the sentence is synthesized there as well.
+                    pool_.getNextLoop()->queueInLoop([this, i, audio = std::move(audio)]() mutable {
+                        process(i, std::move(audio));
+                    });
+                });
+        }
+    }
+
+private:
+    // Synthesizes sentence i, unless a shard worker did already, then hands it on
+    void process(size_t i, std::optional<std::vector<int16_t>> shardAudio = std::nullopt)
+    {
+        const size_t n = phonemeData_.sentences.size();
+        try {
+            if (shardAudio) {
+                sentenceAudio_[i] = std::move(*shardAudio);
+                sentenceResults_[i].audioSeconds =
+                    (double)sentenceAudio_[i].size() / voice_.synthesisConfig.sampleRate;
+            }
+            else {
+                piper::PhonemeData single;
+                single.sentences.push_back(phonemeData_.sentences[i]);
+                piper::synthesize(voice_, single, sentenceAudio_[i],
+                                 sentenceResults_[i], nullptr,
+                                 speakerId_, noiseScale_, lengthScale_, noiseW_, seed_);
+            }
+            // Runs on the same worker, right after synthesis of the sentence
+            if (postProcess_)
+                postProcess_(i);
+        } catch (...) {
+            captureException();
+        }
+        if (onSentenceReady_)
+            emitInOrder(i);
+        if (completed_.fetch_add(1, std::memory_order_acq_rel) + 1 == n)
+            handle_.resume();
+    }
+
+    void captureException()
+    {
+        if (!exceptionCaptured_.test_and_set(std::memory_order_acq_rel))
+            setException(std::current_exception());
+    }
+
+    void emitInOrder(size_t i)
+    {
+        std::lock_guard<std::mutex> lock(emitMutex_);
+        sentenceDone_[i] = true;
+        while (nextToEmit_ < sentenceDone_.size() && sentenceDone_[nextToEmit_]) {
+            // Stop emitting once a sentence failed, the output would have a gap
+            if (!exceptionCaptured_.test(std::memory_order_acquire)) {
                 try {
-                    piper::PhonemeData single;
-                    single.sentences.push_back(phonemeData_.sentences[i]);
-                    piper::synthesize(voice_, single, sentenceAudio_[i],
-                                     sentenceResults_[i], nullptr,
-                                     speakerId_, noiseScale_, lengthScale_, noiseW_);
+                    onSentenceReady_(nextToEmit_);
                 } catch (...) {
-                    if (!exceptionCaptured_.test_and_set(std::memory_order_acq_rel))
-                        setException(std::current_exception());
+                    captureException();
                 }
-                if (completed_.fetch_add(1, std::memory_order_acq_rel) + 1 == n)
-                    handle.resume();
+            }
+            nextToEmit_++;
+        }
+    }
+
+    trantor::EventLoopThreadPool& pool_;
+    piper::Voice& voice_;
+    const piper::PhonemeData& phonemeData_;
+    std::vector<std::vector<int16_t>>& sentenceAudio_;
+    std::vector<piper::SynthesisResult>& sentenceResults_;
+    std::optional<size_t> speakerId_;
+    std::optional<float> noiseScale_;
+    std::optional<float> lengthScale_;
+    std::optional<float> noiseW_;
+    std::optional<uint64_t> seed_;
+    std::function<void(size_t)> onSentenceReady_;
+    std::function<void(size_t)> postProcess_;
+    std::mutex emitMutex_;
+    std::vector<bool> sentenceDone_;
+    size_t nextToEmit_ = 0;
+    std::atomic<size_t> completed_{0};
+    std::atomic_flag exceptionCaptured_{};
+    std::coroutine_handle<> handle_;
+};
+
+// Phonemize sequentially, then synthesize sentences in parallel across the pool.
+// Single-sentence texts skip the awaiter and synthesize inline.
+static Task<std::vector<int16_t>> doSynthesis(
+    piper::Voice& voice,
+    const std::string& text,
+    const std::optional<piper::PhonemeData>& phonemes,
+    std::optional<size_t> speakerId,
+    std::optional<float> noiseScale,
+    std::optional<float> lengthScale,
+    std::optional<float> noiseW,
+    std::optional<uint64_t> seed)
+{
+    std::vector<int16_t> stored;
+    if(loadStoredAudio(voice, text, speakerId, noiseScale, lengthScale, noiseW, seed, stored))
+        co_return stored;
+
+    auto phonemeData = requestPhonemes(voice, text, phonemes);
+    const size_t sentenceCount = phonemeData.sentences.size();
+    if (sentenceCount == 0)
+        co_return {};
+
+    // Fast path: single sentence, synthesize inline without queueInLoop overhead
+    if (sentenceCount == 1) {
+        std::vector<int16_t> audioBuffer;
+        piper::SynthesisResult result{};
+        audioBuffer.reserve(voice.synthesisConfig.sampleRate);
+        piper::synthesize(voice, phonemeData, audioBuffer, result, nullptr,
+                         speakerId, noiseScale, lengthScale, noiseW, seed);
+        storeAudio(voice, text, speakerId, noiseScale, lengthScale, noiseW, seed, audioBuffer);
+        co_return audioBuffer;
+    }
+
+    // Multi-sentence: dispatch each sentence to the pool in parallel
+    std::vector<std::vector<int16_t>> sentenceAudio(sentenceCount);
+    std::vector<piper::SynthesisResult> sentenceResults(sentenceCount);
+
+    co_await ParallelSynthAwaiter(
+        synthesizerThreadPool, voice, phonemeData,
+        sentenceAudio, sentenceResults,
+        speakerId, noiseScale, lengthScale, noiseW, seed);
+
+    // Stitch audio in sentence order (sentence silence already embedded by synthesize)
+    size_t totalSamples = 0;
+    for (const auto& audio : sentenceAudio)
+        totalSamples += audio.size();
+
+    std::vector<int16_t> stitched;
+    stitched.reserve(totalSamples);
+    for (auto& audio : sentenceAudio)
+        stitched.insert(stitched.end(), audio.begin(), audio.end());
+
+    // Accumulate stats
+    piper::SynthesisResult totalResult{};
+    for (const auto& r : sentenceResults) {
+        totalResult.inferSeconds += r.inferSeconds;
+        totalResult.audioSeconds += r.audioSeconds;
+    }
+    if (totalResult.audioSeconds > 0)
+        totalResult.realTimeFactor = totalResult.inferSeconds / totalResult.audioSeconds;
+
+    storeAudio(voice, text, speakerId, noiseScale, lengthScale, noiseW, seed, stitched);
+    co_return stitched;
+}
+
+// Like doSynthesis, but returns an Ogg Opus file. Every sentence is resampled
+// and encoded on the worker that synthesized it, as a logical stream of its
+// own. The streams are chained one after another, which is a valid Ogg file
+// that decoders play back as a whole.
+static Task<std::vector<uint8_t>> doSynthesisOpus(
+    piper::Voice& voice,
+    const std::string& text,
+    const std::optional<piper::PhonemeData>& phonemes,
+    std::optional<size_t> speakerId,
+    std::optional<float> noiseScale,
+    std::optional<float> lengthScale,
+    std::optional<float> noiseW,
+    std::optional<uint64_t> seed,
+    OpusEncoderOptions opusOptions)
+{
+    const size_t sampleRate = voice.synthesisConfig.sampleRate;
+    std::vector<int16_t> stored;
+    if (loadStoredAudio(voice, text, speakerId, noiseScale, lengthScale, noiseW, seed, stored)) {
+        auto pcm = resample(stored, sampleRate, 24000, 1, resampleQuality);
+        co_return encodeOgg(pcm, 24000, 1, opusOptions);
+    }
+
+    auto phonemeData = requestPhonemes(voice, text, phonemes);
+    const size_t sentenceCount = phonemeData.sentences.size();
+    if (sentenceCount <= 1) {
+        std::vector<int16_t> audioBuffer;
+        piper::SynthesisResult result{};
+        if (sentenceCount == 1)
+            piper::synthesize(voice, phonemeData, audioBuffer, result, nullptr,
+                             speakerId, noiseScale, lengthScale, noiseW, seed);
+        storeAudio(voice, text, speakerId, noiseScale, lengthScale, noiseW, seed, audioBuffer);
+        auto pcm = resample(audioBuffer, sampleRate, 24000, 1, resampleQuality);
+        co_return encodeOgg(pcm, 24000, 1, opusOptions);
+    }
+
+    std::vector<std::vector<int16_t>> sentenceAudio(sentenceCount);
+    std::vector<piper::SynthesisResult> sentenceResults(sentenceCount);
+    std::vector<std::vector<uint8_t>> sentenceOpus(sentenceCount);
+    // Consecutive serial numbers keep the chained streams apart
+    const uint32_t firstSerial = std::random_device{}();
+    // The PCM is dropped once encoded, keep a copy for the audio store
+    std::vector<std::vector<int16_t>> storedAudio(audioStore ? sentenceCount : 0);
+
+    co_await ParallelSynthAwaiter(
+        synthesizerThreadPool, voice, phonemeData,
+        sentenceAudio, sentenceResults,
+        speakerId, noiseScale, lengthScale, noiseW, seed,
+        nullptr,
+        [&](size_t i) {
+            auto options = opusOptions;
+            options.serialNo = (int32_t)((firstSerial + i) & 0x7fffffff);
+            auto pcm = resample(sentenceAudio[i], sampleRate, 24000, 1, resampleQuality);
+            sentenceOpus[i] = encodeOgg(pcm, 24000, 1, options);
+            if (audioStore)
+                storedAudio[i] = std::move(sentenceAudio[i]);
+            sentenceAudio[i] = {};
+        });
+
+    if (audioStore) {
+        std::vector<int16_t> audio;
+        for (const auto& sentence : storedAudio)
+            audio.insert(audio.end(), sentence.begin(), sentence.end());
+        storeAudio(voice, text, speakerId, noiseScale, lengthScale, noiseW, seed, audio);
+    }
+
+    size_t totalBytes = 0;
+    for (const auto& opus : sentenceOpus)
+        totalBytes += opus.size();
+
+    std::vector<uint8_t> chained;
+    chained.reserve(totalBytes);
+    for (const auto& opus : sentenceOpus)
+        chained.insert(chained.end(), opus.begin(), opus.end());
+    co_return chained;
+}
+
+// Like doSynthesis, but hands audio to sink as soon as it is available, in order.
+// A single sentence is streamed per decoder chunk, longer texts per sentence.
+static Task<> doStreamingSynthesis(
+    piper::Voice& voice,
+    const std::string& text,
+    const std::optional<piper::PhonemeData>& phonemes,
+    std::optional<size_t> speakerId,
+    std::optional<float> noiseScale,
+    std::optional<float> lengthScale,
+    std::optional<float> noiseW,
+    std::optional<uint64_t> seed,
+    std::function<void(std::span<const int16_t>)> sink)
+{
+    std::vector<int16_t> stored;
+    if (loadStoredAudio(voice, text, speakerId, noiseScale, lengthScale, noiseW, seed, stored)) {
+        sink(stored);
+        co_return;
+    }
+
+    auto phonemeData = requestPhonemes(voice, text, phonemes);
+    const size_t sentenceCount = phonemeData.sentences.size();
+    if (sentenceCount == 0)
+        co_return;
+
+    // Everything streamed so far, for the audio store
+    std::vector<int16_t> streamed;
+    if (sentenceCount == 1) {
+        std::vector<int16_t> audioBuffer;
+        piper::SynthesisResult result{};
+        piper::synthesize(voice, phonemeData, audioBuffer, result,
+                         [&]() {
+                             sink(audioBuffer);
+                             if (audioStore)
+                                 streamed.insert(streamed.end(), audioBuffer.begin(), audioBuffer.end());
+                         },
+                         speakerId, noiseScale, lengthScale, noiseW, seed);
+        storeAudio(voice, text, speakerId, noiseScale, lengthScale, noiseW, seed, streamed);
+        co_return;
+    }
+
+    std::vector<std::vector<int16_t>> sentenceAudio(sentenceCount);
+    std::vector<piper::SynthesisResult> sentenceResults(sentenceCount);
+
+    co_await ParallelSynthAwaiter(
+        synthesizerThreadPool, voice, phonemeData,
+        sentenceAudio, sentenceResults,
+        speakerId, noiseScale, lengthScale, noiseW, seed,
+        [&](size_t i) {
+            sink(sentenceAudio[i]);
+            if (audioStore)
+                streamed.insert(streamed.end(), sentenceAudio[i].begin(), sentenceAudio[i].end());
+            // Sent already, no need to keep it around
+            sentenceAudio[i] = {};
+        });
+    storeAudio(voice, text, speakerId, noiseScale, lengthScale, noiseW, seed, streamed);
+}
+
+// How far ahead of the paced real time synthesis may run, in seconds of audio
+static constexpr double PACE_LEAD_SECONDS = 1.0;
+
+// Synthesizes one sentence at a time into pipeline. Between sentences the
+// stream waits for the client to catch up (flow control) and for the paced
+// clock, without holding up the synthesizer thread.
+static Task<> doFlowControlledSynthesis(
+    const SynthesisApiParams& params,
+    std::shared_ptr<AudioPipeline> pipeline,
+    ConnectionFlowControl& flow)
+{
+    auto& voice = *params.voice;
+    auto phonemeData = requestPhonemes(voice, params.text, params.phonemes);
+    const auto start = std::chrono::steady_clock::now();
+    const double sampleRate = voice.synthesisConfig.sampleRate;
+    double audioSeconds = 0;
+
+    for (auto& sentence : phonemeData.sentences) {
+        if (params.flow_control)
+            co_await flow.waitForWindow();
+        if (params.pace.has_value()) {
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            double ahead = audioSeconds / *params.pace - elapsed;
+            if (ahead > PACE_LEAD_SECONDS)
+                co_await sleepCoro(trantor::EventLoop::getEventLoopOfCurrentThread(),
+                                   std::chrono::duration<double>(ahead - PACE_LEAD_SECONDS));
+        }
+        // Nobody to send to anymore
+        if (flow.isClosed())
+            co_return;
+
+        piper::PhonemeData single;
+        single.sentences.push_back(std::move(sentence));
+        std::vector<int16_t> audioBuffer;
+        piper::SynthesisResult result{};
+        piper::synthesize(voice, single, audioBuffer, result,
+                         [&]() {
+                             pipeline->push(audioBuffer);
+                             audioSeconds += audioBuffer.size() / sampleRate;
+                         },
+                         params.speaker_id, params.noise_scale, params.length_scale, params.noise_w, params.seed);
+    }
+}
+
+// Chunked transfer response that streams the synthesized audio
+// With a ticket, the streamed bytes are also collected and put into the
+// response cache once the stream completed.
+static HttpResponsePtr makeStreamingSynthesisResponse(SynthesisApiParams params,
+    std::shared_ptr<ResponseCache::Ticket> ticket = nullptr)
+{
+    const auto format = parseAudioFormat(params.audio_format);
+    auto resp = HttpResponse::newAsyncStreamResponse(
+        [params = std::move(params), format, ticket](ResponseStreamPtr responseStream) mutable {
+            std::shared_ptr<ResponseStream> stream = std::move(responseStream);
+            async_run([params = std::move(params), format, stream, ticket = std::move(ticket)]() -> Task<> {
+                co_await switchThreadCoro(synthesizerThreadPool.getNextLoop());
+                auto& voice = *params.voice;
+
+                // Only touched on the pipeline's loop
+                auto tee = std::make_shared<std::string>();
+                bool teeing = ticket != nullptr;
+                // Headers are out already, on errors all we can do is end the stream early
+                auto pipeline = std::make_shared<AudioPipeline>(format, voice.synthesisConfig.sampleRate,
+                    params.opus_options,
+                    [stream, tee, teeing](std::span<const uint8_t> chunk) mutable {
+                        std::string data(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+                        if(teeing && tee->size() + data.size() <= responseCache->maxEntryBytes())
+                            tee->append(data);
+                        else if(teeing) {
+                            // Too large to be cached anyway
+                            teeing = false;
+                            *tee = {};
+                        }
+                        stream->send(std::move(data));
+                    },
+                    [stream, tee, ticket, format](bool ok) {
+                        if(ok && ticket && !tee->empty())
+                            ticket->fulfill(std::make_shared<CachedResponse>(std::move(*tee), audioContentType(format)));
+                        stream->close();
+                    });
+                bool ok = true;
+                try {
+                    // The sink is never called concurrently, sentences are handed over in order
+                    co_await doStreamingSynthesis(voice, params.text, params.phonemes, params.speaker_id,
+                        params.noise_scale, params.length_scale, params.noise_w, params.seed,
+                        [&](std::span<const int16_t> pcm) {
+                            pipeline->push(pcm);
+                        });
+                }
+                catch (const std::exception& e) {
+                    LOG_ERROR << "Exception thrown while streaming speech: " << e.what();
+                    ok = false;
+                }
+                pipeline->finish(ok);
             });
+        });
+    resp->setContentTypeString(audioContentType(format));
+    return resp;
+}
+
+// Everything that changes the response, with the voice's defaults filled in
+static std::string makeResponseCacheKey(const SynthesisApiParams& params)
+{
+    const auto& voice = *params.voice;
+    const auto& config = voice.synthesisConfig;
+    const auto& opus = params.opus_options;
+    const auto seed = params.seed ? params.seed : config.seed;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%lld|%a|%a|%a|%d%llu|%d|%d|%zu|%d|%a|%d|",
+        (long long)params.speaker_id.value_or(config.speakerId.value_or(0)),
+        params.noise_scale.value_or(config.noiseScale),
+        params.length_scale.value_or(config.lengthScale),
+        params.noise_w.value_or(config.noiseW),
+        (int)seed.has_value(), (unsigned long long)seed.value_or(0),
+        (int)parseAudioFormat(params.audio_format), (int)params.stream,
+        opus.bitrate, opus.complexity, opus.frameDuration, (int)opus.flushPages);
+    if(!params.phonemes.has_value())
+        return buf + voice.fingerprint + "|t|" + params.text;
+
+    std::string key = buf + voice.fingerprint + "|p|";
+    for(const auto& sentence : params.phonemes->sentences) {
+        for(const auto& phrase : sentence.phrases) {
+            for(auto id : phrase.phonemeIds)
+                key += std::to_string(id) + ",";
+            key += fmt::format("/{}/", phrase.silenceSeconds);
         }
+        key += ";";
+    }
+    return key;
+}
+
+static bool isResponseCacheable(const SynthesisApiParams& params)
+{
+    if(!responseCache)
+        return false;
+    if(!responseCacheDeterministic)
+        return true;
+    // Noise is drawn anew by every synthesis. In deterministic mode only
+    // responses without noise, or with noise from a seed, are cached, so a
+    // hit matches a fresh synthesis.
+    const auto& voice = *params.voice;
+    const auto& config = voice.synthesisConfig;
+    if((params.seed || config.seed) && voice.encoder.hasNoiseInputs)
+        return true;
+    return params.noise_scale.value_or(config.noiseScale) == 0.0f
+        && params.noise_w.value_or(config.noiseW) == 0.0f;
+}
+
+// Looks key up in the response cache. Suspends while an identical request is
+// being synthesized, and resumes on the thread that finished it.
+struct ResponseCacheAwaiter
+{
+    ResponseCache& cache;
+    std::string key;
+    ResponseCache::Lookup result;
+
+    bool await_ready() { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        return !cache.lookup(key, result, [this, handle](ResponseCache::Lookup lookup) {
+            result = std::move(lookup);
+            handle.resume();
+        });
     }
 
-private:
-    trantor::EventLoopThreadPool& pool_;
-    piper::Voice& voice_;
-    const piper::PhonemeData& phonemeData_;
-    std::vector<std::vector<int16_t>>& sentenceAudio_;
-    std::vector<piper::SynthesisResult>& sentenceResults_;
-    std::optional<size_t> speakerId_;
-    std::optional<float> noiseScale_;
-    std::optional<float> lengthScale_;
-    std::optional<float> noiseW_;
-    std::atomic<size_t> completed_{0};
-    std::atomic_flag exceptionCaptured_{};
+    ResponseCache::Lookup await_resume() { return std::move(result); }
 };
 
-// Phonemize sequentially, then synthesize sentences in parallel across the pool.
-// Single-sentence texts skip the awaiter and synthesize inline.
-static Task<std::vector<int16_t>> doSynthesis(
-    const std::string& text,
-    std::optional<size_t> speakerId,
-    std::optional<float> noiseScale,
-    std::optional<float> lengthScale,
-    std::optional<float> noiseW)
+static bool etagMatches(const std::string& ifNoneMatch, const std::string& etag)
 {
-    auto phonemeData = piper::phonemize(piperConfig, voice, text);
-    const size_t sentenceCount = phonemeData.sentences.size();
-    if (sentenceCount == 0)
-        co_return {};
+    if(ifNoneMatch.empty())
+        return false;
+    if(ifNoneMatch == "*")
+        return true;
+    // A list of tags, possibly weak ones
+    size_t pos = 0;
+    while((pos = ifNoneMatch.find(etag, pos)) != std::string::npos) {
+        bool startOk = pos == 0 || ifNoneMatch[pos - 1] == ' ' || ifNoneMatch[pos - 1] == ','
+            || ifNoneMatch[pos - 1] == '/';
+        size_t end = pos + etag.size();
+        bool endOk = end == ifNoneMatch.size() || ifNoneMatch[end] == ' ' || ifNoneMatch[end] == ',';
+        if(startOk && endOk)
+            return true;
+        pos = end;
+    }
+    return false;
+}
 
-    // Fast path: single sentence, synthesize inline without queueInLoop overhead
-    if (sentenceCount == 1) {
-        std::vector<int16_t> audioBuffer;
-        piper::SynthesisResult result{};
-        audioBuffer.reserve(voice.synthesisConfig.sampleRate);
-        piper::synthesize(voice, phonemeData, audioBuffer, result, nullptr,
-                         speakerId, noiseScale, lengthScale, noiseW);
-        co_return audioBuffer;
+static HttpResponsePtr makeCachedResponse(const HttpRequestPtr& req, const CachedResponse& cached)
+{
+    auto resp = HttpResponse::newHttpResponse();
+    resp->addHeader("ETag", cached.etag);
+    if(etagMatches(req->getHeader("If-None-Match"), cached.etag)) {
+        resp->setStatusCode(k304NotModified);
+        return resp;
     }
+    resp->setStatusCode(k200OK);
+    resp->setContentTypeString(cached.contentType);
+    resp->setBody(cached.body);
+    return resp;
+}
 
-    // Multi-sentence: dispatch each sentence to the pool in parallel
-    std::vector<std::vector<int16_t>> sentenceAudio(sentenceCount);
-    std::vector<piper::SynthesisResult> sentenceResults(sentenceCount);
+// Synthesizes the whole, non streamed response
+static Task<std::shared_ptr<const CachedResponse>> synthesizeResponse(const SynthesisApiParams& params)
+{
+    auto& voice = *params.voice;
+    if(parallelOpusEncode && parseAudioFormat(params.audio_format) == AudioFormat::Opus) {
+        auto opus = co_await doSynthesisOpus(voice, params.text, params.phonemes, params.speaker_id,
+            params.noise_scale, params.length_scale, params.noise_w, params.seed, params.opus_options);
+        co_return std::make_shared<CachedResponse>(
+            std::string(reinterpret_cast<const char*>(opus.data()), opus.size()), "audio/ogg; codecs=opus");
+    }
 
-    co_await ParallelSynthAwaiter(
-        synthesizerThreadPool, voice, phonemeData,
-        sentenceAudio, sentenceResults,
-        speakerId, noiseScale, lengthScale, noiseW);
+    auto audio = co_await doSynthesis(voice, params.text, params.phonemes, params.speaker_id,
+                                      params.noise_scale, params.length_scale, params.noise_w, params.seed);
+    if(params.audio_format.value_or("opus") == "opus") {
+        auto pcm = resample(audio, voice.synthesisConfig.sampleRate, 24000, 1, resampleQuality);
+        auto opus = encodeOgg(pcm, 24000, 1, params.opus_options);
+        co_return std::make_shared<CachedResponse>(
+            std::string(reinterpret_cast<const char*>(opus.data()), opus.size()), "audio/ogg; codecs=opus");
+    }
+    co_return std::make_shared<CachedResponse>(
+        std::string(reinterpret_cast<const char*>(audio.data()), audio.size() * sizeof(int16_t)), "audio/raw");
+}
 
-    // Stitch audio in sentence order (sentence silence already embedded by synthesize)
-    size_t totalSamples = 0;
-    for (const auto& audio : sentenceAudio)
-        totalSamples += audio.size();
+// Answers from the response cache if possible. Otherwise synthesizes,
+// streamed or not, and caches the result if the request is cacheable.
+static Task<HttpResponsePtr> respondWithSynthesis(const HttpRequestPtr req, SynthesisApiParams params)
+{
+    std::shared_ptr<ResponseCache::Ticket> ticket;
+    if(isResponseCacheable(params)) {
+        auto loop = trantor::EventLoop::getEventLoopOfCurrentThread();
+        auto lookup = co_await ResponseCacheAwaiter{*responseCache, makeResponseCacheKey(params)};
+        if(lookup.response)
+            co_return makeCachedResponse(req, *lookup.response);
+        ticket = std::move(lookup.ticket);
+        // We may have waited for another request and got resumed on its thread
+        co_await switchThreadCoro(loop);
+    }
 
-    std::vector<int16_t> stitched;
-    stitched.reserve(totalSamples);
-    for (auto& audio : sentenceAudio)
-        stitched.insert(stitched.end(), audio.begin(), audio.end());
+    if(params.stream)
+        co_return makeStreamingSynthesisResponse(std::move(params), std::move(ticket));
 
-    // Accumulate stats
-    piper::SynthesisResult totalResult{};
-    for (const auto& r : sentenceResults) {
-        totalResult.inferSeconds += r.inferSeconds;
-        totalResult.audioSeconds += r.audioSeconds;
+    std::shared_ptr<const CachedResponse> response;
+    try {
+        response = co_await synthesizeResponse(params);
     }
-    if (totalResult.audioSeconds > 0)
-        totalResult.realTimeFactor = totalResult.inferSeconds / totalResult.audioSeconds;
+    catch (const std::exception& e) {
+        co_return makeBadRequestResponse(e.what());
+    }
+    if(ticket)
+        ticket->fulfill(response);
 
-    co_return stitched;
+    auto resp = HttpResponse::newHttpResponse();
+    resp->setStatusCode(k200OK);
+    resp->setContentTypeString(response->contentType);
+    resp->setBody(response->body);
+    if(ticket)
+        resp->addHeader("ETag", response->etag);
+    co_return resp;
 }
 
 namespace api
 {
+static nlohmann::json collectMetrics();
+
 struct v1 : public HttpController<v1>
 {
     v1()
     {
         synthesizerThreadPool.start();
+        postProcessThreadPool.start();
+        voiceLoaderThread.run();
+        voiceReloadThread.run();
+        // Other workers read these for their /metrics
+        if(sharedMetrics) {
+            app().getLoop()->runEvery(1.0, []() {
+                sharedMetrics->publish(workerIndex, collectMetrics().dump());
+            });
+        }
     }
     METHOD_LIST_BEGIN
     METHOD_ADD(v1::synthesise, "/synthesise", {Post, Options});
     METHOD_ADD(v1::speakers, "/speakers", Get);
+    METHOD_ADD(v1::voices, "/voices", Get);
+    METHOD_ADD(v1::metrics, "/metrics", Get);
+    METHOD_ADD(v1::reload, "/admin/reload", Post);
+    METHOD_ADD(v1::shard, "/shard", Post);
     METHOD_LIST_END
 
     Task<HttpResponsePtr> synthesise(const HttpRequestPtr req);
     Task<HttpResponsePtr> speakers(const HttpRequestPtr req);
+    Task<HttpResponsePtr> voices(const HttpRequestPtr req);
+    Task<HttpResponsePtr> metrics(const HttpRequestPtr req);
+    Task<HttpResponsePtr> reload(const HttpRequestPtr req);
+    Task<HttpResponsePtr> shard(const HttpRequestPtr req);
 };
 
 struct v1ws : public WebSocketController<v1ws>
 {
    void handleNewConnection(const HttpRequestPtr& req, const WebSocketConnectionPtr& wsConnPtr) override;
    void handleNewMessage(const WebSocketConnectionPtr& wsConnPtr, std::string&& message, const WebSocketMessageType& type) override;
-   void handleConnectionClosed(const WebSocketConnectionPtr& wsConnPtr) override {}
+   void handleConnectionClosed(const WebSocketConnectionPtr& wsConnPtr) override;
 
 
-   Task<> handleNewMessageAsync(WebSocketConnectionPtr wsConnPtr, std::string message, WebSocketMessageType type);
+   Task<> handleNewMessageAsync(WebSocketConnectionPtr wsConnPtr, std::string message,
+        std::shared_ptr<StreamConnection::DeliverySlot> slot);
    WS_PATH_LIST_BEGIN
    WS_PATH_ADD("/api/v1/stream", Get);
    WS_PATH_LIST_END
@@ -353,24 +1569,112 @@ struct v1ws : public WebSocketController<v1ws>
 
 void v1ws::handleNewConnection(const HttpRequestPtr& req, const WebSocketConnectionPtr& wsConnPtr)
 {
-    if(authToken.empty())
-        return;
-    auto auth = req->getHeader("Authorization");
-    if(auth.empty() || auth != "Bearer " + authToken) {
-        wsConnPtr->forceClose();
-        return;
+    if(!authToken.empty()) {
+        auto auth = req->getHeader("Authorization");
+        if(auth.empty() || auth != "Bearer " + authToken) {
+            wsConnPtr->forceClose();
+            return;
+        }
     }
+    wsConnPtr->setContext(std::make_shared<StreamConnection>());
+}
+
+void v1ws::handleConnectionClosed(const WebSocketConnectionPtr& wsConnPtr)
+{
+    auto conn = wsConnPtr->getContext<StreamConnection>();
+    if(conn)
+        conn->close();
 }
 
 void v1ws::handleNewMessage(const WebSocketConnectionPtr& wsConnPtr, std::string&& message, const WebSocketMessageType& type)
 {
+    // Acks are handled right here, a stream may be waiting for them on the synthesizer threads
+    if(type == WebSocketMessageType::Text && message.find("\"ack\"") != std::string::npos) {
+        auto json = nlohmann::json::parse(message, nullptr, false);
+        if(json.is_object() && json.contains("ack") && json["ack"].is_number_unsigned()) {
+            auto conn = wsConnPtr->getContext<StreamConnection>();
+            if(conn)
+                conn->flow.onAck(json["ack"].get<size_t>());
+            return;
+        }
+    }
+
+    if(type != WebSocketMessageType::Text)
+        return;
+    auto conn = wsConnPtr->getContext<StreamConnection>();
+    if(!conn)
+        return;
+
+    // Messages are parsed on the synthesizer threads, in no particular order.
+    // Taking the place in line here keeps ordered output in arrival order.
+    auto slot = conn->reserveSlot();
     synthesizerThreadPool.getNextLoop()->queueInLoop(async_func([=, this]() mutable -> Task<> {
-        co_await handleNewMessageAsync(wsConnPtr, std::move(message), type);
+        co_await handleNewMessageAsync(wsConnPtr, std::move(message), slot);
     }));
 }
-Task<> v1ws::handleNewMessageAsync(WebSocketConnectionPtr wsConnPtr, std::string message, WebSocketMessageType type)
+// Runs one request of a /api/v1/stream connection
+static Task<> runStreamRequest(WebSocketConnectionPtr wsConnPtr, std::shared_ptr<StreamConnection> conn,
+    SynthesisApiParams params, std::shared_ptr<StreamConnection::DeliverySlot> slot)
 {
-    if(type != WebSocketMessageType::Text)
+    const auto requestId = params.request_id;
+    try {
+        co_await resolveSynthesisVoice(params);
+    }
+    catch(const std::exception& e) {
+        conn->send(wsConnPtr, slot, makeStreamStatusMessage(false, requestId, e.what()), WebSocketMessageType::Text);
+        conn->complete(wsConnPtr, slot);
+        conn->requestFinished();
+        co_return;
+    }
+
+    // The status message goes out from the pipeline, after the audio before it
+    auto pipeline = std::make_shared<AudioPipeline>(
+        conn->acquireEncoder(parseAudioFormat(params.audio_format), params.voice->synthesisConfig.sampleRate,
+            params.opus_options),
+        [wsConnPtr, conn, slot, requestId](std::span<const uint8_t> chunk) {
+            // Tagged messages start with the request id, little endian
+            std::string message;
+            message.reserve(sizeof(uint32_t) + chunk.size());
+            if(requestId.has_value()) {
+                for(size_t i = 0; i < sizeof(uint32_t); i++)
+                    message.push_back((char)((*requestId >> (8 * i)) & 0xff));
+            }
+            message.append(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+            conn->send(wsConnPtr, slot, std::move(message), WebSocketMessageType::Binary);
+        },
+        [wsConnPtr, conn, slot, requestId](bool ok) {
+            conn->send(wsConnPtr, slot, makeStreamStatusMessage(ok, requestId), WebSocketMessageType::Text);
+            conn->complete(wsConnPtr, slot);
+            conn->requestFinished();
+        },
+        [conn](std::unique_ptr<AudioStreamEncoder> encoder) {
+            conn->releaseEncoder(std::move(encoder));
+        });
+
+    if(!params.flow_control && !params.pace.has_value()) {
+        bool ok = speak(*params.voice, params.text, params.phonemes, params.speaker_id, [&](const std::span<const short> view) {
+            pipeline->push(view);
+        }, params.length_scale, params.noise_scale, params.noise_w, params.seed);
+        pipeline->finish(ok);
+        co_return;
+    }
+
+    bool ok = true;
+    try {
+        co_await doFlowControlledSynthesis(params, pipeline, conn->flow);
+    }
+    catch(const std::exception& e) {
+        LOG_ERROR << "Exception thrown while generating speach: " << e.what();
+        ok = false;
+    }
+    pipeline->finish(ok);
+}
+
+Task<> v1ws::handleNewMessageAsync(WebSocketConnectionPtr wsConnPtr, std::string message,
+    std::shared_ptr<StreamConnection::DeliverySlot> slot)
+{
+    auto conn = wsConnPtr->getContext<StreamConnection>();
+    if(!conn)
         co_return;
 
     SynthesisApiParams params;
@@ -381,45 +1685,24 @@ Task<> v1ws::handleNewMessageAsync(WebSocketConnectionPtr wsConnPtr, std::string
         nlohmann::json resp;
         resp["status"] = "failed";
         resp["message"] = std::string(e.what());
-        wsConnPtr->send(resp.dump());
+        // Tell the client which request failed, if it can be made out
+        auto json = nlohmann::json::parse(message, nullptr, false);
+        if(json.is_object() && json.contains("request_id") && json["request_id"].is_number_unsigned())
+            resp["request_id"] = json["request_id"];
+        conn->send(wsConnPtr, slot, resp.dump(), WebSocketMessageType::Text);
+        conn->complete(wsConnPtr, slot);
         co_return;
     }
-    bool send_opus = params.audio_format.value_or("opus") == "opus";
-
-    StreamingOggOpusEncoder encoder(24000, 1);
-    bool ok = speak(params.text, params.speaker_id, [&](const std::span<const short> view) {
-        if(view.empty())
-            return;
-        if(send_opus) {
-            auto pcm = resample(view, voice.synthesisConfig.sampleRate, 24000, 1);
-            auto opus = encoder.encode(pcm);
-            if(!opus.empty())
-                wsConnPtr->send((char*)opus.data(), opus.size(), WebSocketMessageType::Binary);
-            return;
-        }
-
-        if constexpr (std::endian::native == std::endian::big) {
-            // Convert to little endian
-            std::vector<int16_t> pcm(view.begin(), view.end());
-            for(int16_t& sample : pcm)
-                sample = (sample >> 8) | (sample << 8);
-            wsConnPtr->send((char*)pcm.data(), pcm.size() * sizeof(int16_t), WebSocketMessageType::Binary);
-            return;
-        }
-        wsConnPtr->send((char*)view.data(), view.size() * sizeof(int16_t), WebSocketMessageType::Binary);
-    }, params.length_scale, params.noise_scale, params.noise_w);
-
-    if(!ok) {
-        wsConnPtr->send(R"({"status":"failed", "message":"failed to synthesis"})");
-        co_return;
 
+    if(!params.ordered) {
+        conn->complete(wsConnPtr, slot);
+        slot = nullptr;
     }
-    if(send_opus) {
-        auto opus = encoder.finish();
-        if(opus.empty() == false)
-            wsConnPtr->send((char*)opus.data(), opus.size(), WebSocketMessageType::Binary);
-    }
-    wsConnPtr->send(R"({"status":"ok", "message":"finished"})");
+    conn->submit([wsConnPtr, conn, params = std::move(params), slot]() {
+        synthesizerThreadPool.getNextLoop()->queueInLoop(async_func([=]() -> Task<> {
+            co_await runStreamRequest(wsConnPtr, conn, params, slot);
+        }));
+    });
 }
 
 Task<HttpResponsePtr> v1::synthesise(const HttpRequestPtr req)
@@ -447,32 +1730,104 @@ Task<HttpResponsePtr> v1::synthesise(const HttpRequestPtr req)
     SynthesisApiParams params;
     try {
         params = parseSynthesisApiParams(req->getBody());
+        co_await resolveSynthesisVoice(params);
     }
     catch (const std::exception& e) {
         co_return makeBadRequestResponse(e.what());
     }
 
-    std::vector<int16_t> audio;
-    try {
-        audio = co_await doSynthesis(params.text, params.speaker_id,
-                                     params.noise_scale, params.length_scale, params.noise_w);
+    // Raw Opus packets rely on WebSocket message boundaries for framing
+    if(parseAudioFormat(params.audio_format) == AudioFormat::OpusRaw)
+        co_return makeBadRequestResponse("opus-raw is only supported by the streaming WebSocket API");
+
+    co_return co_await respondWithSynthesis(req, std::move(params));
+}
+
+// Statistics of this process
+static nlohmann::json collectMetrics()
+{
+    nlohmann::json json = nlohmann::json::object();
+    if(responseCache) {
+        auto stats = responseCache->stats();
+        const size_t lookups = stats.hits + stats.misses + stats.coalesced;
+        json["response_cache"] = {
+            {"hits", stats.hits},
+            {"misses", stats.misses},
+            {"coalesced", stats.coalesced},
+            {"hit_rate", lookups > 0 ? (double)(stats.hits + stats.coalesced) / lookups : 0.0},
+            {"insertions", stats.insertions},
+            {"evictions", stats.evictions},
+            {"entries", stats.entries},
+            {"bytes", stats.bytes},
+            {"capacity", stats.capacity},
+        };
     }
-    catch (const std::exception& e) {
-        co_return makeBadRequestResponse(e.what());
+    auto voice = defaultVoice.load();
+    if(voice->sentenceCache) {
+        auto& cache = *voice->sentenceCache;
+        const size_t hits = cache.hits(), misses = cache.misses();
+        json["sentence_cache"] = {
+            {"hits", hits},
+            {"misses", misses},
+            {"hit_rate", hits + misses > 0 ? (double)hits / (hits + misses) : 0.0},
+            {"stretched", cache.stretched()},
+            {"entries", cache.entries()},
+            {"bytes", cache.bytes()},
+            {"capacity", cache.capacity()},
+        };
+    }
+    if(audioStore) {
+        auto stats = audioStore->stats();
+        const size_t lookups = stats.hits + stats.misses;
+        json["audio_store"] = {
+            {"hits", stats.hits},
+            {"misses", stats.misses},
+            {"hit_rate", lookups > 0 ? (double)stats.hits / lookups : 0.0},
+            {"entries", stats.entries},
+            {"bytes", stats.dataBytes},
+            {"capacity", stats.capacityBytes},
+        };
+    }
+    if(shardCluster) {
+        auto stats = shardCluster->stats();
+        json["shard_cluster"] = {
+            {"workers", stats.workers},
+            {"healthy", stats.healthy},
+            {"in_flight", stats.inFlight},
+            {"shards", stats.shards},
+            {"failures", stats.failures},
+            {"retries", stats.retries},
+            {"fallbacks", stats.fallbacks},
+        };
+    }
+    if(voiceRegistry) {
+        auto stats = voiceRegistry->stats();
+        json["voices"] = {
+            {"voices", stats.voices},
+            {"loaded", stats.loaded},
+            {"loads", stats.loads},
+            {"evictions", stats.evictions},
+            {"bytes", stats.bytes},
+            {"budget", stats.budget},
+        };
     }
 
-    auto resp = HttpResponse::newHttpResponse();
-    if(params.audio_format.value_or("opus") == "opus") {
-        auto pcm = resample(audio, voice.synthesisConfig.sampleRate, 24000, 1);
-        auto opus = encodeOgg(pcm, 24000, 1);
-        resp->setContentTypeString("audio/ogg; codecs=opus");
-        resp->setBody(std::string(reinterpret_cast<const char*>(opus.data()), opus.size()));
-        co_return resp;
+    return json;
+}
+
+Task<HttpResponsePtr> v1::metrics(const HttpRequestPtr req)
+{
+    auto json = collectMetrics();
+    // Prefork mode, add up the workers
+    if(sharedMetrics) {
+        sharedMetrics->publish(workerIndex, json.dump());
+        json = aggregateMetrics(sharedMetrics->read());
     }
 
+    auto resp = HttpResponse::newHttpResponse();
     resp->setStatusCode(k200OK);
-    resp->setContentTypeString("audio/raw");
-    resp->setBody(std::string(reinterpret_cast<const char*>(audio.data()), audio.size() * sizeof(int16_t)));
+    resp->setContentTypeCode(CT_APPLICATION_JSON);
+    resp->setBody(json.dump());
     co_return resp;
 }
 
@@ -482,8 +1837,17 @@ Task<HttpResponsePtr> v1::speakers(const HttpRequestPtr req)
     resp->setStatusCode(k200OK);
     resp->setContentTypeCode(CT_APPLICATION_JSON);
 
+    // ?voice=name lists the speakers of a registry voice
+    auto voiceName = req->getParameter("voice");
+    if(!voiceName.empty()) {
+        if(!voiceRegistry || !voiceRegistry->contains(voiceName))
+            co_return makeBadRequestResponse("Unknown voice " + voiceName);
+        resp->setBody(nlohmann::json(voiceRegistry->speakers(voiceName)).dump());
+        co_return resp;
+    }
 
-    const auto& speakerIdMap = voice.modelConfig.speakerIdMap;
+    auto voice = defaultVoice.load();
+    const auto& speakerIdMap = voice->modelConfig.speakerIdMap;
     if(speakerIdMap.has_value() == false) {
         resp->setBody("{}");
     }
@@ -493,6 +1857,150 @@ Task<HttpResponsePtr> v1::speakers(const HttpRequestPtr req)
     co_return resp;
 }
 
+// Voices of the registry with their speakers, whether loaded or not
+Task<HttpResponsePtr> v1::voices(const HttpRequestPtr req)
+{
+    nlohmann::json json = nlohmann::json::object();
+    if(voiceRegistry) {
+        for(const auto& name : voiceRegistry->names()) {
+            json[name] = {
+                {"loaded", voiceRegistry->isLoaded(name)},
+                {"speakers", voiceRegistry->speakers(name)},
+            };
+        }
+    }
+
+    auto resp = HttpResponse::newHttpResponse();
+    resp->setStatusCode(k200OK);
+    resp->setContentTypeCode(CT_APPLICATION_JSON);
+    resp->setBody(json.dump());
+    co_return resp;
+}
+
+// One sentence of phoneme ids from a coordinator, answered with raw PCM of the
+// default voice
+Task<HttpResponsePtr> v1::shard(const HttpRequestPtr req)
+{
+    // 401 rather than 400, coordinators take the worker out of rotation
+    if(!authToken.empty()) {
+        auto auth = req->getHeader("Authorization");
+        if(auth.empty() || auth != "Bearer " + authToken) {
+            auto resp = HttpResponse::newHttpResponse();
+            resp->setStatusCode(k401Unauthorized);
+            resp->setContentTypeCode(CT_TEXT_PLAIN);
+            resp->setBody("Invalid Authorization");
+            co_return resp;
+        }
+    }
+
+    auto loop = synthesizerThreadPool.getNextLoop();
+    co_await switchThreadCoro(loop);
+
+    auto voice = defaultVoice.load();
+    piper::PhonemeData phonemeData;
+    ShardOptions options;
+    try {
+        parseShardRequest(req->getBody(), phonemeData.sentences.emplace_back(), options);
+    }
+    catch(const std::exception& e) {
+        co_return makeBadRequestResponse(e.what());
+    }
+
+    // The phoneme ids mean something else to another voice, even if in range
+    if(options.voice != voice->configDigest) {
+        auto resp = HttpResponse::newHttpResponse();
+        resp->setStatusCode(k409Conflict);
+        resp->setContentTypeCode(CT_TEXT_PLAIN);
+        resp->setBody("Worker serves voice " + voice->configDigest + ", not " + options.voice);
+        co_return resp;
+    }
+
+    try {
+        piper::validatePhonemeData(*voice, phonemeData);
+        piper::checkSeed(*voice, options.seed);
+        if(options.speakerId.has_value() && *options.speakerId >= (size_t)voice->modelConfig.numSpeakers)
+            throw std::runtime_error("Speaker ID is out of range");
+    }
+    catch(const std::exception& e) {
+        co_return makeBadRequestResponse(e.what());
+    }
+    if(!serverReady) {
+        auto resp = HttpResponse::newHttpResponse();
+        resp->setStatusCode(k503ServiceUnavailable);
+        co_return resp;
+    }
+    // Coordinators probe workers with empty sentences
+    if(phonemeData.sentences[0].phrases.empty()) {
+        auto resp = HttpResponse::newHttpResponse();
+        resp->setStatusCode(k200OK);
+        resp->addHeader("X-Sample-Rate", std::to_string(voice->synthesisConfig.sampleRate));
+        co_return resp;
+    }
+
+    std::vector<int16_t> audio;
+    piper::SynthesisResult result{};
+    try {
+        piper::synthesize(*voice, phonemeData, audio, result, nullptr,
+            options.speakerId, options.noiseScale, options.lengthScale, options.noiseW, options.seed,
+            options.sentenceSilenceSeconds);
+    }
+    catch(const std::exception& e) {
+        LOG_ERROR << "Shard synthesis failed: " << e.what();
+        auto resp = HttpResponse::newHttpResponse();
+        resp->setStatusCode(k500InternalServerError);
+        resp->setContentTypeCode(CT_TEXT_PLAIN);
+        resp->setBody(e.what());
+        co_return resp;
+    }
+
+    auto resp = HttpResponse::newHttpResponse();
+    resp->setStatusCode(k200OK);
+    resp->setContentTypeCode(CT_APPLICATION_OCTET_STREAM);
+    resp->addHeader("X-Sample-Rate", std::to_string(voice->synthesisConfig.sampleRate));
+    resp->setBody(std::string(reinterpret_cast<const char*>(audio.data()), audio.size() * sizeof(int16_t)));
+    co_return resp;
+}
+
+// Loads the voices from their files again, answers once the new ones serve
+Task<HttpResponsePtr> v1::reload(const HttpRequestPtr req)
+{
+    if(!authToken.empty()) {
+        auto auth = req->getHeader("Authorization");
+        if(auth.empty() || auth != "Bearer " + authToken)
+            co_return makeBadRequestResponse("Invalid Authorization");
+    }
+
+    // Loading takes seconds, keep it off the event loop
+    auto loop = trantor::EventLoop::getEventLoopOfCurrentThread();
+    co_await switchThreadCoro(voiceReloadThread.getLoop());
+    bool reloaded = false;
+    std::string error;
+    try {
+        reloaded = reloadVoices();
+    }
+    catch(const std::exception& e) {
+        error = e.what();
+    }
+    co_await switchThreadCoro(loop);
+
+    auto resp = HttpResponse::newHttpResponse();
+    resp->setContentTypeCode(CT_APPLICATION_JSON);
+    if(!error.empty()) {
+        LOG_ERROR << "Reloading voices failed: " << error;
+        resp->setStatusCode(k500InternalServerError);
+        resp->setBody(nlohmann::json{{"status", "failed"}, {"message", error}}.dump());
+    }
+    else if(!reloaded) {
+        resp->setStatusCode(k409Conflict);
+        resp->setBody(R"({"status":"busy","message":"Voices are being reloaded already"})");
+    }
+    else {
+        resp->setStatusCode(k200OK);
+        resp->setBody(R"({"status":"reloaded"})");
+    }
+    co_return resp;
+}
+
 } // namespace api
 
 namespace v1
@@ -540,14 +2048,33 @@ Task<HttpResponsePtr> audio::speech(const HttpRequestPtr req)
         co_return makeBadRequestResponse("Missing or invalid 'input' field");
 
     SynthesisApiParams params;
-    auto inputText = json["input"].get<std::string>();
-    if(inputText.size() > MAX_TEXT_LENGTH)
+    params.text = json["input"].get<std::string>();
+    if(params.text.size() > MAX_TEXT_LENGTH)
         co_return makeBadRequestResponse("Text too long");
-    params.text = piperTextPreprocess(std::move(inputText));
 
-    // Resolve "voice" to speaker_id (numeric string or case-insensitive name)
-    if(json.contains("voice") && json["voice"].is_string()) {
-        auto v = json["voice"].get<std::string>();
+    // "model" or "voice" may name a voice of the registry, otherwise "voice"
+    // names a speaker of the voice
+    std::optional<std::string> speakerName;
+    if(json.contains("voice") && json["voice"].is_string())
+        speakerName = json["voice"].get<std::string>();
+    if(voiceRegistry && speakerName && voiceRegistry->contains(*speakerName)) {
+        params.voice_name = speakerName;
+        speakerName.reset();
+    }
+    else if(voiceRegistry && json.contains("model") && json["model"].is_string()
+        && voiceRegistry->contains(json["model"].get<std::string>()))
+        params.voice_name = json["model"].get<std::string>();
+    try {
+        co_await resolveSynthesisVoice(params);
+    }
+    catch (const std::exception& e) {
+        co_return makeBadRequestResponse(e.what());
+    }
+    const auto& voice = *params.voice;
+
+    // Resolve the speaker to speaker_id (numeric string or case-insensitive name)
+    if(speakerName) {
+        const auto& v = *speakerName;
         char* end = nullptr;
         long id = std::strtol(v.c_str(), &end, 10);
         if(end != v.c_str() && *end == '\0' && id >= 0) {
@@ -565,23 +2092,67 @@ Task<HttpResponsePtr> audio::speech(const HttpRequestPtr req)
             }
         }
     }
-
-    std::vector<int16_t> audioBuffer;
-    try {
-        audioBuffer = co_await doSynthesis(params.text, params.speaker_id,
-                                           params.noise_scale, params.length_scale, params.noise_w);
+    if(params.speaker_id.has_value() && *params.speaker_id >= voice.modelConfig.numSpeakers)
+        co_return makeBadRequestResponse("Speaker ID is out of range");
+
+    // pcm and wav are sent at the voice's native sample rate, so they skip
+    // resampling and encoding entirely
+    std::string responseFormat = "opus";
+    if(json.contains("response_format")) {
+        if(json["response_format"].is_string() == false)
+            co_return makeBadRequestResponse("response_format must be a string");
+        responseFormat = json["response_format"].get<std::string>();
     }
-    catch (const std::exception& e) {
-        co_return makeBadRequestResponse(std::string("Synthesis failed: ") + e.what());
+    if(responseFormat != "opus" && responseFormat != "pcm" && responseFormat != "wav")
+        co_return makeBadRequestResponse("Unsupported response_format " + responseFormat + ", valid: opus, pcm, wav");
+    params.audio_format = responseFormat;
+
+    // speed is the inverse of piper's length_scale
+    if(json.contains("speed")) {
+        if(json["speed"].is_number() == false)
+            co_return makeBadRequestResponse("speed must be a number");
+        auto speed = json["speed"].get<float>();
+        if(!std::isfinite(speed) || speed < 0.25f || speed > 4.0f)
+            co_return makeBadRequestResponse("speed out of range (0.25 to 4.0)");
+        params.length_scale = voice.synthesisConfig.lengthScale / speed;
     }
 
-    auto pcm = resample(audioBuffer, voice.synthesisConfig.sampleRate, 24000, 1);
-    auto opus = encodeOgg(pcm, 24000, 1);
+    // Like OpenAI, the body is always streamed as it is synthesized
+    params.stream = true;
+    co_return co_await respondWithSynthesis(req, std::move(params));
+}
+} // namespace v1
+
+
+// Probes for load balancers and orchestrators, no authentication
+struct health : public HttpController<health>
+{
+    METHOD_LIST_BEGIN
+    ADD_METHOD_TO(health::healthz, "/healthz", Get);
+    ADD_METHOD_TO(health::readyz, "/readyz", Get);
+    METHOD_LIST_END
+
+    Task<HttpResponsePtr> healthz(const HttpRequestPtr req);
+    Task<HttpResponsePtr> readyz(const HttpRequestPtr req);
+};
 
+// The process is up and serving HTTP
+Task<HttpResponsePtr> health::healthz(const HttpRequestPtr req)
+{
     auto resp = HttpResponse::newHttpResponse();
-    resp->setContentTypeString("audio/ogg; codecs=opus");
-    resp->setBody(std::string(reinterpret_cast<const char*>(opus.data()), opus.size()));
+    resp->setStatusCode(k200OK);
+    resp->setContentTypeCode(CT_APPLICATION_JSON);
+    resp->setBody(R"({"status":"ok"})");
     co_return resp;
 }
-} // namespace v1
 
+// The default voice is warmed up, requests won't pay for first inferences
+Task<HttpResponsePtr> health::readyz(const HttpRequestPtr req)
+{
+    const bool ready = serverReady.load();
+    auto resp = HttpResponse::newHttpResponse();
+    resp->setStatusCode(ready ? k200OK : k503ServiceUnavailable);
+    resp->setContentTypeCode(CT_APPLICATION_JSON);
+    resp->setBody(nlohmann::json{{"ready", ready}}.dump());
+    co_return resp;
+}
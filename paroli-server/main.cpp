@@ -1,9 +1,14 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <functional>
+#include <future>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -19,6 +24,9 @@
 #ifdef _WIN32
 #include <fcntl.h>
 #include <io.h>
+#else
+#include <csignal>
+#include <pthread.h>
 #endif
 
 #ifdef __APPLE__
@@ -29,7 +37,13 @@
 #include <spdlog/spdlog.h>
 
 #include <nlohmann/json.hpp>
+#include "audio-store.hpp"
 #include "piper.hpp"
+#include "Prefork.hpp"
+#include "Resampler.hpp"
+#include "ResponseCache.hpp"
+#include "ShardCluster.hpp"
+#include "VoiceRegistry.hpp"
 
 #include <drogon/drogon.h>
 
@@ -59,6 +73,9 @@ struct RunConfig {
   // Variation in phoneme lengths
   optional<float> noiseW;
 
+  // Seed for the synthesis noise, makes output reproducible
+  optional<uint64_t> seed;
+
   // Seconds of silence to add after each sentence
   optional<float> sentenceSilenceSeconds;
 
@@ -69,6 +86,16 @@ struct RunConfig {
   // https://github.com/mush42/libtashkeel/
   optional<filesystem::path> tashkeelModelPath;
 
+  // Number of diacritized sentences to cache (0 disables the cache)
+  optional<size_t> tashkeelCacheSize;
+
+  // Memory for synthesized sentence audio in MiB (0 disables the cache)
+  size_t sentenceCacheSize = 0;
+
+  // Stretch cached sentences whose length scale is off by at most this
+  // fraction, instead of synthesizing them (0 disables it)
+  float timeStretchTolerance = 0;
+
   // Seconds of extra silence to insert after a single phoneme
   optional<std::map<piper::Phoneme, float>> phonemeSilenceSeconds;
 
@@ -76,6 +103,10 @@ struct RunConfig {
   // This has 0 affect if the underlying model is not handled by ONNX.
   std::string accelerator = "";
 
+  // Directory to cache optimized models in, for faster startup (disabled if
+  // not set)
+  optional<filesystem::path> modelCachePath;
+
   // IP address for the server to bind to
   std::string ip = "127.0.0.1";
 
@@ -87,17 +118,87 @@ struct RunConfig {
 
   // Disable web UI
   bool disableWebUI = false;
+
+  // Quality of resampling to 24kHz for Opus
+  ResampleQuality resampleQuality = ResampleQuality::Medium;
+
+  // Encode Opus per sentence on the synthesis workers (chained Ogg output)
+  bool parallelOpusEncode = false;
+
+  // Unacknowledged bytes at which flow controlled WebSocket streams pause
+  size_t wsHighWaterMark = 256 * 1024;
+
+  // Unacknowledged bytes at which paused streams resume
+  size_t wsLowWaterMark = 64 * 1024;
+
+  // Requests synthesized at once per WebSocket connection, more are queued
+  size_t wsMaxConcurrentRequests = 2;
+
+  // Memory for cached HTTP responses in MiB (0 disables the cache)
+  size_t responseCacheSize = 0;
+
+  // Only cache responses a fresh synthesis would reproduce exactly
+  bool responseCacheDeterministic = false;
+
+  // Directory of the persistent audio store (disabled if not set)
+  optional<filesystem::path> audioStorePath;
+
+  // Size limit of the audio store in MiB
+  size_t audioStoreSize = 1024;
+
+  // File with one text per line to synthesize into the audio store at startup
+  optional<filesystem::path> prewarmPath;
+
+  // Directory of voices selectable per request (disabled if not set)
+  optional<filesystem::path> voicesPath;
+
+  // Memory for loaded voices of the directory in MiB (0 for no limit)
+  size_t voiceMemory = 0;
+
+  // Rounds of warmup inference per voice before it serves (0 to disable)
+  size_t warmupRounds = 1;
+
+  // Server processes sharing the port, more than 1 starts a supervisor
+  size_t workers = 1;
+
+  // paroli-server instances to synthesize sentences on (coordinator mode,
+  // disabled if empty)
+  std::vector<std::string> shardWorkers;
 };
 
 piper::PiperConfig piperConfig;
-piper::Voice voice;
+// Swapped as a whole by reloadVoices(), requests keep the voice they started
+// with
+std::atomic<std::shared_ptr<piper::Voice>> defaultVoice;
 std::string authToken;
+ResampleQuality resampleQuality = ResampleQuality::Medium;
+bool parallelOpusEncode = false;
+size_t wsHighWaterMark = 256 * 1024;
+size_t wsLowWaterMark = 64 * 1024;
+size_t wsMaxConcurrentRequests = 2;
+std::unique_ptr<ResponseCache> responseCache;
+bool responseCacheDeterministic = false;
+std::unique_ptr<piper::AudioStore> audioStore;
+std::unique_ptr<VoiceRegistry> voiceRegistry;
+// Set once the default voice is warmed up, reported by /readyz
+std::atomic<bool> serverReady{false};
+// reloadVoiceFiles() with the command line's settings, false if a reload is
+// running already
+std::function<bool()> reloadVoices;
+// Prefork mode only, the metrics of all workers
+std::unique_ptr<SharedMetrics> sharedMetrics;
+size_t workerIndex = 0;
+std::unique_ptr<ShardCluster> shardCluster;
 
 void parseArgs(int argc, char *argv[], RunConfig &runConfig);
+void configureVoice(const RunConfig &runConfig, piper::Voice &voice);
+void prewarmAudioStore(piper::Voice &voice, const filesystem::path &path);
+bool reloadVoiceFiles(const RunConfig &runConfig);
+void waitForReloadSignals();
 // ----------------------------------------------------------------------------
 
 int main(int argc, char *argv[]) {
-  spdlog::set_default_logger(spdlog::stderr_color_st("paroli"));
+  spdlog::set_default_logger(spdlog::stderr_color_mt("paroli"));
 
   RunConfig runConfig;
   parseArgs(argc, argv, runConfig);
@@ -105,19 +206,42 @@ int main(int argc, char *argv[]) {
 #ifdef _WIN32
   // Required on Windows to show IPA symbols
   SetConsoleOutputCP(CP_UTF8);
+#else
+  // Workers load everything themselves, forking must happen before any
+  // thread starts
+  if (runConfig.workers > 1) {
+    sharedMetrics = std::make_unique<SharedMetrics>(runConfig.workers);
+    workerIndex = runPrefork(runConfig.workers, *sharedMetrics);
+    spdlog::set_default_logger(
+        spdlog::stderr_color_mt(fmt::format("paroli-{}", workerIndex)));
+  }
+
+  // Blocked before any thread starts so they all inherit it, see
+  // waitForReloadSignals
+  sigset_t reloadSignals;
+  sigemptyset(&reloadSignals);
+  sigaddset(&reloadSignals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &reloadSignals, nullptr);
 #endif
 
   spdlog::debug("Voice config: {}", runConfig.modelConfigPath.string());
   spdlog::debug("Encoder model: {}", runConfig.encoderPath.string());
   spdlog::debug("Decoder model: {}", runConfig.decoderPath.string());
 
+  if (runConfig.modelCachePath) {
+    piperConfig.optimizedModelCachePath = runConfig.modelCachePath->string();
+  }
+
   auto startTime = chrono::steady_clock::now();
-  loadVoice(piperConfig, "", runConfig.encoderPath.string(), runConfig.decoderPath.string(),
-            runConfig.modelConfigPath.string(), voice, runConfig.speakerId,
-            runConfig.accelerator);
-  auto endTime = chrono::steady_clock::now();
-  spdlog::info("Loaded voice in {} second(s)",
-               chrono::duration<double>(endTime - startTime).count());
+  auto voice = std::make_shared<piper::Voice>();
+  loadVoiceConfig(runConfig.modelConfigPath.string(), *voice,
+                  runConfig.speakerId);
+  // The models load while eSpeak and libtashkeel are initialized
+  auto modelsLoaded = std::async(std::launch::async, [&]() {
+    loadVoiceModels(piperConfig, runConfig.encoderPath.string(),
+                    runConfig.decoderPath.string(), *voice,
+                    runConfig.accelerator);
+  });
 
   // Get the path to the piper executable so we can locate espeak-ng-data, etc.
   // next to it.
@@ -140,9 +264,11 @@ int main(int argc, char *argv[]) {
 #endif
 #endif
 
-  if (voice.phonemizeConfig.phonemeType == piper::eSpeakPhonemes) {
+  // Voices of the directory aren't loaded yet, have eSpeak ready for them
+  if (voice->phonemizeConfig.phonemeType == piper::eSpeakPhonemes ||
+      runConfig.voicesPath) {
     spdlog::debug("Voice uses eSpeak phonemes ({})",
-                  voice.phonemizeConfig.eSpeak.voice);
+                  voice->phonemizeConfig.eSpeak.voice);
 
     if (runConfig.eSpeakDataPath) {
       // User provided path
@@ -184,9 +310,123 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  if (runConfig.tashkeelCacheSize) {
+    piperConfig.tashkeelCacheSize = runConfig.tashkeelCacheSize.value();
+  }
+
   piper::initialize(piperConfig);
 
-  // Scales
+  modelsLoaded.get();
+  auto endTime = chrono::steady_clock::now();
+  spdlog::info("Loaded voice in {} second(s)",
+               chrono::duration<double>(endTime - startTime).count());
+  if (auto usage = piper::processMemoryUsage()) {
+    // Models mapped by other processes as well show up as shared
+    spdlog::info("Resident memory: {} MiB private, {} MiB shared",
+                 usage->privateBytes / (1024 * 1024),
+                 usage->sharedBytes / (1024 * 1024));
+  }
+  configureVoice(runConfig, *voice);
+
+  // Voices of the directory warm up as part of loading, on first use
+  piperConfig.warmupRounds = runConfig.warmupRounds;
+
+  if (runConfig.voicesPath) {
+    voiceRegistry = std::make_unique<VoiceRegistry>(
+        runConfig.voicesPath.value(), runConfig.voiceMemory * 1024 * 1024,
+        [runConfig](const VoiceRegistry::Files &files, piper::Voice &voice) {
+          // The default speaker of --speaker is for the default voice only
+          optional<piper::SpeakerId> speakerId;
+          loadVoice(piperConfig, "", files.encoder.string(),
+                    files.decoder.string(), files.config.string(), voice,
+                    speakerId, runConfig.accelerator);
+          configureVoice(runConfig, voice);
+        });
+  }
+
+  char* authTokenEnv = getenv("PAROLI_TOKEN");
+  if(authTokenEnv) {
+      authToken = authTokenEnv;
+      spdlog::info("Using authentication token from environment variable PAROLI_TOKEN");
+  }
+  else if(!runConfig.authToken.empty()) {
+      spdlog::info("Authentication token: {}", runConfig.authToken);
+      authToken = runConfig.authToken;
+  }
+
+  resampleQuality = runConfig.resampleQuality;
+  parallelOpusEncode = runConfig.parallelOpusEncode;
+  wsHighWaterMark = runConfig.wsHighWaterMark;
+  wsLowWaterMark = std::min(runConfig.wsLowWaterMark, runConfig.wsHighWaterMark);
+  wsMaxConcurrentRequests = std::max<size_t>(runConfig.wsMaxConcurrentRequests, 1);
+  if(runConfig.responseCacheSize > 0) {
+      responseCache = std::make_unique<ResponseCache>(runConfig.responseCacheSize * 1024 * 1024);
+      responseCacheDeterministic = runConfig.responseCacheDeterministic;
+      spdlog::info("Response cache enabled, {} MiB", runConfig.responseCacheSize);
+  }
+
+  if (runConfig.audioStorePath) {
+    audioStore = std::make_unique<piper::AudioStore>(
+        runConfig.audioStorePath.value(), runConfig.audioStoreSize * 1024 * 1024);
+    // The store is shared, one worker fills it
+    if (runConfig.prewarmPath && workerIndex == 0) {
+      prewarmAudioStore(*voice, runConfig.prewarmPath.value());
+    }
+  } else if (runConfig.prewarmPath) {
+    spdlog::warn("--prewarm has no effect without --audio_store");
+  }
+
+  if(!runConfig.disableWebUI)
+      app().setDocumentRoot("../paroli-server/web-content");
+
+  defaultVoice = voice;
+  reloadVoices = [&runConfig]() { return reloadVoiceFiles(runConfig); };
+#ifndef _WIN32
+  std::thread(waitForReloadSignals).detach();
+#endif
+
+  // Health probes are answered while the default voice warms up, /readyz
+  // turns ready after
+  std::thread warmupThread([&runConfig, voice]() {
+    try {
+      piper::warmupVoice(*voice, runConfig.warmupRounds);
+    } catch (const std::exception &e) {
+      // Requests still work, only slower at first
+      spdlog::warn("Warmup failed: {}", e.what());
+    }
+    serverReady = true;
+  });
+
+  if (!runConfig.shardWorkers.empty()) {
+    shardCluster = std::make_unique<ShardCluster>(runConfig.shardWorkers, authToken,
+        []() { return defaultVoice.load()->configDigest; });
+  }
+
+  // SO_REUSEPORT, the kernel spreads connections over the workers
+  if (sharedMetrics) {
+    app().enableReusePort();
+  }
+
+  app().addListener(runConfig.ip, runConfig.port)
+      .setThreadNum(3)
+      .run();
+  warmupThread.join();
+
+  piper::terminate(piperConfig);
+
+  return EXIT_SUCCESS;
+}
+
+// ----------------------------------------------------------------------------
+
+// Apply the command line's synthesis settings to a loaded voice
+void configureVoice(const RunConfig &runConfig, piper::Voice &voice) {
+  if (runConfig.sentenceCacheSize > 0) {
+    voice.sentenceCache = std::make_unique<piper::SentenceCache>(
+        runConfig.sentenceCacheSize * 1024 * 1024,
+        runConfig.timeStretchTolerance);
+  }
+
   if (runConfig.noiseScale) {
     voice.synthesisConfig.noiseScale = runConfig.noiseScale.value();
   }
@@ -199,6 +439,11 @@ int main(int argc, char *argv[]) {
     voice.synthesisConfig.noiseW = runConfig.noiseW.value();
   }
 
+  if (runConfig.seed) {
+    piper::checkSeed(voice, runConfig.seed);
+    voice.synthesisConfig.seed = runConfig.seed;
+  }
+
   if (runConfig.sentenceSilenceSeconds) {
     voice.synthesisConfig.sentenceSilenceSeconds =
         runConfig.sentenceSilenceSeconds.value();
@@ -219,30 +464,103 @@ int main(int argc, char *argv[]) {
     }
 
   } // if phonemeSilenceSeconds
+} /* configureVoice */
+
+// Loads the default voice and the loaded voices of the directory from their
+// files again, warmed up before they are swapped in. New requests get the new
+// voices, requests in flight finish on the old ones, which are freed after.
+bool reloadVoiceFiles(const RunConfig &runConfig) {
+  static std::mutex reloadMutex;
+  std::unique_lock<std::mutex> lock(reloadMutex, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    return false;
+  }
 
-  char* authTokenEnv = getenv("PAROLI_TOKEN");
-  if(authTokenEnv) {
-      authToken = authTokenEnv;
-      spdlog::info("Using authentication token from environment variable PAROLI_TOKEN");
+  spdlog::info("Reloading voices");
+  auto startTime = chrono::steady_clock::now();
+  auto voice = std::make_shared<piper::Voice>();
+  optional<piper::SpeakerId> speakerId = runConfig.speakerId;
+  loadVoice(piperConfig, "", runConfig.encoderPath.string(),
+            runConfig.decoderPath.string(), runConfig.modelConfigPath.string(),
+            *voice, speakerId, runConfig.accelerator);
+  if (voice->phonemizeConfig.phonemeType == piper::eSpeakPhonemes &&
+      !piperConfig.useESpeak) {
+    throw runtime_error("The new voice uses eSpeak phonemes, restart the "
+                        "server to enable eSpeak");
   }
-  else if(!runConfig.authToken.empty()) {
-      spdlog::info("Authentication token: {}", runConfig.authToken);
-      authToken = runConfig.authToken;
+  configureVoice(runConfig, *voice);
+  defaultVoice = std::move(voice);
+
+  if (voiceRegistry) {
+    voiceRegistry->reload();
   }
 
-  if(!runConfig.disableWebUI)
-      app().setDocumentRoot("../paroli-server/web-content");
+  auto endTime = chrono::steady_clock::now();
+  spdlog::info("Reloaded voices in {} second(s)",
+               chrono::duration<double>(endTime - startTime).count());
+  return true;
+} /* reloadVoiceFiles */
+
+#ifndef _WIN32
+// SIGHUP reloads the voices. The signal is blocked in every thread and taken
+// here, so reloading isn't limited to what is safe in a signal handler.
+void waitForReloadSignals() {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGHUP);
+  int received;
+  while (sigwait(&signals, &received) == 0) {
+    try {
+      if (!reloadVoices()) {
+        spdlog::warn("Ignoring SIGHUP, voices are being reloaded already");
+      }
+    } catch (const std::exception &e) {
+      spdlog::error("Reloading voices failed, keeping the old ones: {}",
+                    e.what());
+    }
+  }
+}
+#endif
 
-  app().addListener(runConfig.ip, runConfig.port)
-      .setThreadNum(3)
-      .run();
+// Synthesize every line of the file into the audio store, unless it is
+// there already
+void prewarmAudioStore(piper::Voice &voice, const filesystem::path &path) {
+  ifstream prewarmFile(path);
+  if (!prewarmFile.good()) {
+    throw runtime_error("Cannot open prewarm file: " + path.string());
+  }
 
-  piper::terminate(piperConfig);
+  auto startTime = chrono::steady_clock::now();
+  size_t synthesized = 0, skipped = 0;
+  std::string line, text;
+  std::vector<int16_t> audio, audioBuffer;
+  while (getline(prewarmFile, line)) {
+    voice.textNormalizer.normalize(line, text);
+    if (text.empty()) {
+      continue;
+    }
 
-  return EXIT_SUCCESS;
-}
+    auto key = piper::audioStoreKey(voice, text);
+    if (audioStore->getAudio(key, audio)) {
+      skipped++;
+      continue;
+    }
 
-// ----------------------------------------------------------------------------
+    audio.clear();
+    piper::SynthesisResult result;
+    piper::textToAudio(piperConfig, voice, text, audioBuffer, result, [&]() {
+      audio.insert(audio.end(), audioBuffer.begin(), audioBuffer.end());
+    });
+    audioStore->putAudio(key, audio);
+    synthesized++;
+  }
+
+  auto endTime = chrono::steady_clock::now();
+  spdlog::info("Prewarmed audio store in {} second(s): {} synthesized, {} "
+               "already stored",
+               chrono::duration<double>(endTime - startTime).count(),
+               synthesized, skipped);
+}
 
 void printUsage(char *argv[]) {
   cerr << endl;
@@ -257,6 +575,56 @@ void printUsage(char *argv[]) {
   cerr << "   --auth    [STR] authentication token (default: disabled)" << endl;
   cerr << "                   if not provided, a random token will be generated" << endl;
   cerr << "   --disable-web-ui              disable web UI" << endl;
+  cerr << "   --resample_quality      STR   quality of resampling for opus "
+          "(default: medium, valid: polyphase, quick, low, medium, high, veryhigh)"
+       << endl;
+  cerr << "                                 polyphase is a built-in filter for "
+          "16000 and 22050 Hz voices, flat to 85% of their Nyquist frequency"
+       << endl;
+  cerr << "   --parallel_opus               encode opus per sentence in parallel, "
+          "responses become chained ogg streams"
+       << endl;
+  cerr << "   --ws_high_water         NUM   unacknowledged bytes at which flow "
+          "controlled websocket streams pause (default: 262144)"
+       << endl;
+  cerr << "   --ws_low_water          NUM   unacknowledged bytes at which they "
+          "resume (default: 65536)"
+       << endl;
+  cerr << "   --ws_max_concurrent     NUM   requests synthesized at once per "
+          "websocket connection (default: 2)"
+       << endl;
+  cerr << "   --response_cache_size   NUM   MiB of memory to cache http "
+          "responses in (default: 0, disabled)"
+       << endl;
+  cerr << "   --response_cache_deterministic  only cache responses without "
+          "random noise"
+       << endl;
+  cerr << "   --audio_store           DIR   keep synthesized audio in this "
+          "directory, shared between processes (default: disabled)"
+       << endl;
+  cerr << "   --audio_store_size      NUM   MiB of disk for the audio store "
+          "(default: 1024)"
+       << endl;
+  cerr << "   --prewarm               FILE  synthesize each line of FILE into "
+          "the audio store at startup"
+       << endl;
+  cerr << "   --voices                DIR   directory with a sub directory of "
+          "encoder, decoder and config.json per voice, selected by the "
+          "request's voice field (default: disabled)"
+       << endl;
+  cerr << "   --voice_memory          NUM   MiB of memory for loaded voices of "
+          "the directory, least recently used idle ones are unloaded "
+          "(default: 0, no limit)"
+       << endl;
+  cerr << "   --warmup                NUM   rounds of warmup inference per "
+          "voice, /readyz reports ready after (default: 1, 0 disables)"
+       << endl;
+  cerr << "   --workers               NUM   server processes sharing the port, "
+          "crashed ones are restarted (default: 1)"
+       << endl;
+  cerr << "   --shard_workers         URLS  comma separated paroli-server URLs "
+          "to synthesize the sentences of long texts on (default: disabled)"
+       << endl;
   cerr << "   -c  FILE  --config      FILE  path to model config file "
           "(default: model path + .json)"
        << endl;
@@ -273,6 +641,10 @@ void printUsage(char *argv[]) {
        << endl;
   cerr << "   --noise_w               NUM   phoneme width noise (default: 0.8)"
        << endl;
+  cerr << "   --seed                  NUM   seed for the noise, same seed gives "
+          "the same audio, needs an encoder with dp_noise and z_noise inputs "
+          "(default: random)"
+       << endl;
   cerr << "   --sentence_silence      NUM   seconds of silence after each "
           "sentence (default: 0.2)"
        << endl;
@@ -281,9 +653,22 @@ void printUsage(char *argv[]) {
   cerr << "   --tashkeel_model        FILE  path to libtashkeel onnx model "
           "(arabic)"
        << endl;
+  cerr << "   --tashkeel_cache_size   NUM   number of diacritized sentences to "
+          "cache (default: 1024)"
+       << endl;
+  cerr << "   --sentence_cache_size   NUM   MiB of memory to cache synthesized "
+          "sentences in (default: 0, disabled)"
+       << endl;
+  cerr << "   --time_stretch_tolerance NUM  time-stretch cached sentences "
+          "whose length scale differs by at most this fraction (default: 0, "
+          "disabled)"
+       << endl;
   cerr << "   --accelerator           STR   accelerator to use for ONNX "
           "(default: none, valid: cuda)"
        << endl;
+  cerr << "   --model_cache           DIR   keep optimized models in this "
+          "directory, later starts skip optimizing (default: disabled)"
+       << endl;
   cerr << "   --debug                       print DEBUG messages to the console"
        << endl;
   cerr << "   -q       --quiet              disable logging" << endl;
@@ -326,6 +711,9 @@ void parseArgs(int argc, char *argv[], RunConfig &runConfig) {
     } else if (arg == "--noise_w" || arg == "--noise-w") {
       ensureArg(argc, argv, i);
       runConfig.noiseW = stof(argv[++i]);
+    } else if (arg == "--seed") {
+      ensureArg(argc, argv, i);
+      runConfig.seed = stoull(argv[++i]);
     } else if (arg == "--sentence_silence" || arg == "--sentence-silence") {
       ensureArg(argc, argv, i);
       runConfig.sentenceSilenceSeconds = stof(argv[++i]);
@@ -352,8 +740,23 @@ void parseArgs(int argc, char *argv[], RunConfig &runConfig) {
     } else if (arg == "--tashkeel_model" || arg == "--tashkeel-model") {
       ensureArg(argc, argv, i);
       runConfig.tashkeelModelPath = filesystem::path(argv[++i]);
+    } else if (arg == "--tashkeel_cache_size" ||
+               arg == "--tashkeel-cache-size") {
+      ensureArg(argc, argv, i);
+      runConfig.tashkeelCacheSize = stoul(argv[++i]);
+    } else if (arg == "--sentence_cache_size" ||
+               arg == "--sentence-cache-size") {
+      ensureArg(argc, argv, i);
+      runConfig.sentenceCacheSize = stoul(argv[++i]);
+    } else if (arg == "--time_stretch_tolerance" ||
+               arg == "--time-stretch-tolerance") {
+      ensureArg(argc, argv, i);
+      runConfig.timeStretchTolerance = stof(argv[++i]);
     } else if (arg == "--accelerator") {
       runConfig.accelerator = argv[++i];
+    } else if (arg == "--model_cache" || arg == "--model-cache") {
+      ensureArg(argc, argv, i);
+      runConfig.modelCachePath = filesystem::path(argv[++i]);
     } else if (arg == "--version") {
       std::cout << piper::getVersion() << std::endl;
       exit(0);
@@ -379,6 +782,56 @@ void parseArgs(int argc, char *argv[], RunConfig &runConfig) {
             runConfig.authToken = argv[++i];
     } else if (arg == "--disable-web-ui") {
         runConfig.disableWebUI = true;
+    } else if (arg == "--resample_quality" || arg == "--resample-quality") {
+      ensureArg(argc, argv, i);
+      runConfig.resampleQuality = parseResampleQuality(argv[++i]);
+    } else if (arg == "--parallel_opus" || arg == "--parallel-opus") {
+      runConfig.parallelOpusEncode = true;
+    } else if (arg == "--ws_high_water" || arg == "--ws-high-water") {
+      ensureArg(argc, argv, i);
+      runConfig.wsHighWaterMark = stoul(argv[++i]);
+    } else if (arg == "--ws_low_water" || arg == "--ws-low-water") {
+      ensureArg(argc, argv, i);
+      runConfig.wsLowWaterMark = stoul(argv[++i]);
+    } else if (arg == "--ws_max_concurrent" || arg == "--ws-max-concurrent") {
+      ensureArg(argc, argv, i);
+      runConfig.wsMaxConcurrentRequests = stoul(argv[++i]);
+    } else if (arg == "--response_cache_size" || arg == "--response-cache-size") {
+      ensureArg(argc, argv, i);
+      runConfig.responseCacheSize = stoul(argv[++i]);
+    } else if (arg == "--response_cache_deterministic" ||
+               arg == "--response-cache-deterministic") {
+      runConfig.responseCacheDeterministic = true;
+    } else if (arg == "--audio_store" || arg == "--audio-store") {
+      ensureArg(argc, argv, i);
+      runConfig.audioStorePath = filesystem::path(argv[++i]);
+    } else if (arg == "--audio_store_size" || arg == "--audio-store-size") {
+      ensureArg(argc, argv, i);
+      runConfig.audioStoreSize = stoul(argv[++i]);
+    } else if (arg == "--prewarm") {
+      ensureArg(argc, argv, i);
+      runConfig.prewarmPath = filesystem::path(argv[++i]);
+    } else if (arg == "--voices") {
+      ensureArg(argc, argv, i);
+      runConfig.voicesPath = filesystem::path(argv[++i]);
+    } else if (arg == "--voice_memory" || arg == "--voice-memory") {
+      ensureArg(argc, argv, i);
+      runConfig.voiceMemory = stoul(argv[++i]);
+    } else if (arg == "--warmup") {
+      ensureArg(argc, argv, i);
+      runConfig.warmupRounds = stoul(argv[++i]);
+    } else if (arg == "--workers") {
+      ensureArg(argc, argv, i);
+      runConfig.workers = stoul(argv[++i]);
+    } else if (arg == "--shard_workers" || arg == "--shard-workers") {
+      ensureArg(argc, argv, i);
+      stringstream urls(argv[++i]);
+      string url;
+      while (getline(urls, url, ',')) {
+        if (!url.empty()) {
+          runConfig.shardWorkers.push_back(url);
+        }
+      }
     } else {
       cerr << "Unknown argument: " << arg << endl;
       printUsage(argv);
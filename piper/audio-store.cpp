@@ -0,0 +1,537 @@
+#include "audio-store.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+namespace piper {
+
+static constexpr uint32_t INDEX_MAGIC = 0x58444950; // "PIDX"
+static constexpr uint32_t RECORD_MAGIC = 0x43524150; // "PARC"
+static constexpr uint32_t INDEX_VERSION = 1;
+static constexpr uint64_t INITIAL_SLOTS = 4096;
+
+struct AudioStore::IndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  // Number of slots, a power of two
+  uint64_t capacity;
+  uint64_t count;
+  // Bumped whenever the data file is replaced
+  uint64_t generation;
+  // End of the last complete record in the data file
+  uint64_t dataBytes;
+  // Incremented on every access, orders records for compaction
+  uint64_t accessClock;
+};
+
+struct AudioStore::IndexSlot {
+  // 0 marks an empty slot
+  uint64_t hash;
+  uint64_t offset;
+  // Size of the whole record, header included
+  uint64_t size;
+  uint64_t lastAccess;
+};
+
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t keySize;
+  uint64_t valueSize;
+  uint64_t checksum;
+};
+
+// 64 bit FNV-1a
+static uint64_t hashBytes(std::string_view data,
+                          uint64_t hash = 0xcbf29ce484222325ull) {
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+static uint64_t keyHash(std::string_view key) {
+  uint64_t hash = hashBytes(key);
+  return hash == 0 ? 1 : hash;
+}
+
+static uint64_t recordChecksum(std::string_view key, std::string_view value) {
+  return hashBytes(value, hashBytes(key));
+}
+
+static uint16_t swapBytes(uint16_t value) {
+  return (uint16_t)((value >> 8) | (value << 8));
+}
+
+static void throwErrno(const std::string &what) {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+static bool readFull(int fd, void *buf, size_t size, uint64_t offset) {
+  auto *p = static_cast<char *>(buf);
+  while (size > 0) {
+    ssize_t n = pread(fd, p, size, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+static void writeFull(int fd, const void *buf, size_t size, uint64_t offset) {
+  auto *p = static_cast<const char *>(buf);
+  while (size > 0) {
+    ssize_t n = pwrite(fd, p, size, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      throwErrno("Failed to write audio store");
+    }
+    p += n;
+    size -= n;
+    offset += n;
+  }
+}
+
+AudioStore::AudioStore(const std::filesystem::path &directory,
+                       size_t capacityBytes)
+    : directory(directory), capacityBytes(capacityBytes) {
+  std::filesystem::create_directories(directory);
+
+  auto indexPath = directory / "audio.index";
+  indexFd = open(indexPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (indexFd < 0) {
+    throwErrno("Failed to open " + indexPath.string());
+  }
+
+  std::lock_guard<std::mutex> guard(mutex);
+  lock(LOCK_EX);
+  try {
+    struct stat st;
+    if (fstat(indexFd, &st) != 0) {
+      throwErrno("Failed to stat " + indexPath.string());
+    }
+
+    bool valid = (size_t)st.st_size >= sizeof(IndexHeader);
+    if (valid) {
+      IndexHeader h;
+      valid = readFull(indexFd, &h, sizeof(h), 0) && h.magic == INDEX_MAGIC &&
+              h.version == INDEX_VERSION && std::has_single_bit(h.capacity) &&
+              (size_t)st.st_size >= sizeof(IndexHeader) + h.capacity * sizeof(IndexSlot);
+    }
+
+    if (valid) {
+      mapIndex();
+      openDataFile();
+    } else {
+      if (st.st_size > 0) {
+        spdlog::warn("Audio store index {} is invalid, starting over",
+                     indexPath.string());
+      }
+      createIndex(INITIAL_SLOTS);
+      std::filesystem::remove(directory / "audio.data");
+      openDataFile();
+    }
+    dataGeneration = header()->generation;
+  } catch (...) {
+    unlock();
+    throw;
+  }
+  unlock();
+
+  spdlog::info("Opened audio store at {} ({} entries, {} bytes)",
+               directory.string(), header()->count, header()->dataBytes);
+} /* AudioStore */
+
+AudioStore::~AudioStore() {
+  if (indexMap) {
+    munmap(indexMap, indexMapSize);
+  }
+  if (dataFd >= 0) {
+    close(dataFd);
+  }
+  if (indexFd >= 0) {
+    close(indexFd);
+  }
+}
+
+void AudioStore::lock(int operation) {
+  while (flock(indexFd, operation) != 0) {
+    if (errno != EINTR) {
+      throwErrno("Failed to lock audio store");
+    }
+  }
+}
+
+void AudioStore::unlock() { flock(indexFd, LOCK_UN); }
+
+AudioStore::IndexHeader *AudioStore::header() {
+  return static_cast<IndexHeader *>(indexMap);
+}
+
+AudioStore::IndexSlot *AudioStore::slots() {
+  return reinterpret_cast<IndexSlot *>(static_cast<char *>(indexMap) +
+                                       sizeof(IndexHeader));
+}
+
+void AudioStore::mapIndex() {
+  if (indexMap) {
+    munmap(indexMap, indexMapSize);
+    indexMap = nullptr;
+  }
+
+  IndexHeader h;
+  if (!readFull(indexFd, &h, sizeof(h), 0)) {
+    throw std::runtime_error("Failed to read audio store index");
+  }
+  indexMapSize = sizeof(IndexHeader) + h.capacity * sizeof(IndexSlot);
+  indexMap = mmap(nullptr, indexMapSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  indexFd, 0);
+  if (indexMap == MAP_FAILED) {
+    indexMap = nullptr;
+    throwErrno("Failed to map audio store index");
+  }
+}
+
+void AudioStore::openDataFile() {
+  if (dataFd >= 0) {
+    close(dataFd);
+  }
+  auto dataPath = directory / "audio.data";
+  dataFd = open(dataPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (dataFd < 0) {
+    throwErrno("Failed to open " + dataPath.string());
+  }
+}
+
+void AudioStore::createIndex(uint64_t capacity) {
+  IndexHeader h{};
+  h.magic = INDEX_MAGIC;
+  h.version = INDEX_VERSION;
+  h.capacity = capacity;
+
+  // Write the header before growing the file, so the mapping covers it all
+  if (ftruncate(indexFd, 0) != 0 ||
+      ftruncate(indexFd, sizeof(IndexHeader) + capacity * sizeof(IndexSlot)) != 0) {
+    throwErrno("Failed to resize audio store index");
+  }
+  writeFull(indexFd, &h, sizeof(h), 0);
+  mapIndex();
+}
+
+void AudioStore::refresh() {
+  // Another process resized the index
+  if (header()->capacity * sizeof(IndexSlot) + sizeof(IndexHeader) !=
+      indexMapSize) {
+    mapIndex();
+  }
+
+  // Another process compacted the data file
+  if (header()->generation != dataGeneration) {
+    openDataFile();
+    dataGeneration = header()->generation;
+  }
+}
+
+AudioStore::IndexSlot *AudioStore::findSlot(uint64_t hash,
+                                            std::string_view key,
+                                            bool &found) {
+  const uint64_t mask = header()->capacity - 1;
+  for (uint64_t i = hash & mask;; i = (i + 1) & mask) {
+    IndexSlot &slot = slots()[i];
+    if (slot.hash == 0) {
+      found = false;
+      return &slot;
+    }
+    if (slot.hash == hash && readRecord(slot, key, nullptr)) {
+      found = true;
+      return &slot;
+    }
+  }
+}
+
+bool AudioStore::readRecord(const IndexSlot &slot, std::string_view key,
+                            std::string *value) {
+  RecordHeader record;
+  if (slot.size < sizeof(record) ||
+      slot.offset + slot.size > header()->dataBytes ||
+      !readFull(dataFd, &record, sizeof(record), slot.offset)) {
+    return false;
+  }
+  if (record.magic != RECORD_MAGIC || record.keySize != key.size() ||
+      sizeof(record) + record.keySize + record.valueSize != slot.size) {
+    return false;
+  }
+
+  std::string storedKey(record.keySize, '\0');
+  if (!readFull(dataFd, storedKey.data(), storedKey.size(),
+                slot.offset + sizeof(record)) ||
+      storedKey != key) {
+    return false;
+  }
+  if (!value) {
+    return true;
+  }
+
+  value->resize(record.valueSize);
+  if (!readFull(dataFd, value->data(), value->size(),
+                slot.offset + sizeof(record) + record.keySize)) {
+    return false;
+  }
+  if (recordChecksum(key, *value) != record.checksum) {
+    spdlog::warn("Audio store record at {} failed its checksum", slot.offset);
+    return false;
+  }
+  return true;
+}
+
+bool AudioStore::get(std::string_view key, std::string &out) {
+  std::lock_guard<std::mutex> guard(mutex);
+  lock(LOCK_SH);
+  bool found = false;
+  try {
+    refresh();
+    IndexSlot *slot = findSlot(keyHash(key), key, found);
+    found = found && readRecord(*slot, key, &out);
+    if (found) {
+      // Other readers may do the same, only the order matters
+      uint64_t now = std::atomic_ref<uint64_t>(header()->accessClock)
+                         .fetch_add(1, std::memory_order_relaxed);
+      std::atomic_ref<uint64_t>(slot->lastAccess)
+          .store(now, std::memory_order_relaxed);
+    }
+  } catch (...) {
+    unlock();
+    throw;
+  }
+  unlock();
+
+  (found ? hitCount : missCount).fetch_add(1, std::memory_order_relaxed);
+  return found;
+}
+
+void AudioStore::put(std::string_view key, std::string_view value) {
+  RecordHeader record;
+  record.magic = RECORD_MAGIC;
+  record.keySize = key.size();
+  record.valueSize = value.size();
+  record.checksum = recordChecksum(key, value);
+  const uint64_t size = sizeof(record) + key.size() + value.size();
+  if (size > capacityBytes / 2) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(mutex);
+  lock(LOCK_EX);
+  try {
+    refresh();
+    const uint64_t hash = keyHash(key);
+    bool found = false;
+    findSlot(hash, key, found);
+    if (!found) {
+      if (header()->dataBytes + size > capacityBytes) {
+        // Leave some room so not every insert compacts
+        compactLocked(capacityBytes * 3 / 4 - size);
+      }
+      if ((header()->count + 1) * 2 > header()->capacity) {
+        growIndex();
+      }
+
+      // Write the record before the index points to it. A crash in between
+      // leaves garbage past dataBytes, which the next put overwrites.
+      const uint64_t offset = header()->dataBytes;
+      std::vector<char> buffer(size);
+      memcpy(buffer.data(), &record, sizeof(record));
+      memcpy(buffer.data() + sizeof(record), key.data(), key.size());
+      memcpy(buffer.data() + sizeof(record) + key.size(), value.data(),
+             value.size());
+      writeFull(dataFd, buffer.data(), buffer.size(), offset);
+
+      insertSlot(hash, offset, size, header()->accessClock++);
+      header()->dataBytes = offset + size;
+    }
+  } catch (...) {
+    unlock();
+    throw;
+  }
+  unlock();
+}
+
+bool AudioStore::getAudio(std::string_view key, std::vector<int16_t> &audio) {
+  std::string bytes;
+  if (!get(key, bytes)) {
+    return false;
+  }
+  audio.resize(bytes.size() / sizeof(int16_t));
+  memcpy(audio.data(), bytes.data(), audio.size() * sizeof(int16_t));
+  if constexpr (std::endian::native == std::endian::big) {
+    for (auto &sample : audio) {
+      sample = (int16_t)swapBytes((uint16_t)sample);
+    }
+  }
+  return true;
+}
+
+void AudioStore::putAudio(std::string_view key,
+                          std::span<const int16_t> audio) {
+  std::string bytes(audio.size() * sizeof(int16_t), '\0');
+  memcpy(bytes.data(), audio.data(), bytes.size());
+  if constexpr (std::endian::native == std::endian::big) {
+    auto *samples = reinterpret_cast<uint16_t *>(bytes.data());
+    for (size_t i = 0; i < audio.size(); i++) {
+      samples[i] = swapBytes(samples[i]);
+    }
+  }
+  put(key, bytes);
+}
+
+void AudioStore::insertSlot(uint64_t hash, uint64_t offset, uint64_t size,
+                            uint64_t lastAccess) {
+  const uint64_t mask = header()->capacity - 1;
+  uint64_t i = hash & mask;
+  while (slots()[i].hash != 0) {
+    i = (i + 1) & mask;
+  }
+  slots()[i] = IndexSlot{hash, offset, size, lastAccess};
+  header()->count++;
+}
+
+void AudioStore::growIndex() {
+  std::vector<IndexSlot> entries;
+  entries.reserve(header()->count);
+  for (uint64_t i = 0; i < header()->capacity; i++) {
+    if (slots()[i].hash != 0) {
+      entries.push_back(slots()[i]);
+    }
+  }
+  IndexHeader old = *header();
+
+  createIndex(old.capacity * 2);
+  *header() = old;
+  header()->capacity *= 2;
+  header()->count = 0;
+  for (const auto &entry : entries) {
+    insertSlot(entry.hash, entry.offset, entry.size, entry.lastAccess);
+  }
+}
+
+void AudioStore::compact(size_t targetBytes) {
+  std::lock_guard<std::mutex> guard(mutex);
+  lock(LOCK_EX);
+  try {
+    refresh();
+    compactLocked(targetBytes);
+  } catch (...) {
+    unlock();
+    throw;
+  }
+  unlock();
+}
+
+void AudioStore::compactLocked(size_t targetBytes) {
+  std::vector<IndexSlot> entries;
+  entries.reserve(header()->count);
+  for (uint64_t i = 0; i < header()->capacity; i++) {
+    if (slots()[i].hash != 0) {
+      entries.push_back(slots()[i]);
+    }
+  }
+  // Most recently used first
+  std::sort(entries.begin(), entries.end(),
+            [](const IndexSlot &a, const IndexSlot &b) {
+              return a.lastAccess > b.lastAccess;
+            });
+
+  auto tmpPath = directory / "audio.data.tmp";
+  int tmpFd = open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (tmpFd < 0) {
+    throwErrno("Failed to open " + tmpPath.string());
+  }
+
+  std::vector<IndexSlot> kept;
+  uint64_t offset = 0;
+  std::vector<char> buffer;
+  try {
+    for (const auto &entry : entries) {
+      if (offset + entry.size > targetBytes) {
+        break;
+      }
+      buffer.resize(entry.size);
+      if (!readFull(dataFd, buffer.data(), buffer.size(), entry.offset)) {
+        continue;
+      }
+      // Drop records that no longer check out
+      RecordHeader record;
+      memcpy(&record, buffer.data(), sizeof(record));
+      if (record.magic != RECORD_MAGIC ||
+          sizeof(record) + record.keySize + record.valueSize != entry.size) {
+        continue;
+      }
+      std::string_view key(buffer.data() + sizeof(record), record.keySize);
+      std::string_view value(key.data() + key.size(), record.valueSize);
+      if (recordChecksum(key, value) != record.checksum) {
+        continue;
+      }
+
+      writeFull(tmpFd, buffer.data(), buffer.size(), offset);
+      kept.push_back(IndexSlot{entry.hash, offset, entry.size, entry.lastAccess});
+      offset += entry.size;
+    }
+    if (fsync(tmpFd) != 0) {
+      throwErrno("Failed to sync " + tmpPath.string());
+    }
+  } catch (...) {
+    close(tmpFd);
+    throw;
+  }
+  close(tmpFd);
+
+  std::filesystem::rename(tmpPath, directory / "audio.data");
+  openDataFile();
+
+  memset(static_cast<void *>(slots()), 0, header()->capacity * sizeof(IndexSlot));
+  header()->count = 0;
+  for (const auto &entry : kept) {
+    insertSlot(entry.hash, entry.offset, entry.size, entry.lastAccess);
+  }
+  header()->dataBytes = offset;
+  header()->generation++;
+  dataGeneration = header()->generation;
+
+  spdlog::debug("Compacted audio store from {} to {} entries ({} bytes)",
+                entries.size(), kept.size(), offset);
+} /* compactLocked */
+
+AudioStoreStats AudioStore::stats() {
+  AudioStoreStats res;
+  res.hits = hitCount.load(std::memory_order_relaxed);
+  res.misses = missCount.load(std::memory_order_relaxed);
+  res.capacityBytes = capacityBytes;
+
+  std::lock_guard<std::mutex> guard(mutex);
+  lock(LOCK_SH);
+  res.entries = header()->count;
+  res.dataBytes = header()->dataBytes;
+  unlock();
+  return res;
+}
+
+} // namespace piper
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace piper {
+
+struct AudioStoreStats {
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t entries = 0;
+  size_t dataBytes = 0;
+  size_t capacityBytes = 0;
+};
+
+// Persistent key/value store for synthesized audio, shared by all processes
+// on the host that open the same directory. Records are appended to a data
+// file, with key and checksum so corrupt or mismatching records are never
+// returned. A memory mapped open addressing table indexes them by key hash.
+//
+// Readers hold a shared flock on the index, writers an exclusive one. Once the
+// data file outgrows the size limit, it is compacted down to the most
+// recently used records and the generation counter in the index header is
+// bumped, telling other processes to reopen the data file.
+class AudioStore {
+public:
+  AudioStore(const std::filesystem::path &directory, size_t capacityBytes);
+  ~AudioStore();
+  AudioStore(const AudioStore &) = delete;
+  AudioStore &operator=(const AudioStore &) = delete;
+
+  // Copy the value of key to out. False if it is not stored or is corrupt.
+  bool get(std::string_view key, std::string &out);
+
+  // Store value under key, unless it is already there
+  void put(std::string_view key, std::string_view value);
+
+  // 16 bit PCM samples, stored little endian
+  bool getAudio(std::string_view key, std::vector<int16_t> &audio);
+  void putAudio(std::string_view key, std::span<const int16_t> audio);
+
+  // Rewrite the data file keeping the most recently used records that fit
+  // into targetBytes
+  void compact(size_t targetBytes);
+
+  AudioStoreStats stats();
+
+private:
+  struct IndexHeader;
+  struct IndexSlot;
+
+  void lock(int operation);
+  void unlock();
+  // Pick up changes other processes made to the index size or data file.
+  // Must hold the lock.
+  void refresh();
+  void mapIndex();
+  void openDataFile();
+  void createIndex(uint64_t capacity);
+  IndexHeader *header();
+  IndexSlot *slots();
+  // Slot holding key, or the empty slot it would go into
+  IndexSlot *findSlot(uint64_t hash, std::string_view key, bool &found);
+  bool readRecord(const IndexSlot &slot, std::string_view key,
+                  std::string *value);
+  void insertSlot(uint64_t hash, uint64_t offset, uint64_t size,
+                  uint64_t lastAccess);
+  void growIndex();
+  void compactLocked(size_t targetBytes);
+
+  std::filesystem::path directory;
+  size_t capacityBytes;
+
+  // Serializes threads of this process, flock only works between processes
+  std::mutex mutex;
+  int indexFd = -1;
+  int dataFd = -1;
+  void *indexMap = nullptr;
+  size_t indexMapSize = 0;
+  uint64_t dataGeneration = 0;
+
+  std::atomic<size_t> hitCount{0};
+  std::atomic<size_t> missCount{0};
+};
+
+} // namespace piper
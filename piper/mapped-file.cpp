@@ -0,0 +1,83 @@
+#include "mapped-file.hpp"
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace piper {
+
+MappedFile::MappedFile(const std::filesystem::path &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Cannot open " + path.string());
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int error = errno;
+    close(fd);
+    throw std::system_error(error, std::generic_category(),
+                            "Cannot stat " + path.string());
+  }
+  length = st.st_size;
+
+  if (length > 0) {
+    map = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  int error = errno;
+  // The mapping keeps the file alive
+  close(fd);
+  if (map == MAP_FAILED) {
+    map = nullptr;
+    throw std::system_error(error, std::generic_category(),
+                            "Cannot map " + path.string());
+  }
+
+  if (map) {
+    // Models are read front to back while loading
+    madvise(map, length, MADV_WILLNEED);
+  }
+} /* MappedFile */
+
+MappedFile::~MappedFile() {
+  if (map) {
+    munmap(map, length);
+  }
+}
+
+std::optional<MemoryUsage> processMemoryUsage() {
+  std::ifstream smaps("/proc/self/smaps_rollup");
+  if (!smaps.good()) {
+    return std::nullopt;
+  }
+
+  // Lines like "Private_Dirty:      1234 kB"
+  std::map<std::string, size_t> fields;
+  std::string line;
+  while (std::getline(smaps, line)) {
+    auto colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    try {
+      fields[line.substr(0, colon)] = std::stoull(line.substr(colon + 1)) * 1024;
+    } catch (const std::exception &) {
+      // Not a size
+    }
+  }
+
+  MemoryUsage usage;
+  usage.rssBytes = fields["Rss"];
+  usage.privateBytes = fields["Private_Clean"] + fields["Private_Dirty"];
+  usage.sharedBytes = fields["Shared_Clean"] + fields["Shared_Dirty"];
+  return usage;
+} /* processMemoryUsage */
+
+} // namespace piper
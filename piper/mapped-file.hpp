@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+
+namespace piper {
+
+// Read-only, shared memory mapping of a whole file. Processes mapping the same
+// file share its pages through the page cache instead of each holding a
+// private copy.
+class MappedFile {
+public:
+  explicit MappedFile(const std::filesystem::path &path);
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const uint8_t *data() const { return static_cast<const uint8_t *>(map); }
+  size_t size() const { return length; }
+  std::span<const uint8_t> bytes() const { return {data(), size()}; }
+
+private:
+  void *map = nullptr;
+  size_t length = 0;
+};
+
+struct MemoryUsage {
+  size_t rssBytes = 0;
+  // Pages only this process maps, heap and copied weights mostly
+  size_t privateBytes = 0;
+  // Pages other processes map too, such as models mapped by all of them
+  size_t sharedBytes = 0;
+};
+
+// Resident memory of this process from /proc/self/smaps_rollup, not available
+// on every platform
+std::optional<MemoryUsage> processMemoryUsage();
+
+} // namespace piper
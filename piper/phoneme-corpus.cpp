@@ -0,0 +1,220 @@
+#include "phoneme-corpus.hpp"
+
+#include <bit>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <spdlog/spdlog.h>
+
+namespace piper {
+
+static constexpr uint32_t CORPUS_MAGIC = 0x43485050; // "PPHC"
+static constexpr uint32_t CORPUS_VERSION = 1;
+
+struct CorpusHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t numSymbols;
+  uint64_t entryCount;
+  uint64_t sentenceCount;
+  uint64_t phraseCount;
+  // End of the ID runs, the indexes follow
+  uint64_t tablesOffset;
+};
+
+struct CorpusPhrase {
+  // Of the phrase's ID run, from the start of the file
+  uint64_t runOffset;
+  float silenceSeconds;
+  uint32_t reserved;
+};
+static_assert(sizeof(CorpusPhrase) == 16);
+
+// Records are copied out, the mapping makes no alignment promises to the
+// compiler
+template <typename T> static T load(const uint8_t *data) {
+  T value;
+  memcpy(&value, data, sizeof(T));
+  return value;
+}
+
+static void checkByteOrder() {
+  if constexpr (std::endian::native != std::endian::little) {
+    throw std::runtime_error("Phoneme corpora need a little endian host");
+  }
+}
+
+PhonemeCorpusWriter::PhonemeCorpusWriter(const std::filesystem::path &path,
+                                         size_t numSymbols)
+    : path(path), tempPath(path.string() + ".tmp"), numSymbols(numSymbols) {
+  checkByteOrder();
+  file.open(tempPath, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Cannot create " + tempPath.string());
+  }
+
+  // Filled in by finish
+  CorpusHeader header{};
+  write(&header, sizeof(header));
+} /* PhonemeCorpusWriter */
+
+PhonemeCorpusWriter::~PhonemeCorpusWriter() {
+  if (!finished) {
+    file.close();
+    std::error_code ec;
+    std::filesystem::remove(tempPath, ec);
+  }
+}
+
+void PhonemeCorpusWriter::write(const void *data, size_t size) {
+  file.write(static_cast<const char *>(data), size);
+  if (!file) {
+    throw std::runtime_error("Failed to write " + tempPath.string());
+  }
+  offset += size;
+}
+
+void PhonemeCorpusWriter::add(const PhonemeData &phonemeData) {
+  for (const auto &sentence : phonemeData.sentences) {
+    for (const auto &phrase : sentence.phrases) {
+      phraseOffsets.push_back(offset);
+      phraseSilences.push_back(phrase.silenceSeconds);
+      const int64_t count = phrase.phonemeIds.size();
+      write(&count, sizeof(count));
+      static_assert(sizeof(PhonemeId) == sizeof(int64_t));
+      write(phrase.phonemeIds.data(), sizeof(PhonemeId) * count);
+    }
+    sentenceIndex.push_back(phraseOffsets.size());
+  }
+  entryIndex.push_back(sentenceIndex.size() - 1);
+} /* add */
+
+void PhonemeCorpusWriter::finish() {
+  CorpusHeader header{};
+  header.magic = CORPUS_MAGIC;
+  header.version = CORPUS_VERSION;
+  header.numSymbols = numSymbols;
+  header.entryCount = size();
+  header.sentenceCount = sentenceIndex.size() - 1;
+  header.phraseCount = phraseOffsets.size();
+  header.tablesOffset = offset;
+
+  write(entryIndex.data(), sizeof(uint64_t) * entryIndex.size());
+  write(sentenceIndex.data(), sizeof(uint64_t) * sentenceIndex.size());
+  for (size_t i = 0; i < phraseOffsets.size(); i++) {
+    CorpusPhrase phrase{phraseOffsets[i], phraseSilences[i], 0};
+    write(&phrase, sizeof(phrase));
+  }
+
+  file.seekp(0);
+  write(&header, sizeof(header));
+  file.close();
+  if (!file) {
+    throw std::runtime_error("Failed to write " + tempPath.string());
+  }
+
+  std::filesystem::rename(tempPath, path);
+  finished = true;
+} /* finish */
+
+PhonemeCorpus::PhonemeCorpus(const std::filesystem::path &path) : file(path) {
+  checkByteOrder();
+  const auto corrupt = [&]() {
+    return std::runtime_error(path.string() + " is not a phoneme corpus");
+  };
+
+  if (file.size() < sizeof(CorpusHeader)) {
+    throw corrupt();
+  }
+  auto header = load<CorpusHeader>(file.data());
+  if (header.magic != CORPUS_MAGIC || header.version != CORPUS_VERSION) {
+    throw corrupt();
+  }
+
+  // Counts are bounded by the file size before multiplying, so the sum
+  // cannot overflow
+  const uint64_t words = file.size() / sizeof(uint64_t);
+  if (header.tablesOffset < sizeof(CorpusHeader) ||
+      header.tablesOffset > file.size() || header.entryCount >= words ||
+      header.sentenceCount >= words || header.phraseCount >= words) {
+    throw corrupt();
+  }
+  const uint64_t tablesSize =
+      sizeof(uint64_t) * (header.entryCount + 1) +
+      sizeof(uint64_t) * (header.sentenceCount + 1) +
+      sizeof(CorpusPhrase) * header.phraseCount;
+  if (header.tablesOffset + tablesSize != file.size()) {
+    throw corrupt();
+  }
+
+  symbolCount = header.numSymbols;
+  entryCount = header.entryCount;
+  sentenceCount = header.sentenceCount;
+  phraseCount = header.phraseCount;
+  tablesOffset = header.tablesOffset;
+  spdlog::debug("Phoneme corpus {} has {} entries, {} sentence(s)",
+                path.string(), entryCount, sentenceCount);
+} /* PhonemeCorpus */
+
+PhonemeData PhonemeCorpus::entry(size_t index) const {
+  if (index >= entryCount) {
+    throw std::out_of_range("Phoneme corpus entry out of range");
+  }
+  const auto corrupt = [&]() {
+    return std::runtime_error(
+        fmt::format("Phoneme corpus entry {} is corrupt", index));
+  };
+
+  const uint8_t *entries = file.data() + tablesOffset;
+  const uint8_t *sentences = entries + sizeof(uint64_t) * (entryCount + 1);
+  const uint8_t *phrases = sentences + sizeof(uint64_t) * (sentenceCount + 1);
+
+  const auto firstSentence =
+      load<uint64_t>(entries + sizeof(uint64_t) * index);
+  const auto endSentence =
+      load<uint64_t>(entries + sizeof(uint64_t) * (index + 1));
+  if (firstSentence > endSentence || endSentence > sentenceCount) {
+    throw corrupt();
+  }
+
+  PhonemeData phonemeData;
+  for (auto s = firstSentence; s < endSentence; s++) {
+    const auto firstPhrase = load<uint64_t>(sentences + sizeof(uint64_t) * s);
+    const auto endPhrase =
+        load<uint64_t>(sentences + sizeof(uint64_t) * (s + 1));
+    if (firstPhrase > endPhrase || endPhrase > phraseCount) {
+      throw corrupt();
+    }
+
+    auto &sentence = phonemeData.sentences.emplace_back();
+    for (auto p = firstPhrase; p < endPhrase; p++) {
+      const auto record =
+          load<CorpusPhrase>(phrases + sizeof(CorpusPhrase) * p);
+      const auto runOffset = record.runOffset;
+      auto &phrase = sentence.phrases.emplace_back();
+      phrase.silenceSeconds = record.silenceSeconds;
+
+      if (runOffset < sizeof(CorpusHeader) ||
+          runOffset > tablesOffset - sizeof(int64_t)) {
+        throw corrupt();
+      }
+      const auto count = load<int64_t>(file.data() + runOffset);
+      const size_t available =
+          (tablesOffset - runOffset - sizeof(int64_t)) / sizeof(PhonemeId);
+      if (count < 0 || (uint64_t)count > available) {
+        throw corrupt();
+      }
+      const uint8_t *ids = file.data() + runOffset + sizeof(int64_t);
+      phrase.phonemeIds.resize(count);
+      if (count > 0) {
+        memcpy(phrase.phonemeIds.data(), ids, sizeof(PhonemeId) * count);
+      }
+    }
+  }
+
+  return phonemeData;
+} /* entry */
+
+} // namespace piper
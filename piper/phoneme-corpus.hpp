@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include "mapped-file.hpp"
+#include "piper.hpp"
+
+namespace piper {
+
+// Phonemized texts on disk, so phonemizing and synthesizing can run on
+// different machines. Entries are numbered in the order they were added and
+// each holds the PhonemeData of one text.
+//
+// The file is little endian and meant to be memory mapped:
+//   header
+//   ID runs: an int64 count followed by that many int64 IDs, one per phrase
+//   entry index: entries + 1 uint64, first sentence of each entry
+//   sentence index: sentences + 1 uint64, first phrase of each sentence
+//   phrase table: offset of the phrase's ID run and its silence seconds
+// Any entry is decoded without reading the ones before it.
+
+// Appends entries, the file appears under its name once finished
+class PhonemeCorpusWriter {
+public:
+  // numSymbols of the voice, checked by readers
+  PhonemeCorpusWriter(const std::filesystem::path &path, size_t numSymbols);
+  // Discards the file unless finished
+  ~PhonemeCorpusWriter();
+  PhonemeCorpusWriter(const PhonemeCorpusWriter &) = delete;
+  PhonemeCorpusWriter &operator=(const PhonemeCorpusWriter &) = delete;
+
+  void add(const PhonemeData &phonemeData);
+  // Writes the indexes and renames the file into place
+  void finish();
+
+  size_t size() const { return entryIndex.size() - 1; }
+
+private:
+  void write(const void *data, size_t size);
+
+  std::filesystem::path path;
+  std::filesystem::path tempPath;
+  std::ofstream file;
+  uint64_t numSymbols;
+  uint64_t offset = 0;
+  std::vector<uint64_t> entryIndex{0};
+  std::vector<uint64_t> sentenceIndex{0};
+  // Phrase table, written by finish
+  std::vector<uint64_t> phraseOffsets;
+  std::vector<float> phraseSilences;
+  bool finished = false;
+};
+
+// Read-only view of a corpus, safe to use from several threads
+class PhonemeCorpus {
+public:
+  // Throws if the file is not a corpus or is truncated
+  explicit PhonemeCorpus(const std::filesystem::path &path);
+
+  size_t size() const { return entryCount; }
+  size_t numSymbols() const { return symbolCount; }
+
+  // Throws if the entry's records are corrupt
+  PhonemeData entry(size_t index) const;
+
+private:
+  MappedFile file;
+  size_t symbolCount = 0;
+  size_t entryCount = 0;
+  size_t sentenceCount = 0;
+  size_t phraseCount = 0;
+  // End of the ID runs, where the indexes start
+  size_t tablesOffset = 0;
+};
+
+} // namespace piper
@@ -1,16 +1,27 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <cstring>
 #include <fstream>
+#include <future>
 #include <limits>
+#include <numbers>
+#include <random>
 #include <sstream>
 #include <stdexcept>
 
+#include <unistd.h>
+
 #include <espeak-ng/speak_lib.h>
 #include <onnxruntime_cxx_api.h>
 #include <spdlog/spdlog.h>
 #include <nlohmann/json.hpp>
 
 #include "piper.hpp"
+#include "mapped-file.hpp"
+#include "time-stretch.hpp"
 #include "utf8.h"
 #include "wavfile.hpp"
 
@@ -203,10 +214,34 @@ void parseSynthesisConfig(json &configRoot, SynthesisConfig &synthesisConfig) {
 
 } /* parseSynthesisConfig */
 
+// Load extra text replacement rules for the voice
+void parseTextNormalizerConfig(json &configRoot,
+                               TextNormalizer &textNormalizer) {
+  // {
+  //     "text_replacements": {
+  //         "<from text>": "<to text>",
+  //         ...
+  //     }
+  // }
+
+  if (configRoot.contains("text_replacements")) {
+    auto replacementsValue = configRoot["text_replacements"];
+    for (auto &replacementItem : replacementsValue.items()) {
+      textNormalizer.addRule(replacementItem.key(),
+                             replacementItem.value().get<std::string>());
+    }
+  }
+
+} /* parseTextNormalizerConfig */
+
 void parseModelConfig(json &configRoot, ModelConfig &modelConfig) {
 
   modelConfig.numSpeakers = configRoot["num_speakers"].get<SpeakerId>();
 
+  if (configRoot.contains("num_symbols")) {
+    modelConfig.numSymbols = configRoot["num_symbols"].get<size_t>();
+  }
+
   if (configRoot.contains("speaker_id_map")) {
     if (!modelConfig.speakerIdMap) {
       modelConfig.speakerIdMap.emplace();
@@ -251,6 +286,8 @@ void initialize(PiperConfig &config) {
     config.tashkeelState = std::make_unique<tashkeel::State>();
     tashkeel::tashkeel_load(config.tashkeelModelPath.value(),
                             *config.tashkeelState);
+    config.tashkeelCache = std::make_unique<TashkeelCache>(
+        *config.tashkeelState, config.tashkeelCacheSize);
     spdlog::debug("Initialized libtashkeel");
   }
 
@@ -273,6 +310,37 @@ void loadVoice(PiperConfig &config, std::string modelPath,
                std::string encoderPath, std::string decoderPath,
                std::string modelConfigPath, Voice &voice,
                std::optional<SpeakerId> &speakerId, std::string accelerator) {
+  loadVoiceConfig(modelConfigPath, voice, speakerId);
+  loadVoiceModels(config, encoderPath, decoderPath, voice, accelerator);
+  warmupVoice(voice, config.warmupRounds);
+} /* loadVoice */
+
+// Path, size and modification time of a voice file
+// 64 bit FNV-1a over whole words, fast enough to hash large models on startup
+static uint64_t hashModel(std::span<const uint8_t> bytes) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= bytes.size(); i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes.data() + i, sizeof(word));
+    hash = (hash ^ word) * 0x100000001b3ull;
+  }
+  for (; i < bytes.size(); i++) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+static std::string fileFingerprint(const std::string &path) {
+  std::error_code ec;
+  auto size = std::filesystem::file_size(path, ec);
+  auto mtime = std::filesystem::last_write_time(path, ec);
+  return fmt::format("{}:{}:{};", std::filesystem::absolute(path, ec).string(),
+                     size, mtime.time_since_epoch().count());
+}
+
+void loadVoiceConfig(std::string modelConfigPath, Voice &voice,
+                     std::optional<SpeakerId> &speakerId) {
   spdlog::debug("Parsing voice config at {}", modelConfigPath);
   std::ifstream modelConfigFile(modelConfigPath);
   voice.configRoot = json::parse(modelConfigFile);
@@ -280,6 +348,7 @@ void loadVoice(PiperConfig &config, std::string modelPath,
   parsePhonemizeConfig(voice.configRoot, voice.phonemizeConfig);
   parseSynthesisConfig(voice.configRoot, voice.synthesisConfig);
   parseModelConfig(voice.configRoot, voice.modelConfig);
+  parseTextNormalizerConfig(voice.configRoot, voice.textNormalizer);
 
   if (voice.modelConfig.numSpeakers > 1) {
     // Multi-speaker model
@@ -293,7 +362,34 @@ void loadVoice(PiperConfig &config, std::string modelPath,
 
   spdlog::debug("Voice contains {} speaker(s)", voice.modelConfig.numSpeakers);
 
-  voice.encoder.load(encoderPath, accelerator);
+  if (voice.modelConfig.numSymbols == 0) {
+    // Older configs, the model knows at least the mapped IDs
+    for (const auto &[phoneme, ids] : voice.phonemizeConfig.phonemeIdMap) {
+      for (auto id : ids) {
+        voice.modelConfig.numSymbols =
+            std::max(voice.modelConfig.numSymbols, (size_t)id + 1);
+      }
+    }
+  }
+
+  // The models are added by loadVoiceModels
+  voice.fingerprint = fileFingerprint(modelConfigPath);
+  // Of the parsed config, so formatting and the file's location don't matter
+  auto config = voice.configRoot.dump();
+  voice.configDigest = fmt::format(
+      "{:016x}", hashModel({(const uint8_t *)config.data(), config.size()}));
+} /* loadVoiceConfig */
+
+void loadVoiceModels(PiperConfig &config, std::string encoderPath,
+                     std::string decoderPath, Voice &voice,
+                     std::string accelerator) {
+  // Session creation is mostly single threaded graph work, the encoder and
+  // decoder load side by side. Should the decoder throw, the future's
+  // destructor waits for the encoder.
+  voice.encoder.optimizedModelCachePath = config.optimizedModelCachePath;
+  auto encoderLoaded = std::async(std::launch::async, [&]() {
+    voice.encoder.load(encoderPath, accelerator);
+  });
 
   auto extension = std::filesystem::path(decoderPath).extension();
   if(extension == ".rknn") {
@@ -303,10 +399,130 @@ void loadVoice(PiperConfig &config, std::string modelPath,
       throw std::runtime_error("RKNN is not enabled in this build");
 #endif
   }
-  else
-      voice.decoder = std::make_unique<OnnxDecoderInferer>();
+  else {
+      auto decoder = std::make_unique<OnnxDecoderInferer>();
+      decoder->optimizedModelCachePath = config.optimizedModelCachePath;
+      voice.decoder = std::move(decoder);
+  }
   voice.decoder->load(decoderPath, accelerator);
-} /* loadVoice */
+  encoderLoaded.get();
+
+  voice.fingerprint += fileFingerprint(encoderPath);
+  voice.fingerprint += fileFingerprint(decoderPath);
+} /* loadVoiceModels */
+
+// ORT format models carry the flatbuffer file identifier "ORTM" at offset 4
+static bool isOrtFormatModel(const MappedFile &file) {
+  return file.size() >= 8 && memcmp(file.data() + 4, "ORTM", 4) == 0;
+}
+
+// Where the optimized copy of model is cached. Optimizations depend on the
+// model, the ORT version and the execution provider. "ext" marks entries saved
+// at ORT_ENABLE_EXTENDED, older entries may hold CPU specific layouts.
+static std::filesystem::path optimizedModelPath(const std::string &cacheDir,
+                                                const std::string &path,
+                                                const MappedFile &model,
+                                                const std::string &accelerator) {
+  return std::filesystem::path(cacheDir) /
+         fmt::format("{}-{:016x}-ort{}-{}-ext.ort",
+                     std::filesystem::path(path).stem().string(),
+                     hashModel(model.bytes()),
+                     OrtGetApiBase()->GetVersionString(),
+                     accelerator.empty() ? "cpu" : accelerator);
+}
+
+// Session using the model in file. ORT format models are used in place, their
+// weights stay in the mapping and are shared through the page cache by all
+// processes loading the model, so the mapping is handed to mappedModel to
+// outlive the session. ONNX models are parsed into private memory.
+static Ort::Session createMappedSession(Ort::Env &env,
+                                        std::shared_ptr<MappedFile> file,
+                                        Ort::SessionOptions &options,
+                                        std::shared_ptr<MappedFile> &mappedModel) {
+  if (!isOrtFormatModel(*file)) {
+    return Ort::Session(env, file->data(), file->size(), options);
+  }
+
+  options.AddConfigEntry("session.use_ort_model_bytes_directly", "1");
+  options.AddConfigEntry("session.use_ort_model_bytes_for_initializers", "1");
+  Ort::Session session(env, file->data(), file->size(), options);
+  mappedModel = std::move(file);
+  return session;
+}
+
+// Creates the session from a read-only mapping of the model file instead of
+// reading it into the heap. With a cache directory, the graph optimized for
+// accelerator is saved there in ORT format on the first load. Only the
+// extended optimizations are saved, the layout transforms of ORT_ENABLE_ALL
+// are specific to the CPU's instruction set and would break the model on a
+// host without it. They are applied again every time the cached model loads.
+static Ort::Session createSession(Ort::Env &env, const std::string &path,
+                                  Ort::SessionOptions &options,
+                                  std::shared_ptr<MappedFile> &mappedModel,
+                                  const std::optional<std::string> &cacheDir,
+                                  const std::string &accelerator) {
+  auto file = std::make_shared<MappedFile>(path);
+  // TensorRT compiles the graph into engines that can't be saved this way
+  if (!cacheDir || accelerator == "tensorrt" || isOrtFormatModel(*file)) {
+    return createMappedSession(env, file, options, mappedModel);
+  }
+
+  auto cachedPath = optimizedModelPath(*cacheDir, path, *file, accelerator);
+  if (std::filesystem::exists(cachedPath)) {
+    spdlog::debug("Loading optimized model from {}", cachedPath.string());
+    try {
+      return createMappedSession(env, std::make_shared<MappedFile>(cachedPath),
+                                 options, mappedModel);
+    } catch (const std::exception &e) {
+      spdlog::warn("Ignoring unusable optimized model {}: {}",
+                   cachedPath.string(), e.what());
+    }
+  }
+
+  // Written under a unique name and renamed, processes starting at the same
+  // time may race to create it
+  std::filesystem::create_directories(*cacheDir);
+  auto tempPath = cachedPath;
+  tempPath += fmt::format(".{}.tmp.ort", getpid());
+  Ort::SessionOptions savingOptions = options.Clone();
+  savingOptions.SetGraphOptimizationLevel(
+      GraphOptimizationLevel::ORT_ENABLE_EXTENDED);
+  savingOptions.SetOptimizedModelFilePath(tempPath.c_str());
+  std::optional<Ort::Session> session;
+  try {
+    session.emplace(
+        createMappedSession(env, file, savingOptions, mappedModel));
+  } catch (const Ort::Exception &e) {
+    // Some graphs can't be saved after optimization, load without caching
+    spdlog::warn("Cannot cache optimized model {}: {}", cachedPath.string(),
+                 e.what());
+    std::error_code ec;
+    std::filesystem::remove(tempPath, ec);
+    return createMappedSession(env, file, options, mappedModel);
+  }
+
+  std::error_code ec;
+  std::filesystem::rename(tempPath, cachedPath, ec);
+  if (ec) {
+    spdlog::warn("Cannot cache optimized model {}: {}", cachedPath.string(),
+                 ec.message());
+    std::filesystem::remove(tempPath, ec);
+    return std::move(*session);
+  }
+  spdlog::debug("Saved optimized model to {}", cachedPath.string());
+
+  // The saving session lacks the layout transforms, load the cached model as
+  // later starts will
+  try {
+    session.reset();
+    return createMappedSession(env, std::make_shared<MappedFile>(cachedPath),
+                               options, mappedModel);
+  } catch (const std::exception &e) {
+    spdlog::warn("Ignoring unusable optimized model {}: {}",
+                 cachedPath.string(), e.what());
+    return createMappedSession(env, file, options, mappedModel);
+  }
+} /* createSession */
 
 void OnnxDecoderInferer::load(std::string path, std::string accelerator)
 {
@@ -329,7 +545,8 @@ void OnnxDecoderInferer::load(std::string path, std::string accelerator)
     
     //options.DisableCpuMemArena();
     //options.DisableMemPattern();
-    onnx = Ort::Session(env, path.c_str(), options);
+    onnx = createSession(env, path, options, mappedModel,
+                         optimizedModelCachePath, accelerator);
 }
 
 std::vector<int16_t> OnnxDecoderInferer::infer(const xt::xarray<float>& z, const xt::xarray<float>& y_mask, const std::optional<xt::xarray<float>>& g)
@@ -407,7 +624,50 @@ void EncoderInferer::load(std::string path, std::string accelerator)
     
     // Makes encoder slower
     //options.SetExecutionMode(ExecutionMode::ORT_PARALLEL);
-    onnx = Ort::Session(env, path.c_str(), options);
+    onnx = createSession(env, path, options, mappedModel,
+                         optimizedModelCachePath, accelerator);
+
+    bool hasDurationNoise = false, hasLatentNoise = false;
+    for (size_t i = 0; i < onnx.GetInputCount(); i++) {
+      std::string name = onnx.GetInputNameAllocated(i, allocator).get();
+      if (name == "dp_noise") {
+        hasDurationNoise = true;
+      } else if (name == "z_noise") {
+        auto shape = onnx.GetInputTypeInfo(i).GetTensorTypeAndShapeInfo().GetShape();
+        if (shape.size() != 3 || shape[1] <= 0) {
+          throw std::runtime_error("z_noise input must have shape [1, channels, frames]");
+        }
+        hasLatentNoise = true;
+        noiseChannels = shape[1];
+        noiseFrames = shape[2];
+      }
+    }
+    hasNoiseInputs = hasDurationNoise && hasLatentNoise;
+    if (hasDurationNoise != hasLatentNoise) {
+      throw std::runtime_error("Encoder must have both dp_noise and z_noise inputs or neither");
+    }
+    spdlog::debug("Encoder takes noise as input: {}", hasNoiseInputs);
+}
+
+// z_noise frames for models accepting any number. Generous for one phoneme
+// id at length scale 1, even with long pauses and slow speech.
+static constexpr int64_t NOISE_FRAMES_PER_PHONEME = 32;
+
+// Standard normal noise from seed, using Box-Muller. Unlike
+// std::normal_distribution, the result does not depend on the standard
+// library.
+static void fillNormalNoise(std::vector<float> &noise, uint64_t seed) {
+  std::mt19937_64 rng(seed);
+  // Uniform in (0, 1), so the logarithm is finite
+  auto uniform = [&rng]() { return ((rng() >> 11) + 0.5) * 0x1.0p-53; };
+  for (size_t i = 0; i < noise.size(); i += 2) {
+    double radius = std::sqrt(-2.0 * std::log(uniform()));
+    double angle = 2.0 * std::numbers::pi * uniform();
+    noise[i] = (float)(radius * std::cos(angle));
+    if (i + 1 < noise.size()) {
+      noise[i + 1] = (float)(radius * std::sin(angle));
+    }
+  }
 }
 
 std::map<std::string, xt::xarray<float>> EncoderInferer::infer(const std::vector<int64_t> &phonemeIds,
@@ -415,7 +675,8 @@ std::map<std::string, xt::xarray<float>> EncoderInferer::infer(const std::vector
              std::optional<int64_t> sid,
              float noiseScale,
              float lengthScale,
-             float noiseW)
+             float noiseW,
+             std::optional<uint64_t> seed)
 {
   auto memoryInfo = Ort::MemoryInfo::CreateCpu(
       OrtAllocatorType::OrtArenaAllocator, OrtMemType::OrtMemTypeDefault);
@@ -454,8 +715,44 @@ std::map<std::string, xt::xarray<float>> EncoderInferer::infer(const std::vector
   }
 
   // From export_onnx.py
-  std::array<const char *, 4> inputNames = {"input", "input_lengths", "scales",
-                                            "sid"};
+  std::vector<const char *> inputNames = {"input", "input_lengths", "scales"};
+  if (sid.has_value()) {
+    inputNames.push_back("sid");
+  }
+
+  // Must outlive the run as well
+  const int64_t phonemeCount = (int64_t)phonemeIds.size();
+  std::vector<float> durationNoise, latentNoise;
+  std::vector<int64_t> durationNoiseShape, latentNoiseShape;
+  if (hasNoiseInputs) {
+    // Models taking their noise always need it, seeded or not
+    std::random_device device;
+    uint64_t noiseSeed = seed ? *seed : ((uint64_t)device() << 32 | device());
+    int64_t frames = noiseFrames > 0
+                         ? noiseFrames
+                         : (int64_t)std::ceil(phonemeCount * NOISE_FRAMES_PER_PHONEME *
+                                              std::max(lengthScale, 1.0f));
+
+    durationNoiseShape = {1, 2, phonemeCount};
+    durationNoise.resize(2 * phonemeCount);
+    fillNormalNoise(durationNoise, noiseSeed);
+    latentNoiseShape = {1, noiseChannels, frames};
+    latentNoise.resize(noiseChannels * frames);
+    // Separate stream, so the duration noise is not a prefix of it
+    fillNormalNoise(latentNoise, noiseSeed ^ 0x9e3779b97f4a7c15ull);
+
+    inputTensors.push_back(Ort::Value::CreateTensor<float>(
+        memoryInfo, durationNoise.data(), durationNoise.size(),
+        durationNoiseShape.data(), durationNoiseShape.size()));
+    inputNames.push_back("dp_noise");
+    inputTensors.push_back(Ort::Value::CreateTensor<float>(
+        memoryInfo, latentNoise.data(), latentNoise.size(),
+        latentNoiseShape.data(), latentNoiseShape.size()));
+    inputNames.push_back("z_noise");
+  } else if (seed) {
+    throw std::runtime_error(
+        "Encoder has no noise inputs, seeded synthesis is not possible");
+  }
 
   std::vector<std::string> outputNames;
   for (size_t i=0;i<onnx.GetOutputCount();i++)
@@ -501,18 +798,22 @@ std::map<std::string, xt::xarray<float>> EncoderInferer::infer(const std::vector
 
 // ----------------------------------------------------------------------------
 
-// Phase 1: Phonemize text into phoneme IDs, split into sentences and phrases
-PhonemeData phonemize(PiperConfig &config, Voice &voice, std::string text) {
-  PhonemeData phonemeData;
-
-  if (config.useTashkeel) {
-    if (!config.tashkeelState) {
-      throw std::runtime_error("Tashkeel model is not loaded");
-    }
+// Diacritize text with libtashkeel, going through the sentence cache
+static std::string diacritize(PiperConfig &config, const std::string &text) {
+  if (!config.tashkeelState) {
+    throw std::runtime_error("Tashkeel model is not loaded");
+  }
 
-    spdlog::debug("Diacritizing text with libtashkeel: {}", text);
-    text = tashkeel::tashkeel_run(text, *config.tashkeelState);
+  spdlog::debug("Diacritizing text with libtashkeel: {}", text);
+  if (config.tashkeelCache) {
+    return config.tashkeelCache->diacritize(text);
   }
+  return tashkeel::tashkeel_run(text, *config.tashkeelState);
+}
+
+// Phonemize text that is already diacritized (if needed)
+static PhonemeData phonemizeText(Voice &voice, const std::string &text) {
+  PhonemeData phonemeData;
 
   // Phonemes for each sentence
   spdlog::debug("Phonemizing text: {}", text);
@@ -628,38 +929,231 @@ PhonemeData phonemize(PiperConfig &config, Voice &voice, std::string text) {
   }
 
   return phonemeData;
+} /* phonemizeText */
+
+// Phase 1: Phonemize text into phoneme IDs, split into sentences and phrases
+PhonemeData phonemize(PiperConfig &config, Voice &voice, std::string text) {
+  if (config.useTashkeel) {
+    text = diacritize(config, text);
+  }
+
+  return phonemizeText(voice, text);
 } /* phonemize */
 
+PhonemeSentence parsePhonemeSentence(const json &phrases) {
+  if (!phrases.is_array()) {
+    throw std::runtime_error("A sentence must be an array of phrases");
+  }
+
+  PhonemeSentence sentence;
+  for (const auto &phrase : phrases) {
+    auto &parsed = sentence.phrases.emplace_back();
+    const json *ids = &phrase;
+    if (phrase.is_object()) {
+      if (!phrase.contains("phoneme_ids")) {
+        throw std::runtime_error("Phrase is missing phoneme_ids");
+      }
+      ids = &phrase["phoneme_ids"];
+      if (phrase.contains("silence_seconds")) {
+        if (!phrase["silence_seconds"].is_number()) {
+          throw std::runtime_error("silence_seconds must be a number");
+        }
+        parsed.silenceSeconds = phrase["silence_seconds"].get<float>();
+        if (!std::isfinite(parsed.silenceSeconds) ||
+            parsed.silenceSeconds < 0) {
+          throw std::runtime_error("silence_seconds out of range");
+        }
+      }
+    }
+    if (!ids->is_array()) {
+      throw std::runtime_error("A phrase must be an array of phoneme IDs");
+    }
+    for (const auto &id : *ids) {
+      if (!id.is_number_integer()) {
+        throw std::runtime_error("Phoneme IDs must be integers");
+      }
+      parsed.phonemeIds.push_back(id.get<PhonemeId>());
+    }
+  }
+
+  return sentence;
+} /* parsePhonemeSentence */
+
+PhonemeData parsePhonemeData(const json &sentences) {
+  if (!sentences.is_array()) {
+    throw std::runtime_error("phoneme_ids must be an array of sentences");
+  }
+
+  PhonemeData phonemeData;
+  for (const auto &sentence : sentences) {
+    phonemeData.sentences.push_back(parsePhonemeSentence(sentence));
+  }
+
+  return phonemeData;
+} /* parsePhonemeData */
+
+void validatePhonemeData(const Voice &voice, const PhonemeData &phonemeData) {
+  const size_t numSymbols = voice.modelConfig.numSymbols;
+  for (const auto &sentence : phonemeData.sentences) {
+    for (const auto &phrase : sentence.phrases) {
+      if (phrase.phonemeIds.empty()) {
+        throw std::runtime_error("Phrase without phoneme IDs");
+      }
+      for (auto id : phrase.phonemeIds) {
+        if (id < 0 || (size_t)id >= numSymbols) {
+          throw std::runtime_error(
+              fmt::format("Phoneme ID {} is out of range (0 to {})", id,
+                          numSymbols - 1));
+        }
+      }
+    }
+  }
+} /* validatePhonemeData */
+
+// Seed of a phrase's noise. Depends on its phoneme ids rather than its
+// position, so a phrase sounds the same wherever it appears.
+static uint64_t phraseSeed(uint64_t seed, const std::vector<PhonemeId> &phonemeIds) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (auto id : phonemeIds) {
+    hash ^= (uint64_t)id;
+    hash *= 0x100000001b3ull;
+  }
+  // splitmix64 finalizer
+  uint64_t x = seed ^ hash;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+// Everything that goes into the audio of a sentence, except for the length
+// scale which the cache keeps apart
+static std::string sentenceCacheKey(const PhonemeSentence &sentence,
+                                    std::optional<size_t> speakerId,
+                                    float noiseScale, float noiseW,
+                                    std::optional<uint64_t> seed,
+                                    size_t sentenceSilenceSamples) {
+  std::string key;
+  auto append = [&key](const auto &value) {
+    key.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  };
+
+  append(speakerId ? (int64_t)*speakerId : (int64_t)-1);
+  append(noiseScale);
+  append(noiseW);
+  append(seed.has_value());
+  append(seed.value_or(0));
+  append(sentenceSilenceSamples);
+  for (auto &phrase : sentence.phrases) {
+    append(phrase.silenceSeconds);
+    append(phrase.phonemeIds.size());
+    key.append(reinterpret_cast<const char *>(phrase.phonemeIds.data()),
+               phrase.phonemeIds.size() * sizeof(PhonemeId));
+  }
+  return key;
+}
+
 // Phase 2: Synthesize audio from pre-phonemized data
+// Long phrases are decoded in chunks of this many frames, overlapping the
+// neighbouring chunks by the padding
+static constexpr size_t DECODER_CHUNK_SIZE = 45;
+static constexpr size_t DECODER_CHUNK_PADDING = 5;
+
 void synthesize(Voice &voice, const PhonemeData &phonemeData,
                 std::vector<int16_t> &audioBuffer, SynthesisResult &result,
                 const std::function<void()> &audioCallback,
                 std::optional<size_t> speakerId,
                 std::optional<float> noiseScale,
                 std::optional<float> lengthScale,
-                std::optional<float> noiseW) {
+                std::optional<float> noiseW,
+                std::optional<uint64_t> seed,
+                std::optional<float> sentenceSilenceSeconds) {
 
+  const float effectiveSentenceSilence = sentenceSilenceSeconds.value_or(
+      voice.synthesisConfig.sentenceSilenceSeconds);
   std::size_t sentenceSilenceSamples = 0;
-  if (voice.synthesisConfig.sentenceSilenceSeconds > 0) {
+  if (effectiveSentenceSilence > 0) {
     sentenceSilenceSamples = (std::size_t)(
-        voice.synthesisConfig.sentenceSilenceSeconds *
-        voice.synthesisConfig.sampleRate * voice.synthesisConfig.channels);
+        effectiveSentenceSilence * voice.synthesisConfig.sampleRate *
+        voice.synthesisConfig.channels);
   }
 
+  std::optional<size_t> sid = speakerId;
+  if(!sid && voice.synthesisConfig.speakerId)
+    sid = voice.synthesisConfig.speakerId;
+  const float effectiveNoiseScale =
+      noiseScale.value_or(voice.synthesisConfig.noiseScale);
+  const float effectiveLengthScale =
+      lengthScale.value_or(voice.synthesisConfig.lengthScale);
+  const float effectiveNoiseW = noiseW.value_or(voice.synthesisConfig.noiseW);
+  const std::optional<uint64_t> effectiveSeed =
+      seed ? seed : voice.synthesisConfig.seed;
+
+  auto &sentenceCache = voice.sentenceCache;
+  // Audio of the current sentence handed to audioCallback so far
+  std::vector<int16_t> sentenceAudio;
+  auto emitAudio = [&]() {
+    if (sentenceCache) {
+      sentenceAudio.insert(sentenceAudio.end(), audioBuffer.begin(),
+                           audioBuffer.end());
+    }
+    audioCallback();
+  };
+
   for (auto &sentence : phonemeData.sentences) {
+    std::string cacheKey;
+    if (sentenceCache) {
+      cacheKey = sentenceCacheKey(sentence, sid, effectiveNoiseScale,
+                                  effectiveNoiseW, effectiveSeed,
+                                  sentenceSilenceSamples);
+      const size_t start = audioBuffer.size();
+      float cachedLengthScale = 0;
+      auto cached = sentenceCache->lookup(cacheKey, effectiveLengthScale);
+      if (cached) {
+        audioBuffer.insert(audioBuffer.end(), cached->begin(), cached->end());
+      } else if (sentenceCache->stretchTolerance() > 0 &&
+                 (cached = sentenceCache->lookupNearest(
+                      cacheKey, effectiveLengthScale, cachedLengthScale))) {
+        // Re-time the speech, the sentence silence keeps its length
+        const size_t speechSize =
+            cached->size() - std::min(cached->size(), sentenceSilenceSamples);
+        auto stretched = timeStretch(
+            std::span(cached->data(), speechSize),
+            effectiveLengthScale / cachedLengthScale,
+            voice.synthesisConfig.sampleRate);
+        spdlog::debug("Stretched cached sentence from length scale {} to {}",
+                      cachedLengthScale, effectiveLengthScale);
+        audioBuffer.insert(audioBuffer.end(), stretched.begin(),
+                           stretched.end());
+        audioBuffer.insert(audioBuffer.end(), cached->begin() + speechSize,
+                           cached->end());
+      }
+
+      if (cached) {
+        result.audioSeconds += (double)(audioBuffer.size() - start) /
+                               (double)voice.synthesisConfig.sampleRate;
+        if (audioCallback) {
+          audioCallback();
+          audioBuffer.clear();
+        }
+        continue;
+      }
+    }
+    // Without callback the sentence is appended to what is in the buffer
+    const size_t sentenceStart = audioBuffer.size();
+    sentenceAudio.clear();
+
     for (size_t phraseIdx = 0; phraseIdx < sentence.phrases.size(); phraseIdx++) {
       auto &phrase = sentence.phrases[phraseIdx];
 
       // Encoder inference
       auto encode_start = std::chrono::steady_clock::now();
-      std::optional<size_t> sid = speakerId;
-      if(!sid && voice.synthesisConfig.speakerId)
-        sid = voice.synthesisConfig.speakerId;
+      std::optional<uint64_t> noiseSeed;
+      if (effectiveSeed) {
+        noiseSeed = phraseSeed(*effectiveSeed, phrase.phonemeIds);
+      }
       auto params = voice.encoder.infer(phrase.phonemeIds, phrase.phonemeIds.size(),
-                          sid,
-                          noiseScale.value_or(voice.synthesisConfig.noiseScale),
-                          lengthScale.value_or(voice.synthesisConfig.lengthScale),
-                          noiseW.value_or(voice.synthesisConfig.noiseW));
+                          sid, effectiveNoiseScale, effectiveLengthScale,
+                          effectiveNoiseW, noiseSeed);
       auto encode_end = std::chrono::steady_clock::now();
       float encode_seconds = std::chrono::duration<double>(encode_end - encode_start).count();
       std::optional<xt::xarray<float>> g;
@@ -672,8 +1166,8 @@ void synthesize(Voice &voice, const PhonemeData &phonemeData,
       if(nslices != y_mask.shape()[2])
         throw std::runtime_error("z and y_mask must have the same number of slices");
 
-      const size_t chunkSize = 45;
-      const size_t padding = 5;
+      const size_t chunkSize = DECODER_CHUNK_SIZE;
+      const size_t padding = DECODER_CHUNK_PADDING;
 
       float audioSeconds = 0;
       float inferSeconds = encode_seconds;
@@ -681,10 +1175,11 @@ void synthesize(Voice &voice, const PhonemeData &phonemeData,
       // Too small to chunk, just pass it through
       if(nslices < chunkSize + padding * 2) {
           auto t0 = std::chrono::steady_clock::now();
-          audioBuffer = voice.decoder->infer(z, y_mask, g);
+          auto audio = voice.decoder->infer(z, y_mask, g);
           auto t1 = std::chrono::steady_clock::now();
+          audioBuffer.insert(audioBuffer.end(), audio.begin(), audio.end());
           inferSeconds += std::chrono::duration<double>(t1 - t0).count();
-          audioSeconds = (double)audioBuffer.size() / (double)voice.synthesisConfig.sampleRate;
+          audioSeconds = (double)audio.size() / (double)voice.synthesisConfig.sampleRate;
       }
       else {
         for(size_t i=0,idx=0;i<nslices;i+=chunkSize,idx++) {
@@ -744,7 +1239,7 @@ void synthesize(Voice &voice, const PhonemeData &phonemeData,
             std::vector<int16_t> tmp;
             tmp.insert(tmp.end(), audioBuffer.end() - compare_window, audioBuffer.end());
             audioBuffer.resize(audioBuffer.size() - compare_window);
-            audioCallback();
+            emitAudio();
             audioBuffer.resize(tmp.size());
             memcpy(audioBuffer.data(), tmp.data(), tmp.size() * sizeof(int16_t));
           }
@@ -760,9 +1255,9 @@ void synthesize(Voice &voice, const PhonemeData &phonemeData,
             spdlog::debug("First chunk latency: {} seconds", first_chunk_duration);
           }
         }
-        result.audioSeconds += audioSeconds;
-        result.inferSeconds += inferSeconds;
       }
+      result.audioSeconds += audioSeconds;
+      result.inferSeconds += inferSeconds;
 
       // Add end of phrase silence
       std::size_t phraseSilenceSamples = (std::size_t)(
@@ -782,8 +1277,17 @@ void synthesize(Voice &voice, const PhonemeData &phonemeData,
 
     if (audioCallback) {
       // Call back must copy audio since it is cleared afterwards.
-      audioCallback();
+      emitAudio();
       audioBuffer.clear();
+      if (sentenceCache) {
+        sentenceCache->insert(cacheKey, effectiveLengthScale,
+                              std::move(sentenceAudio));
+      }
+    } else if (sentenceCache) {
+      sentenceCache->insert(
+          cacheKey, effectiveLengthScale,
+          std::vector<int16_t>(audioBuffer.begin() + sentenceStart,
+                               audioBuffer.end()));
     }
   }
 
@@ -793,6 +1297,92 @@ void synthesize(Voice &voice, const PhonemeData &phonemeData,
 
 } /* synthesize */
 
+// Phonemes in the made up phrases of warmupVoice, from a word to a long
+// sentence
+static constexpr std::array<size_t, 3> WARMUP_PHONEME_COUNTS = {8, 32, 128};
+
+void warmupVoice(Voice &voice, size_t rounds) {
+  if (rounds == 0) {
+    return;
+  }
+
+  auto &config = voice.phonemizeConfig;
+  std::vector<PhonemeId> symbols;
+  for (const auto &[phoneme, ids] : config.phonemeIdMap) {
+    for (auto id : ids) {
+      if (id != config.idPad && id != config.idBos && id != config.idEos) {
+        symbols.push_back(id);
+      }
+    }
+  }
+  if (symbols.empty()) {
+    symbols.push_back(config.idPad);
+  }
+
+  std::optional<int64_t> sid;
+  if (voice.synthesisConfig.speakerId) {
+    sid = *voice.synthesisConfig.speakerId;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t round = 0; round < rounds; round++) {
+    for (size_t count : WARMUP_PHONEME_COUNTS) {
+      // Laid out like phonemize() does, BOS, the phonemes interspersed with
+      // PAD, EOS
+      std::vector<PhonemeId> phonemeIds{config.idBos};
+      if (config.interspersePad) {
+        phonemeIds.push_back(config.idPad);
+      }
+      for (size_t i = 0; i < count; i++) {
+        phonemeIds.push_back(symbols[(i * 7) % symbols.size()]);
+        if (config.interspersePad) {
+          phonemeIds.push_back(config.idPad);
+        }
+      }
+      phonemeIds.push_back(config.idEos);
+
+      auto params = voice.encoder.infer(
+          phonemeIds, phonemeIds.size(), sid,
+          voice.synthesisConfig.noiseScale, voice.synthesisConfig.lengthScale,
+          voice.synthesisConfig.noiseW);
+      std::optional<xt::xarray<float>> g;
+      if (params.count("g")) {
+        g = std::move(params["g"]);
+      }
+      auto &y_mask = params["y_mask"];
+      auto &z = params["z"];
+      const size_t nslices = z.shape()[2];
+
+      // The shapes synthesize() hands the decoder: short phrases whole, long
+      // ones as a first chunk, middle chunks and a shorter last one
+      std::vector<size_t> widths{nslices};
+      if (nslices >= DECODER_CHUNK_SIZE + DECODER_CHUNK_PADDING * 2) {
+        widths = {DECODER_CHUNK_SIZE + DECODER_CHUNK_PADDING,
+                  DECODER_CHUNK_SIZE + DECODER_CHUNK_PADDING * 2,
+                  DECODER_CHUNK_SIZE / 2 + DECODER_CHUNK_PADDING};
+      }
+      for (size_t width : widths) {
+        auto z_chunk =
+            xt::view(z, xt::all(), xt::all(), xt::range(0, width));
+        auto y_mask_chunk =
+            xt::view(y_mask, xt::all(), xt::all(), xt::range(0, width));
+        voice.decoder->infer(z_chunk, y_mask_chunk, g);
+      }
+    }
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  spdlog::info("Warmed up voice in {} second(s)",
+               std::chrono::duration<double>(end - start).count());
+} /* warmupVoice */
+
+void checkSeed(const Voice &voice, std::optional<uint64_t> seed) {
+  if (seed && !voice.encoder.hasNoiseInputs) {
+    throw std::runtime_error("seed needs a model taking its noise as inputs "
+                             "(dp_noise and z_noise)");
+  }
+} /* checkSeed */
+
 // Phonemize text and synthesize audio
 void textToAudio(PiperConfig &config, Voice &voice, std::string text,
                  std::vector<int16_t> &audioBuffer, SynthesisResult &result,
@@ -800,25 +1390,78 @@ void textToAudio(PiperConfig &config, Voice &voice, std::string text,
                  std::optional<size_t> speakerId,
                  std::optional<float> noiseScale,
                  std::optional<float> lengthScale,
-                 std::optional<float> noiseW) {
+                 std::optional<float> noiseW,
+                 std::optional<uint64_t> seed) {
+
+  if (config.useTashkeel && config.tashkeelOnWorker && config.tashkeelCache &&
+      audioCallback) {
+    auto sentences = splitSentences(text);
+    if (sentences.size() > 1) {
+      // The first sentence is diacritized alone so synthesis can start early,
+      // the rest in one batch while the first one is synthesized. Sentences
+      // end where eSpeak ends them, so phonemizing them one by one gives the
+      // same phonemes as the whole text.
+      auto ready = config.tashkeelCache->diacritizeAhead(std::move(sentences));
+      for (auto &sentence : ready) {
+        auto phonemeData = phonemizeText(voice, sentence.get());
+        synthesize(voice, phonemeData, audioBuffer, result, audioCallback,
+                   speakerId, noiseScale, lengthScale, noiseW, seed);
+      }
+
+      return;
+    }
+  }
 
   auto phonemeData = phonemize(config, voice, text);
   synthesize(voice, phonemeData, audioBuffer, result, audioCallback,
-             speakerId, noiseScale, lengthScale, noiseW);
+             speakerId, noiseScale, lengthScale, noiseW, seed);
 
 } /* textToAudio */
 
+std::string audioStoreKey(const Voice &voice, std::string_view text,
+                          std::optional<size_t> speakerId,
+                          std::optional<float> noiseScale,
+                          std::optional<float> lengthScale,
+                          std::optional<float> noiseW,
+                          std::optional<uint64_t> seed) {
+  auto &synthesisConfig = voice.synthesisConfig;
+  std::optional<size_t> sid = speakerId;
+  if (!sid && synthesisConfig.speakerId) {
+    sid = synthesisConfig.speakerId;
+  }
+
+  // %a keeps every bit of the floats
+  std::string key = fmt::format(
+      "{}|{}|{:a}|{:a}|{:a}|{:a}|", voice.fingerprint, sid ? (int64_t)*sid : -1,
+      noiseScale.value_or(synthesisConfig.noiseScale),
+      lengthScale.value_or(synthesisConfig.lengthScale),
+      noiseW.value_or(synthesisConfig.noiseW),
+      synthesisConfig.sentenceSilenceSeconds);
+  if (auto effectiveSeed = seed ? seed : synthesisConfig.seed) {
+    key += fmt::format("seed={}|", *effectiveSeed);
+  }
+  if (synthesisConfig.phonemeSilenceSeconds) {
+    for (auto &[phoneme, seconds] : *synthesisConfig.phonemeSilenceSeconds) {
+      key += fmt::format("{}={:a},", (uint32_t)phoneme, seconds);
+    }
+  }
+  key += '|';
+  key += text;
+  return key;
+} /* audioStoreKey */
+
 // Phonemize text and synthesize audio to WAV file
 void textToWavFile(PiperConfig &config, Voice &voice, std::string text,
                    std::ostream &audioFile, SynthesisResult &result,
                    std::optional<size_t> speakerId,
                    std::optional<float> noiseScale,
                    std::optional<float> lengthScale,
-                   std::optional<float> noiseW) {
+                   std::optional<float> noiseW,
+                   std::optional<uint64_t> seed) {
 
   std::vector<int16_t> audioBuffer;
-  textToAudio(config, voice, text, audioBuffer, result, NULL, noiseScale,
-              lengthScale, noiseW);
+  textToAudio(config, voice, text, audioBuffer, result, NULL, speakerId,
+              noiseScale, lengthScale, noiseW, seed);
 
   // Write WAV
   auto synthesisConfig = voice.synthesisConfig;
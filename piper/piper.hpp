@@ -3,11 +3,17 @@
 #include <fstream>
 #include <functional>
 #include <map>
+#include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "inferer.hpp"
+#include "mapped-file.hpp"
+#include "sentence-cache.hpp"
+#include "tashkeel-cache.hpp"
+#include "text-normalizer.hpp"
 
 #include <onnxruntime_cxx_api.h>
 #include <piper-phonemize/phoneme_ids.hpp>
@@ -35,6 +41,22 @@ struct PiperConfig {
   bool useTashkeel = false;
   std::optional<std::string> tashkeelModelPath;
   std::unique_ptr<tashkeel::State> tashkeelState;
+
+  // Number of diacritized sentences to remember (0 to disable caching)
+  size_t tashkeelCacheSize = 1024;
+  std::unique_ptr<TashkeelCache> tashkeelCache;
+
+  // Diacritize on a worker thread in textToAudio, so later sentences are
+  // diacritized while earlier ones are synthesized
+  bool tashkeelOnWorker = true;
+
+  // Directory to keep graph optimized ORT format copies of the models in.
+  // Later loads use those and skip optimization.
+  std::optional<std::string> optimizedModelCachePath;
+
+  // Rounds of warmup inference loadVoice runs, so the first requests don't
+  // pay for allocating buffers of each shape (0 to disable)
+  size_t warmupRounds = 0;
 };
 
 enum PhonemeType { eSpeakPhonemes, TextPhonemes };
@@ -69,16 +91,25 @@ struct SynthesisConfig {
   // Extra silence
   float sentenceSilenceSeconds = 0.2f;
   std::optional<std::map<piper::Phoneme, float>> phonemeSilenceSeconds;
+
+  // Seed for the encoder noise. Makes the audio of a text reproducible with
+  // models taking their noise as inputs, see EncoderInferer.
+  std::optional<uint64_t> seed;
 };
 
 struct ModelConfig {
   int numSpeakers;
 
+  // Size of the model's symbol table, phoneme ids are below it
+  size_t numSymbols = 0;
+
   // speaker name -> id
   std::optional<std::map<std::string, SpeakerId>> speakerIdMap;
 };
 
 struct EncoderInferer {
+  // Backs the weights of ORT format models, must outlive the session
+  std::shared_ptr<MappedFile> mappedModel;
   Ort::Session onnx;
   Ort::AllocatorWithDefaultOptions allocator;
   Ort::SessionOptions options;
@@ -89,13 +120,28 @@ struct EncoderInferer {
              std::optional<int64_t> sid,
              float noiseScale,
              float lengthScale,
-             float noiseW);
+             float noiseW,
+             std::optional<uint64_t> seed = std::nullopt);
   virtual void load(std::string modelPath, std::string accelerator="");
 
+  // See PiperConfig::optimizedModelCachePath, set before load()
+  std::optional<std::string> optimizedModelCachePath;
+
+  // Models exported with "dp_noise" [1, 2, phonemes] and "z_noise"
+  // [1, channels, frames] inputs get standard normal noise generated from
+  // the seed, instead of drawing their own. z_noise has at least as many
+  // frames as the output, the model uses the leading ones.
+  bool hasNoiseInputs = false;
+  int64_t noiseChannels = 0;
+  // -1 if the model accepts any number
+  int64_t noiseFrames = -1;
+
   EncoderInferer() : onnx(nullptr){};
 };
 
 struct OnnxDecoderInferer : DecoderInferer {
+  // Backs the weights of ORT format models, must outlive the session
+  std::shared_ptr<MappedFile> mappedModel;
   Ort::Session onnx;
   Ort::AllocatorWithDefaultOptions allocator;
   Ort::SessionOptions options;
@@ -104,6 +150,9 @@ struct OnnxDecoderInferer : DecoderInferer {
   std::vector<int16_t> infer(const xt::xarray<float>& z, const xt::xarray<float>& y_mask, const std::optional<xt::xarray<float>>& g) override;
   void load(std::string modelPath, std::string accelerator) override;
 
+  // See PiperConfig::optimizedModelCachePath, set before load()
+  std::optional<std::string> optimizedModelCachePath;
+
   OnnxDecoderInferer() : onnx(nullptr){};
 };
 
@@ -131,12 +180,22 @@ struct PhonemeData {
 
 struct Voice {
   json configRoot;
+  TextNormalizer textNormalizer;
   PhonemizeConfig phonemizeConfig;
   SynthesisConfig synthesisConfig;
   ModelConfig modelConfig;
 
   EncoderInferer encoder;
   std::unique_ptr<DecoderInferer> decoder;
+
+  // Identifies the loaded model and config files, changes when they do
+  std::string fingerprint;
+
+  // Hash of the config's contents, the same on every host loading it
+  std::string configDigest;
+
+  // Audio of recently synthesized sentences, reused by synthesize() (optional)
+  std::unique_ptr<SentenceCache> sentenceCache;
 };
 
 // True if the string is a single UTF-8 codepoint
@@ -160,6 +219,24 @@ void loadVoice(PiperConfig &config, std::string modelPath,
                std::string modelConfigPath, Voice &voice,
                std::optional<SpeakerId> &speakerId, std::string accelerator);
 
+// The two halves of loadVoice. The config is needed to initialize piper, so
+// the models can load while initialize() runs.
+void loadVoiceConfig(std::string modelConfigPath, Voice &voice,
+                     std::optional<SpeakerId> &speakerId);
+
+// Loads the encoder and decoder concurrently
+void loadVoiceModels(PiperConfig &config, std::string encoderPath,
+                     std::string decoderPath, Voice &voice,
+                     std::string accelerator);
+
+// Runs made up phrases of typical lengths through the encoder and the
+// decoder's chunk shapes. Leaves the caches alone.
+void warmupVoice(Voice &voice, size_t rounds = 1);
+
+// Throws if seed is set but the voice's encoder draws its own noise, which no
+// seed can make reproducible
+void checkSeed(const Voice &voice, std::optional<uint64_t> seed);
+
 // Phonemize text and synthesize audio
 void textToAudio(PiperConfig &config, Voice &voice, std::string text,
                  std::vector<int16_t> &audioBuffer, SynthesisResult &result,
@@ -167,19 +244,42 @@ void textToAudio(PiperConfig &config, Voice &voice, std::string text,
                  std::optional<size_t> speakerId = std::nullopt,
                  std::optional<float> noiseScale = std::nullopt,
                  std::optional<float> lengthScale = std::nullopt,
-                 std::optional<float> noiseW = std::nullopt);
+                 std::optional<float> noiseW = std::nullopt,
+                 std::optional<uint64_t> seed = std::nullopt);
 
 // Phonemize text into phoneme IDs, split into sentences and phrases
 PhonemeData phonemize(PiperConfig &config, Voice &voice, std::string text);
 
-// Synthesize audio from pre-phonemized data
+// Phoneme IDs phonemized elsewhere, as JSON. A sentence is an array of
+// phrases, a phrase either an array of IDs or an object with "phoneme_ids"
+// and optionally "silence_seconds" to insert after it. Throws if malformed.
+PhonemeData parsePhonemeData(const json &sentences);
+PhonemeSentence parsePhonemeSentence(const json &phrases);
+
+// Throws unless the voice can synthesize the data: every phrase has IDs and
+// they are all in the voice's symbol table
+void validatePhonemeData(const Voice &voice, const PhonemeData &phonemeData);
+
+// Synthesize audio from pre-phonemized data. sentenceSilenceSeconds overrides
+// the silence the voice adds after each sentence.
 void synthesize(Voice &voice, const PhonemeData &phonemeData,
                 std::vector<int16_t> &audioBuffer, SynthesisResult &result,
                 const std::function<void()> &audioCallback,
                 std::optional<size_t> speakerId = std::nullopt,
                 std::optional<float> noiseScale = std::nullopt,
                 std::optional<float> lengthScale = std::nullopt,
-                std::optional<float> noiseW = std::nullopt);
+                std::optional<float> noiseW = std::nullopt,
+                std::optional<uint64_t> seed = std::nullopt,
+                std::optional<float> sentenceSilenceSeconds = std::nullopt);
+
+// Key under which the audio for text is kept in an AudioStore. Covers the
+// voice files and every setting that changes the audio.
+std::string audioStoreKey(const Voice &voice, std::string_view text,
+                          std::optional<size_t> speakerId = std::nullopt,
+                          std::optional<float> noiseScale = std::nullopt,
+                          std::optional<float> lengthScale = std::nullopt,
+                          std::optional<float> noiseW = std::nullopt,
+                          std::optional<uint64_t> seed = std::nullopt);
 
 // Phonemize text and synthesize audio to WAV file
 void textToWavFile(PiperConfig &config, Voice &voice, std::string text,
@@ -187,7 +287,8 @@ void textToWavFile(PiperConfig &config, Voice &voice, std::string text,
                    std::optional<size_t> speakerId = std::nullopt,
                    std::optional<float> noiseScale = std::nullopt,
                    std::optional<float> lengthScale = std::nullopt,
-                   std::optional<float> noiseW = std::nullopt);
+                   std::optional<float> noiseW = std::nullopt,
+                   std::optional<uint64_t> seed = std::nullopt);
 
 } // namespace piper
 
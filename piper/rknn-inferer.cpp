@@ -1,4 +1,5 @@
 #include "rknn-inferer.hpp"
+#include "mapped-file.hpp"
 
 #include <spdlog/spdlog.h>
 
@@ -17,26 +18,6 @@ struct Defer
     T f;
 };
 
-static std::vector<uint8_t> loadModel(std::string modelPath)
-{
-    std::ifstream ifs(modelPath, std::ios::binary);
-    if (!ifs.is_open())
-    {
-        std::cout << "open model file failed." << std::endl;
-        return std::vector<uint8_t>();
-    }
-
-    ifs.seekg(0, std::ios::end);
-    size_t size = ifs.tellg();
-    ifs.seekg(0, std::ios::beg);
-
-    std::vector<uint8_t> buf(size);
-    ifs.read(reinterpret_cast<char*>(buf.data()), size);
-    ifs.close();
-
-    return buf;
-}
-
 RknnDecoderInfererImpl::~RknnDecoderInfererImpl()
 {
     if (ctx)
@@ -163,13 +144,14 @@ RknnDecoderInfererImpl::RknnDecoderInfererImpl(RknnDecoderInfererImpl&& other)
 void RknnDecoderInferer::load(std::string modelPath, std::string accelerator)
 {
     (void)accelerator; // ignored, this is for NPU
-    auto model = loadModel(modelPath);
-    if (model.empty())
+    // The runtime copies the model to the NPU, mapping it saves reading it into the heap first
+    piper::MappedFile model(modelPath);
+    if (model.size() == 0)
         throw std::runtime_error("load model failed.");
 
     // enabling sram seems to help with reducing the variance of inference time. no hard evidence though.
     rknn_context ctx;
-    auto ret = rknn_init(&ctx, model.data(), model.size(), 0, nullptr);
+    auto ret = rknn_init(&ctx, const_cast<uint8_t*>(model.data()), model.size(), 0, nullptr);
     if (ret != RKNN_SUCC)
         throw std::runtime_error("rknn_init failed. Error code: " + std::to_string(ret));
 
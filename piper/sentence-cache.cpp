@@ -0,0 +1,111 @@
+#include "sentence-cache.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace piper {
+
+// Rough per entry overhead of the list node, map node and key
+static size_t entrySize(const std::string &key,
+                        const std::vector<int16_t> &audio) {
+  return key.size() + audio.size() * sizeof(int16_t) + 128;
+}
+
+SentenceCache::SentenceCache(size_t capacityBytes, float stretchTolerance)
+    : capacityBytes(capacityBytes), tolerance(stretchTolerance) {}
+
+SentenceCache::AudioPtr SentenceCache::lookup(const std::string &key,
+                                              float lengthScale) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = renditions.find(key);
+  if (it != renditions.end()) {
+    for (auto entry : it->second) {
+      if (entry->lengthScale == lengthScale) {
+        hitCount.fetch_add(1, std::memory_order_relaxed);
+        lru.splice(lru.begin(), lru, entry);
+        return entry->audio;
+      }
+    }
+  }
+
+  // Only counted as a miss once lookupNearest found nothing either
+  if (tolerance <= 0) {
+    missCount.fetch_add(1, std::memory_order_relaxed);
+  }
+  return nullptr;
+}
+
+SentenceCache::AudioPtr SentenceCache::lookupNearest(const std::string &key,
+                                                     float lengthScale,
+                                                     float &cachedLengthScale) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = renditions.find(key);
+  std::list<Entry>::iterator best;
+  float bestDistance = INFINITY;
+  if (it != renditions.end() && lengthScale > 0) {
+    for (auto entry : it->second) {
+      float distance = std::abs(entry->lengthScale / lengthScale - 1.0f);
+      if (distance <= tolerance && distance < bestDistance) {
+        bestDistance = distance;
+        best = entry;
+      }
+    }
+  }
+
+  if (std::isinf(bestDistance)) {
+    missCount.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  stretchCount.fetch_add(1, std::memory_order_relaxed);
+  lru.splice(lru.begin(), lru, best);
+  cachedLengthScale = best->lengthScale;
+  return best->audio;
+}
+
+void SentenceCache::insert(const std::string &key, float lengthScale,
+                           std::vector<int16_t> audio) {
+  const size_t size = entrySize(key, audio);
+  if (size > capacityBytes / 4) {
+    return;
+  }
+
+  auto value = std::make_shared<const std::vector<int16_t>>(std::move(audio));
+  std::lock_guard<std::mutex> lock(mutex);
+  auto [it, inserted] = renditions.try_emplace(key);
+  for (auto entry : it->second) {
+    if (entry->lengthScale == lengthScale) {
+      return;
+    }
+  }
+
+  lru.push_front(Entry{&it->first, lengthScale, std::move(value)});
+  it->second.push_back(lru.begin());
+  usedBytes += size;
+
+  while (usedBytes > capacityBytes) {
+    auto &oldest = lru.back();
+    usedBytes -= entrySize(*oldest.key, *oldest.audio);
+
+    auto rendition = renditions.find(*oldest.key);
+    auto &entries = rendition->second;
+    entries.erase(std::find(entries.begin(), entries.end(),
+                            std::prev(lru.end())));
+    lru.pop_back();
+    if (entries.empty()) {
+      renditions.erase(rendition);
+    }
+  }
+}
+
+size_t SentenceCache::entries() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return lru.size();
+}
+
+size_t SentenceCache::bytes() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return usedBytes;
+}
+
+} // namespace piper
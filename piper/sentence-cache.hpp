@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace piper {
+
+// Memory bounded LRU cache of synthesized sentence audio, keyed by phoneme
+// ids and synthesis settings. The length scale is kept apart from the rest of
+// the key, so renditions of a sentence at other speeds can be found and
+// time-stretched instead of synthesized. Safe to use from several
+// synthesizing threads.
+struct SentenceCache {
+  using AudioPtr = std::shared_ptr<const std::vector<int16_t>>;
+
+  // Renditions within stretchTolerance (relative difference of the length
+  // scales) are stretched to the requested length scale. 0 disables it.
+  explicit SentenceCache(size_t capacityBytes, float stretchTolerance = 0);
+
+  // Audio of the sentence at lengthScale, or nullptr if it is not cached
+  AudioPtr lookup(const std::string &key, float lengthScale);
+
+  // Audio of the sentence at the length scale closest to lengthScale, within
+  // the stretch tolerance. Its length scale is stored in cachedLengthScale.
+  AudioPtr lookupNearest(const std::string &key, float lengthScale,
+                         float &cachedLengthScale);
+
+  void insert(const std::string &key, float lengthScale,
+              std::vector<int16_t> audio);
+
+  float stretchTolerance() const { return tolerance; }
+
+  size_t hits() const { return hitCount.load(std::memory_order_relaxed); }
+  size_t misses() const { return missCount.load(std::memory_order_relaxed); }
+  // Lookups answered by stretching a neighbouring rendition
+  size_t stretched() const {
+    return stretchCount.load(std::memory_order_relaxed);
+  }
+  size_t entries();
+  size_t bytes();
+  size_t capacity() const { return capacityBytes; }
+
+private:
+  struct Entry {
+    // Points into renditions, whose nodes stay put
+    const std::string *key;
+    float lengthScale;
+    AudioPtr audio;
+  };
+
+  size_t capacityBytes;
+  float tolerance;
+  size_t usedBytes = 0;
+
+  std::mutex mutex;
+  // Most recently used at the front
+  std::list<Entry> lru;
+  // Every cached length scale of a sentence
+  std::unordered_map<std::string, std::vector<std::list<Entry>::iterator>>
+      renditions;
+
+  std::atomic<size_t> hitCount{0};
+  std::atomic<size_t> missCount{0};
+  std::atomic<size_t> stretchCount{0};
+};
+
+} // namespace piper
@@ -0,0 +1,290 @@
+#include "tashkeel-cache.hpp"
+
+#include <spdlog/spdlog.h>
+
+namespace piper {
+
+static bool isSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Length of the sentence terminator at the start of text, 0 if there is none
+static size_t terminatorLength(std::string_view text) {
+  switch (text[0]) {
+  case '.':
+  case '!':
+  case '?':
+  case '\n':
+    return 1;
+  }
+
+  // U+061F ARABIC QUESTION MARK and U+06D4 ARABIC FULL STOP
+  if (text.starts_with("؟") || text.starts_with("۔")) {
+    return 2;
+  }
+
+  return 0;
+}
+
+// Whether the terminator at the start of text ends a sentence. Punctuation
+// inside a word or number ("3.5", "e.g.") doesn't
+static size_t sentenceEndLength(std::string_view text) {
+  size_t length = terminatorLength(text);
+  if (length == 0 || text[0] == '\n') {
+    return length;
+  }
+  if (length < text.size() && !isSpace(text[length])) {
+    return 0;
+  }
+  return length;
+}
+
+std::vector<std::string> splitSentences(std::string_view text) {
+  std::vector<std::string> sentences;
+
+  size_t start = 0;
+  size_t i = 0;
+  while (i < text.size()) {
+    size_t length = sentenceEndLength(text.substr(i));
+    if (length == 0) {
+      i++;
+      continue;
+    }
+
+    i += length;
+    while (i < text.size() && isSpace(text[i])) {
+      i++;
+    }
+
+    sentences.emplace_back(text.substr(start, i - start));
+    start = i;
+  }
+
+  if (start < text.size()) {
+    sentences.emplace_back(text.substr(start));
+  }
+
+  return sentences;
+}
+
+TashkeelCache::TashkeelCache(tashkeel::State &state, size_t capacity)
+    : state(state), capacity(capacity) {}
+
+TashkeelCache::~TashkeelCache() {
+  {
+    std::lock_guard<std::mutex> lock(workerMutex);
+    stopping = true;
+  }
+  workAvailable.notify_one();
+  if (worker.joinable()) {
+    worker.join();
+  }
+}
+
+void TashkeelCache::runWorker() {
+  std::unique_lock<std::mutex> lock(workerMutex);
+  while (true) {
+    workAvailable.wait(lock, [&]() { return stopping || !jobs.empty(); });
+    if (jobs.empty()) {
+      return;
+    }
+    auto job = std::move(jobs.front());
+    jobs.pop_front();
+    lock.unlock();
+    job();
+    lock.lock();
+  }
+}
+
+bool TashkeelCache::lookup(const std::string &sentence,
+                           std::string &diacritized) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = index.find(sentence);
+  if (it == index.end()) {
+    return false;
+  }
+
+  entries.splice(entries.begin(), entries, it->second);
+  diacritized = it->second->second;
+  return true;
+}
+
+void TashkeelCache::insert(const std::string &sentence,
+                           const std::string &diacritized) {
+  if (capacity == 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (index.count(sentence) > 0) {
+    return;
+  }
+
+  entries.emplace_front(sentence, diacritized);
+  index[entries.front().first] = entries.begin();
+
+  while (entries.size() > capacity) {
+    index.erase(entries.back().first);
+    entries.pop_back();
+  }
+}
+
+std::vector<std::string> TashkeelCache::diacritizeBatch(
+    const std::vector<std::string> &sentences) {
+  // Only the sentence itself goes through the model. Surrounding whitespace
+  // is kept as is.
+  struct Piece {
+    std::string_view prefix;
+    std::string core;
+    std::string_view suffix;
+    std::string diacritized;
+    bool cached = false;
+  };
+
+  std::vector<Piece> pieces(sentences.size());
+  std::vector<size_t> missing;
+  for (size_t i = 0; i < sentences.size(); i++) {
+    std::string_view sentence = sentences[i];
+    size_t first = 0;
+    while (first < sentence.size() && isSpace(sentence[first])) {
+      first++;
+    }
+    size_t last = sentence.size();
+    while (last > first && isSpace(sentence[last - 1])) {
+      last--;
+    }
+
+    auto &piece = pieces[i];
+    piece.prefix = sentence.substr(0, first);
+    piece.core = sentence.substr(first, last - first);
+    piece.suffix = sentence.substr(last);
+
+    if (piece.core.empty() || lookup(piece.core, piece.diacritized)) {
+      piece.cached = true;
+    } else {
+      missing.push_back(i);
+    }
+  }
+
+  hitCount.fetch_add(sentences.size() - missing.size(),
+                     std::memory_order_relaxed);
+  missCount.fetch_add(missing.size(), std::memory_order_relaxed);
+
+  if (missing.size() == 1) {
+    auto &piece = pieces[missing[0]];
+    piece.diacritized = tashkeel::tashkeel_run(piece.core, state);
+  } else if (missing.size() > 1) {
+    // One model run for every missing sentence, separated by new lines
+    std::string batch;
+    for (auto i : missing) {
+      if (!batch.empty()) {
+        batch += '\n';
+      }
+      batch += pieces[i].core;
+    }
+
+    spdlog::debug("Diacritizing {} sentence(s) with libtashkeel",
+                  missing.size());
+    auto diacritized = tashkeel::tashkeel_run(batch, state);
+
+    std::vector<std::string> lines;
+    size_t start = 0;
+    while (true) {
+      auto end = diacritized.find('\n', start);
+      lines.push_back(diacritized.substr(start, end - start));
+      if (end == std::string::npos) {
+        break;
+      }
+      start = end + 1;
+    }
+
+    if (lines.size() == missing.size()) {
+      for (size_t j = 0; j < missing.size(); j++) {
+        pieces[missing[j]].diacritized = std::move(lines[j]);
+      }
+    } else {
+      // The model did not keep our separators. Fall back to one run each.
+      spdlog::warn("libtashkeel changed sentence boundaries, diacritizing "
+                   "{} sentence(s) one by one",
+                   missing.size());
+      for (auto i : missing) {
+        pieces[i].diacritized = tashkeel::tashkeel_run(pieces[i].core, state);
+      }
+    }
+  }
+
+  std::vector<std::string> results;
+  results.reserve(pieces.size());
+  for (auto &piece : pieces) {
+    if (!piece.cached) {
+      insert(piece.core, piece.diacritized);
+    }
+
+    std::string result;
+    result.reserve(piece.prefix.size() + piece.diacritized.size() +
+                   piece.suffix.size());
+    result += piece.prefix;
+    result += piece.diacritized;
+    result += piece.suffix;
+    results.push_back(std::move(result));
+  }
+
+  return results;
+}
+
+std::string TashkeelCache::diacritize(std::string_view text) {
+  std::string result;
+  for (auto &sentence : diacritizeBatch(splitSentences(text))) {
+    result += sentence;
+  }
+  return result;
+}
+
+std::vector<std::future<std::string>>
+TashkeelCache::diacritizeAhead(std::vector<std::string> sentences) {
+  // The job owns everything it touches, callers may stop waiting early
+  struct Job {
+    std::vector<std::string> sentences;
+    std::vector<std::promise<std::string>> diacritized;
+  };
+  auto job = std::make_shared<Job>();
+  job->sentences = std::move(sentences);
+  job->diacritized.resize(job->sentences.size());
+
+  std::vector<std::future<std::string>> ready;
+  for (auto &promise : job->diacritized) {
+    ready.push_back(promise.get_future());
+  }
+  if (ready.empty()) {
+    return ready;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(workerMutex);
+    jobs.push_back([this, job]() {
+      auto &sentences = job->sentences;
+      size_t done = 0;
+      try {
+        job->diacritized[0].set_value(diacritize(sentences[0]));
+        done = 1;
+
+        std::vector<std::string> rest(sentences.begin() + 1, sentences.end());
+        for (auto &sentence : diacritizeBatch(rest)) {
+          job->diacritized[done++].set_value(std::move(sentence));
+        }
+      } catch (...) {
+        for (; done < job->diacritized.size(); done++) {
+          job->diacritized[done].set_exception(std::current_exception());
+        }
+      }
+    });
+    if (!worker.joinable()) {
+      worker = std::thread(&TashkeelCache::runWorker, this);
+    }
+  }
+  workAvailable.notify_one();
+
+  return ready;
+}
+
+} // namespace piper
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <piper-phonemize/tashkeel.hpp>
+
+namespace piper {
+
+// Split text after sentence ending punctuation (including the Arabic
+// question mark) followed by whitespace or the end of the text, and after new
+// lines. Like eSpeak, "3.5" or "e.g." don't end a sentence. Whitespace
+// following a sentence stays with it, so concatenating the pieces gives back
+// the original text.
+std::vector<std::string> splitSentences(std::string_view text);
+
+// Sentence level LRU cache in front of libtashkeel. Sentences that are not in
+// the cache are diacritized together in a single model run.
+struct TashkeelCache {
+  TashkeelCache(tashkeel::State &state, size_t capacity);
+  // Waits for the worker to finish queued work
+  ~TashkeelCache();
+
+  // Diacritize text, looking up each of its sentences in the cache
+  std::string diacritize(std::string_view text);
+
+  // Diacritize each sentence. Cache misses are batched into one model run.
+  std::vector<std::string> diacritizeBatch(
+      const std::vector<std::string> &sentences);
+
+  // Diacritize sentences on the cache's worker thread, the first one alone so
+  // it is ready early and the rest in one batch. The futures are fulfilled in
+  // order, so callers can start on the first sentence while the others are
+  // diacritized.
+  std::vector<std::future<std::string>>
+  diacritizeAhead(std::vector<std::string> sentences);
+
+  size_t hits() const { return hitCount.load(std::memory_order_relaxed); }
+  size_t misses() const { return missCount.load(std::memory_order_relaxed); }
+
+private:
+  bool lookup(const std::string &sentence, std::string &diacritized);
+  void insert(const std::string &sentence, const std::string &diacritized);
+
+  tashkeel::State &state;
+  size_t capacity;
+
+  std::mutex mutex;
+  // Most recently used at the front
+  std::list<std::pair<std::string, std::string>> entries;
+  std::unordered_map<std::string_view, decltype(entries)::iterator> index;
+
+  std::atomic<size_t> hitCount{0};
+  std::atomic<size_t> missCount{0};
+
+  // Started by the first diacritizeAhead, requests queue up for it
+  void runWorker();
+  std::mutex workerMutex;
+  std::condition_variable workAvailable;
+  std::deque<std::function<void()>> jobs;
+  bool stopping = false;
+  std::thread worker;
+};
+
+} // namespace piper
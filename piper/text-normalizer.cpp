@@ -0,0 +1,119 @@
+#include "text-normalizer.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace piper {
+
+static constexpr const char *WHITESPACE = " \n\r\t";
+static constexpr const char *PUNCTUATION = ".,!?;:";
+
+TextNormalizer::TextNormalizer()
+    : rules{
+          // Handle unicode characters that piper can't handle
+          {"…", ","},
+          {"“", "\""},
+          {"”", "\""},
+          {"‘", "'"},
+          {"’", "'"},
+          {"—", ", "},
+          {" - ", ", "},
+          // The em dash replacement followed by "- " forms " - ", which gets
+          // replaced again. Keep that behaviour of the old multi-pass code.
+          {"—- ", ",, "},
+      } {
+  rebuildIndex();
+}
+
+void TextNormalizer::addRule(std::string from, std::string to) {
+  if (from.empty()) {
+    throw std::runtime_error("Text replacement pattern must not be empty");
+  }
+
+  auto it = std::find_if(rules.begin(), rules.end(),
+                         [&](const Rule &rule) { return rule.from == from; });
+  if (it != rules.end()) {
+    it->to = std::move(to);
+  } else {
+    rules.push_back({std::move(from), std::move(to)});
+  }
+  rebuildIndex();
+}
+
+void TextNormalizer::rebuildIndex() {
+  for (auto &bucket : rulesByFirstByte) {
+    bucket.clear();
+  }
+
+  for (size_t i = 0; i < rules.size(); i++) {
+    rulesByFirstByte[(unsigned char)rules[i].from[0]].push_back(i);
+  }
+
+  for (auto &bucket : rulesByFirstByte) {
+    std::stable_sort(bucket.begin(), bucket.end(), [this](size_t a, size_t b) {
+      return rules[a].from.size() > rules[b].from.size();
+    });
+  }
+}
+
+void TextNormalizer::normalize(std::string_view text, std::string &out) const {
+  out.clear();
+
+  // trim leading and tailing spaces
+  auto first = text.find_first_not_of(WHITESPACE);
+  auto last = text.find_last_not_of(WHITESPACE);
+  if (first != std::string_view::npos) {
+    text = text.substr(first, last - first + 1);
+  }
+
+  if (text.empty()) {
+    out = ",";
+    return;
+  }
+
+  // append a comma if the text does not end with a punctuation
+  bool needsComma = (strchr(PUNCTUATION, text.back()) == nullptr);
+  out.reserve(text.size() + 1);
+
+  size_t i = 0;
+  while (i < text.size()) {
+    const auto &candidates = rulesByFirstByte[(unsigned char)text[i]];
+    const Rule *match = nullptr;
+    for (auto ruleIdx : candidates) {
+      const auto &from = rules[ruleIdx].from;
+      if (text.compare(i, from.size(), from) == 0) {
+        match = &rules[ruleIdx];
+        break;
+      }
+    }
+
+    if (match) {
+      out += match->to;
+      i += match->from.size();
+    } else if (text[i] == '.') {
+      // Piper have no idea how to process ... and .. so we convert them to ,
+      size_t count = 1;
+      while (i + count < text.size() && text[i + count] == '.') {
+        count++;
+      }
+      out += (count == 1) ? '.' : ',';
+      i += count;
+    } else {
+      out += text[i];
+      i++;
+    }
+  }
+
+  if (needsComma) {
+    out += ',';
+  }
+}
+
+std::string TextNormalizer::normalize(std::string_view text) const {
+  std::string out;
+  normalize(text, out);
+  return out;
+}
+
+} // namespace piper
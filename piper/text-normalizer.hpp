@@ -0,0 +1,45 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace piper {
+
+// Cleans up text before phonemization in a single pass over the UTF-8 input.
+// - Leading and trailing whitespace is trimmed
+// - A comma is appended if the text does not end with punctuation
+// - Runs of two or more dots become a comma (Piper can't handle ... and ..)
+// - Characters Piper can't handle are replaced according to a rule table
+//
+// Replacement rules are indexed by their first byte and the longest matching
+// rule wins, so each input byte is looked at once no matter how many rules
+// there are.
+struct TextNormalizer {
+  struct Rule {
+    std::string from;
+    std::string to;
+  };
+
+  // Creates a normalizer with the built-in rules
+  TextNormalizer();
+
+  // Add a replacement rule. Replaces an existing rule with the same pattern.
+  void addRule(std::string from, std::string to);
+
+  // Normalize text into out. out is cleared first but keeps its capacity, so
+  // the same buffer can be reused across calls without allocating.
+  void normalize(std::string_view text, std::string &out) const;
+  std::string normalize(std::string_view text) const;
+
+  std::vector<Rule> rules;
+
+private:
+  void rebuildIndex();
+
+  // Rule indices by first byte of the pattern, longest pattern first
+  std::array<std::vector<size_t>, 256> rulesByFirstByte;
+};
+
+} // namespace piper
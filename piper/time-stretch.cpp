@@ -0,0 +1,93 @@
+#include "time-stretch.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+
+namespace piper {
+
+// Frames of 20 ms, overlapping by half. Each frame may move up to a quarter
+// frame from its nominal position to line up with the previous one.
+static constexpr double FRAME_SECONDS = 0.02;
+
+std::vector<int16_t> timeStretch(std::span<const int16_t> input, double ratio,
+                                 int sampleRate) {
+  const size_t outputSize = (size_t)std::llround(input.size() * ratio);
+  const size_t frameSize =
+      std::max<size_t>(2 * (size_t)(FRAME_SECONDS * sampleRate / 2), 16);
+  const size_t hop = frameSize / 2;
+  const size_t tolerance = frameSize / 4;
+
+  if (std::abs(ratio - 1.0) < 1e-6) {
+    return std::vector<int16_t>(input.begin(), input.end());
+  }
+  if (input.size() < 2 * frameSize) {
+    // Too short for overlap-add, resample by index instead
+    std::vector<int16_t> output(outputSize);
+    for (size_t i = 0; i < outputSize; i++) {
+      output[i] = input[std::min(input.size() - 1, (size_t)(i / ratio))];
+    }
+    return output;
+  }
+
+  std::vector<float> window(frameSize);
+  for (size_t i = 0; i < frameSize; i++) {
+    window[i] =
+        0.5f - 0.5f * (float)std::cos(2 * std::numbers::pi * i / frameSize);
+  }
+
+  auto sample = [&](ptrdiff_t i) -> float {
+    return (i >= 0 && (size_t)i < input.size()) ? (float)input[i] : 0.0f;
+  };
+
+  std::vector<float> output(outputSize + frameSize, 0.0f);
+  std::vector<float> weight(outputSize + frameSize, 0.0f);
+  const double analysisHop = hop / ratio;
+  // Input position of the previous frame as it was actually copied
+  ptrdiff_t previous = 0;
+
+  for (size_t k = 0; k * hop < outputSize; k++) {
+    const ptrdiff_t nominal = (ptrdiff_t)std::llround(k * analysisHop);
+    ptrdiff_t position = nominal;
+
+    if (k > 0) {
+      // Pick the frame that continues the previous one most naturally: the
+      // input right after the previous frame's first half is what overlaps
+      // with the new frame's first half in the output.
+      const ptrdiff_t natural = previous + (ptrdiff_t)hop;
+      float best = -INFINITY;
+      const ptrdiff_t first = std::max<ptrdiff_t>(0, nominal - (ptrdiff_t)tolerance);
+      const ptrdiff_t last = nominal + (ptrdiff_t)tolerance;
+      for (ptrdiff_t candidate = first; candidate <= last; candidate++) {
+        float correlation = 0, energy = 0;
+        for (size_t i = 0; i < hop; i++) {
+          float x = sample(candidate + i);
+          correlation += x * sample(natural + i);
+          energy += x * x;
+        }
+        // Normalized, so loud candidates do not win by volume alone
+        float score = correlation / std::sqrt(energy + 1.0f);
+        if (score > best) {
+          best = score;
+          position = candidate;
+        }
+      }
+    }
+
+    const size_t out = k * hop;
+    for (size_t i = 0; i < frameSize; i++) {
+      output[out + i] += window[i] * sample(position + i);
+      weight[out + i] += window[i];
+    }
+    previous = position;
+  }
+
+  std::vector<int16_t> result(outputSize);
+  for (size_t i = 0; i < outputSize; i++) {
+    float value = weight[i] > 1e-3f ? output[i] / weight[i] : 0.0f;
+    result[i] = (int16_t)std::clamp(std::lround(value), -32768l, 32767l);
+  }
+  return result;
+} /* timeStretch */
+
+} // namespace piper
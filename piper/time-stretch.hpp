@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace piper {
+
+// Change the duration of speech by ratio (output / input length) without
+// changing its pitch, using waveform similarity overlap-add (WSOLA). Meant
+// for ratios close to 1, such as re-timing audio to a nearby length scale.
+std::vector<int16_t> timeStretch(std::span<const int16_t> input, double ratio,
+                                 int sampleRate);
+
+} // namespace piper
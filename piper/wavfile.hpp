@@ -24,7 +24,7 @@ struct WavHeader {
 };
 
 // Write WAV file header only
-void writeWavHeader(int sampleRate, int sampleWidth, int channels,
+inline void writeWavHeader(int sampleRate, int sampleWidth, int channels,
                     uint32_t numSamples, std::ostream &audioFile) {
   WavHeader header;
   header.dataSize = numSamples * sampleWidth * channels;